@@ -0,0 +1,280 @@
+﻿#include <QtConcurrent>
+#include <QJsonDocument>
+#include <QImageWriter>
+#include <QFileInfo>
+#include <QFile>
+#include <QDir>
+#include <QHash>
+#include <QElapsedTimer>
+#include <QThread>
+#include <stdio.h>
+
+#include "batchprocessor.h"
+#include "opencvprocess.h"
+#include "imagesaver.h"
+
+static const char *usage =
+        "usage: pmig --batch recipe.json [--jobs N] [--output-dir dir] [--format png] image...\n";
+
+BatchProcessor::BatchProcessor()
+    :format("png"), outputDir(".")
+{
+    ;
+}
+
+bool BatchProcessor::loadRecipe(const QString &fileName, QString *error)
+{
+    QFile file(fileName);
+    if(!file.open(QFile::ReadOnly))
+    {
+        *error = file.errorString();
+        return false;
+    }
+
+    QJsonParseError parseError;
+    QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &parseError);
+    if(!document.isObject())
+    {
+        *error = parseError.errorString();
+        return false;
+    }
+
+    QJsonObject recipe = document.object();
+    operations = recipe.value("operations").toArray();
+    if(recipe.contains("format"))
+        format = recipe.value("format").toString().toLower().toLatin1();
+    suffix = recipe.value("suffix").toString();
+
+    // checked up front, not after the first thousand files
+    QStringList known = QStringList() << "line" << "erase" << "newLayer" << "overlay";
+    foreach(const QJsonValue &value, operations)
+    {
+        QString op = value.toObject().value("op").toString();
+        if(!known.contains(op))
+        {
+            *error = QString("unknown operation \"%1\"").arg(op);
+            return false;
+        }
+        int width = value.toObject().value("width").toInt(5);
+        if(op == "line" && (width < 1 || width > BrushEngine::MaxSize))
+        {
+            *error = QString("line width %1 is not within 1 to %2").arg(width).arg(BrushEngine::MaxSize);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BatchProcessor::apply(OpencvProcess *process, const QJsonObject &operation, QString *error)
+{
+    QString op = operation.value("op").toString();
+    if(op == "line")
+    {
+        QJsonArray points = operation.value("points").toArray();
+        // not the tool panel's settings, the jobs run side by side
+        BrushEngine::Settings settings;
+        settings.shape = BrushEngine::Round;
+        settings.size = operation.value("width").toInt(5);
+        settings.antiAliasing = operation.value("antiAliasing").toBool(true);
+        settings.hardness = operation.value("hardness").toInt(80);
+        settings.opacity = operation.value("brushOpacity").toInt(100);
+        settings.flow = operation.value("flow").toInt(100);
+        settings.spacing = operation.value("spacing").toInt(10);
+        QColor color = process->fgColor;
+        if(operation.contains("color"))
+            color = QColor(operation.value("color").toString());
+        for(int i = 1; i < points.size(); i++)
+        {
+            QJsonArray from = points.at(i-1).toArray(), to = points.at(i).toArray();
+            QLineF line(from.at(0).toInt(), from.at(1).toInt(), to.at(0).toInt(), to.at(1).toInt());
+            process->drawSegment(StrokeSegment(line), settings, color);
+        }
+        process->endStroke();
+    }
+    else if(op == "erase")
+    {
+        QJsonArray rect = operation.value("rect").toArray();
+        int x = rect.at(0).toInt(), y = rect.at(1).toInt();
+        process->eraseRect(cvPoint(x, y), cvPoint(x + rect.at(2).toInt() - 1, y + rect.at(3).toInt() - 1));
+    }
+    else if(op == "newLayer")
+    {
+        process->addLayer();
+    }
+    else if(op == "overlay")
+    {
+        QString fileName = operation.value("file").toString();
+        if(!process->openImage(fileName.toLocal8Bit().constData()))
+        {
+            *error = QString("unable to load %1").arg(fileName);
+            return false;
+        }
+    }
+
+    // new layers may come with their properties
+    Layer &layer = process->layerStack[process->currentImageNum];
+    if(operation.contains("opacity"))
+        layer.opacity = qBound(0.0, operation.value("opacity").toDouble(), 1.0);
+    if(operation.contains("blendMode"))
+    {
+        int mode = Layer::blendModeNames().indexOf(operation.value("blendMode").toString());
+        if(mode < 0)
+        {
+            *error = QString("unknown blend mode %1").arg(operation.value("blendMode").toString());
+            return false;
+        }
+        layer.blendMode = Layer::BlendMode(mode);
+    }
+    return true;
+}
+
+QString BatchProcessor::outputNameFor(const QString &fileName) const
+{
+    return QDir(outputDir).filePath(QFileInfo(fileName).completeBaseName() + suffix + "." + format);
+}
+
+bool BatchProcessor::processFile(OpencvProcess *process, const QString &fileName,
+                                 QString *outputName, QString *error)
+{
+    QFileInfo input(fileName);
+    *outputName = outputNameFor(fileName);
+    if(QFileInfo(*outputName).absoluteFilePath() == input.absoluteFilePath())
+    {
+        *error = "the output would overwrite the input";
+        return false;
+    }
+
+    if(!process->openImage(fileName.toLocal8Bit().constData()))
+    {
+        *error = "unable to load";
+        return false;
+    }
+
+    foreach(const QJsonValue &value, operations)
+        if(!apply(process, value.toObject(), error)) return false;
+
+    if(!process->saveImage(outputName->toLocal8Bit().constData(), format.constData()))
+    {
+        *error = "unable to save";
+        return false;
+    }
+    return true;
+}
+
+void BatchProcessor::runJob(OpencvProcess *process, const QString &fileName)
+{
+    QString outputName, error;
+    bool ok = processFile(process, fileName, &outputName, &error);
+    if(!ok) failures.ref();
+    bool isReduced = ok && ImageSaver::reducesDepth(process->layerStack, format);
+
+    {
+        QMutexLocker locker(&outputMutex);
+        if(ok)
+            fprintf(stdout, "ok %s -> %s%s\n", fileName.toLocal8Bit().constData(),
+                    outputName.toLocal8Bit().constData(), isReduced ? " (reduced to 8 bits)" : "");
+        else
+            fprintf(stderr, "failed %s: %s\n", fileName.toLocal8Bit().constData(),
+                    error.toLocal8Bit().constData());
+    }
+
+    // the tiles go now, not when the next file reuses the process
+    process->layerStack.clear();
+    process->currentImageNum = -1;
+
+    QMutexLocker locker(&idleMutex);
+    idle.append(process);
+    freeSlots.release();
+}
+
+int BatchProcessor::run(const QStringList &arguments)
+{
+    QString recipeName;
+    QStringList files;
+    QByteArray formatOverride;
+    int jobs = QThread::idealThreadCount();
+    for(int i = 1; i < arguments.size(); i++)
+    {
+        const QString &argument = arguments.at(i);
+        bool hasValue = i + 1 < arguments.size();
+        if(argument == "--batch" && hasValue)
+            recipeName = arguments.at(++i);
+        else if(argument == "--jobs" && hasValue)
+            jobs = arguments.at(++i).toInt();
+        else if(argument == "--output-dir" && hasValue)
+            outputDir = arguments.at(++i);
+        else if(argument == "--format" && hasValue)
+            formatOverride = arguments.at(++i).toLower().toLatin1();
+        else
+            files.append(argument);
+    }
+    if(recipeName.isEmpty() || files.isEmpty() || jobs <= 0)
+    {
+        fprintf(stderr, "%s", usage);
+        return 2;
+    }
+
+    QString error;
+    if(!loadRecipe(recipeName, &error))
+    {
+        fprintf(stderr, "%s: %s\n", recipeName.toLocal8Bit().constData(), error.toLocal8Bit().constData());
+        return 2;
+    }
+    if(!formatOverride.isEmpty())
+        format = formatOverride;
+    if(!QImageWriter::supportedImageFormats().contains(format))
+    {
+        fprintf(stderr, "unsupported format %s\n", format.constData());
+        return 2;
+    }
+
+    // inputs of the same name from different directories would race for
+    // one output, checked before anything is written
+    QHash<QString, QString> inputFor;
+    foreach(const QString &fileName, files)
+    {
+        QString outputName = QFileInfo(outputNameFor(fileName)).absoluteFilePath();
+        if(inputFor.contains(outputName))
+        {
+            fprintf(stderr, "%s and %s would both be written to %s\n",
+                    inputFor.value(outputName).toLocal8Bit().constData(),
+                    fileName.toLocal8Bit().constData(), outputName.toLocal8Bit().constData());
+            return 2;
+        }
+        inputFor.insert(outputName, fileName);
+    }
+
+    if(!QDir().mkpath(outputDir))
+    {
+        fprintf(stderr, "unable to create %s\n", outputDir.toLocal8Bit().constData());
+        return 1;
+    }
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(jobs);
+    for(int i = 0; i < jobs; i++)
+        idle.append(new OpencvProcess(0));
+    freeSlots.release(jobs);
+
+    // blocks here while every process is busy, so at most jobs images are
+    // decoded at a time however long the list is
+    QElapsedTimer timer;
+    timer.start();
+    foreach(const QString &fileName, files)
+    {
+        freeSlots.acquire();
+        OpencvProcess *process;
+        {
+            QMutexLocker locker(&idleMutex);
+            process = idle.takeLast();
+        }
+        QtConcurrent::run(&pool, this, &BatchProcessor::runJob, process, fileName);
+    }
+    pool.waitForDone();
+    qDeleteAll(idle);
+
+    int failed = failures.load();
+    fprintf(stderr, "%d of %d images done in %.1f s\n", files.size() - failed, files.size(),
+            timer.elapsed() / 1000.0);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,66 @@
+﻿#ifndef BATCHPROCESSOR_H
+#define BATCHPROCESSOR_H
+
+#include <QStringList>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QMutex>
+#include <QSemaphore>
+#include <QAtomicInt>
+
+class OpencvProcess;
+
+/* pmig --batch recipe.json [--jobs N] [--output-dir dir] [--format png] image...
+ *
+ * Applies the recipe to every image and writes the results, no window is
+ * shown. A recipe is a JSON object:
+ *
+ *   {
+ *     "operations": [
+ *       {"op": "line", "points": [[10, 10], [200, 80]], "width": 5, "antiAliasing": true,
+ *        "color": "#3366cc", "hardness": 80, "brushOpacity": 100, "flow": 100, "spacing": 10},
+ *       {"op": "erase", "rect": [0, 0, 64, 64]},
+ *       {"op": "newLayer", "opacity": 0.5, "blendMode": "Multiply"},
+ *       {"op": "overlay", "file": "logo.png", "blendMode": "Screen"}
+ *     ],
+ *     "format": "png",
+ *     "suffix": "_out"
+ *   }
+ *
+ * Images load, change and save through OpencvProcess, as in the editor, so
+ * erase leaves 16-bit and float grey images as they are. A 16-bit image
+ * with no layers added keeps its depth in PNG and TIFF, the other native
+ * depth images are reported as reduced to 8 bits, see ImageSaver.
+ * Files are processed on a thread pool, with at most --jobs of them in
+ * memory at once.
+ */
+class BatchProcessor
+{
+public:
+    BatchProcessor();
+
+    int run(const QStringList &arguments);
+
+private:
+    QJsonArray operations;
+    QByteArray format;
+    QString suffix;
+    QString outputDir;
+
+    // one OpencvProcess per job, made on the GUI thread as it is a widget
+    QMutex idleMutex;
+    QList<OpencvProcess*> idle;
+    QSemaphore freeSlots;
+    QAtomicInt failures;
+
+    QMutex outputMutex;
+
+    bool loadRecipe(const QString &fileName, QString *error);
+    void runJob(OpencvProcess *process, const QString &fileName);
+    QString outputNameFor(const QString &fileName) const;
+    bool processFile(OpencvProcess *process, const QString &fileName, QString *outputName,
+                     QString *error);
+    bool apply(OpencvProcess *process, const QJsonObject &operation, QString *error);
+};
+
+#endif // BATCHPROCESSOR_H
@@ -0,0 +1,278 @@
+﻿#include <QApplication>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QFile>
+#include <QThread>
+#include <QtMath>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "benchmark.h"
+#include "scribblearea.h"
+#include "pixelkernels.h"
+
+Benchmark::Benchmark()
+{
+    megapixels << 1 << 4 << 16 << 64 << 200;
+    brushSizes << 1 << 2 << 5 << 10 << 20 << 50 << 100;
+}
+
+QList<int> Benchmark::parseList(const QString &text)
+{
+    QList<int> values;
+    foreach(const QString &item, text.split(',', QString::SkipEmptyParts))
+    {
+        bool ok;
+        int value = item.toInt(&ok);
+        if(ok && value > 0) values.append(value);
+    }
+    return values;
+}
+
+void Benchmark::record(const QString &path, int mp, const QSize &size, int brushSize,
+                       const QVector<qint64> &samples)
+{
+    qint64 total = 0, least = samples.first(), most = samples.first();
+    foreach(qint64 sample, samples)
+    {
+        total += sample;
+        least = qMin(least, sample);
+        most = qMax(most, sample);
+    }
+
+    QJsonObject result;
+    result["path"] = path;
+    result["megapixels"] = mp;
+    result["width"] = size.width();
+    result["height"] = size.height();
+    if(brushSize > 0) result["brush"] = brushSize;
+    result["iterations"] = samples.size();
+    result["mean_ms"] = total / 1e6 / samples.size();
+    result["min_ms"] = least / 1e6;
+    result["max_ms"] = most / 1e6;
+    results.append(result);
+
+    // progress goes to stderr, stdout only carries the JSON
+    fprintf(stderr, "%-14s %4d MP brush %3d  %10.3f ms\n", path.toLatin1().constData(),
+            mp, brushSize, total / 1e6 / samples.size());
+}
+
+void Benchmark::benchConversion(int mp, const QSize &size)
+{
+    // the decoded BGR image is what cvLoadImage hands to openImage
+    IplImage *source = cvCreateImage(cvSize(size.width(), size.height()), IPL_DEPTH_8U, 3);
+    CvRNG rng = cvRNG(1);
+    cvRandArr(&rng, source, CV_RAND_UNI, cvScalarAll(0), cvScalarAll(256));
+
+    QVector<qint64> samples;
+    int rounds = mp > 16 ? 1 : 4;
+    for(int r = 0; r < rounds; r++)
+    {
+        TiledImage image(size.width(), size.height());
+        QElapsedTimer timer;
+        timer.start();
+        // 8-bit samples take no window
+        image.convertFrom(source, 0, 1);
+        samples.append(timer.nsecsElapsed());
+    }
+    cvReleaseImage(&source);
+
+    record("convertFrom", mp, size, 0, samples);
+}
+
+void Benchmark::benchStroke(ScribbleArea *area, int mp)
+{
+    OpencvProcess *process = area->opencvProcess;
+    QSize size = area->canvasSize();
+    process->setToolType(ToolType::Brush);
+
+    foreach(int brush, brushSizes)
+    {
+        brushSize = brush;
+
+        // short random segments, like mouse moves between two frames
+        srand(brush);
+        QVector<qint64> samples;
+        for(int i = 0; i < 256; i++)
+        {
+            QPoint from(rand() % size.width(), rand() % size.height());
+            QPoint to = from + QPoint(rand() % 64 - 32, rand() % 64 - 32);
+
+            QElapsedTimer timer;
+            timer.start();
+            process->drawLineTo(from, to);
+            samples.append(timer.nsecsElapsed());
+        }
+        record("drawLineTo", mp, size, brush, samples);
+    }
+}
+
+void Benchmark::benchErase(ScribbleArea *area, int mp)
+{
+    OpencvProcess *process = area->opencvProcess;
+    QSize size = area->canvasSize();
+
+    foreach(int brush, brushSizes)
+    {
+        eraseSize = brush;
+
+        srand(brush);
+        QVector<qint64> samples;
+        for(int i = 0; i < 256; i++)
+        {
+            QPoint at(rand() % size.width(), rand() % size.height());
+
+            QElapsedTimer timer;
+            timer.start();
+            process->eraseAt(at);
+            samples.append(timer.nsecsElapsed());
+        }
+        record("eraseDab", mp, size, brush, samples);
+    }
+}
+
+void Benchmark::waitForFrame(ScribbleArea *area, const QVector<int> &tiles)
+{
+    QImage frame(area->size(), QImage::Format_ARGB32_Premultiplied);
+    area->render(&frame);
+
+    QElapsedTimer waiting;
+    waiting.start();
+    foreach(int index, tiles)
+    {
+        while(area->renderedRevisions.at(index) != area->tileRevisions.at(index)
+              && waiting.elapsed() < 60000)
+        {
+            QApplication::processEvents();
+            QThread::msleep(1);
+        }
+    }
+}
+
+void Benchmark::benchPaint(ScribbleArea *area, int mp)
+{
+    QSize size = area->canvasSize();
+    QImage frame(area->size(), QImage::Format_ARGB32_Premultiplied);
+
+    // let the pyramid build first so it does not compete with the timings
+    qreal fit = qMin(qreal(area->width()) / size.width(), qreal(area->height()) / size.height());
+    QElapsedTimer building;
+    building.start();
+    while(fit <= 0.5 && area->pyramids.first()->levelFor(fit) == 0)
+    {
+        if(building.elapsed() > 600000) break;
+        QApplication::processEvents();
+        QThread::msleep(2);
+    }
+
+    // composing the tiles in view from scratch, what the render thread does
+    // after a layer change
+    area->zoomFactor = 1;
+    QRect view = area->mapToImage(area->rect()) & QRect(QPoint(0, 0), size);
+    QVector<int> viewTiles = area->image(0).tilesIn(view);
+    LayerCompositor compositor(&area->opencvProcess->layerStack);
+    QVector<qint64> compose;
+    for(int i = 0; i < 16; i++)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        compositor.reset(area->currentImageNum);
+        foreach(int index, viewTiles)
+            compositor.tile(index);
+        compose.append(timer.nsecsElapsed());
+    }
+    record("compose", mp, size, 0, compose);
+
+    // full resolution blit, once the render thread has delivered the view
+    waitForFrame(area, viewTiles);
+    QVector<qint64> blit;
+    for(int i = 0; i < 16; i++)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        area->render(&frame);
+        blit.append(timer.nsecsElapsed());
+    }
+    record("paintEvent", mp, size, 0, blit);
+
+    // zoomed to fit, sampling the pyramid when there is one
+    area->zoomFactor = fit;
+    QVector<qint64> fitted;
+    for(int i = 0; i < 16; i++)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        area->render(&frame);
+        fitted.append(timer.nsecsElapsed());
+    }
+    record("paintEvent_fit", mp, size, 0, fitted);
+}
+
+int Benchmark::run(const QStringList &arguments)
+{
+    QString output;
+    for(int i = 0; i + 1 < arguments.size(); i++)
+    {
+        if(arguments.at(i) == "--sizes")
+            megapixels = parseList(arguments.at(i+1));
+        else if(arguments.at(i) == "--brushes")
+            brushSizes = parseList(arguments.at(i+1));
+        else if(arguments.at(i) == "--output")
+            output = arguments.at(i+1);
+    }
+    if(megapixels.isEmpty() || brushSizes.isEmpty())
+    {
+        fprintf(stderr, "usage: pmig --benchmark [--sizes 1,16,200] [--brushes 1,10,100] [--output file]\n");
+        return 2;
+    }
+
+    foreach(int mp, megapixels)
+    {
+        // 4:3, like most camera images
+        int width = qCeil(qSqrt(mp * 1e6 * 4 / 3));
+        QSize size(width, qCeil(mp * 1e6 / width));
+
+        benchConversion(mp, size);
+
+        ScribbleArea *area = new ScribbleArea;
+        area->resize(1920, 1080);
+        area->imageCentralPoint = area->rect().center();
+
+        TiledImage image(size.width(), size.height());
+        image.fill(Scalar(255, 255, 255, 255));
+        area->opencvProcess->layerStack.append(Layer(image, "benchmark"));
+        area->insertPyramid(0);
+        area->setCurrentLayer(0);
+        area->updateDisplay(0);
+
+        benchPaint(area, mp);
+        benchStroke(area, mp);
+        benchErase(area, mp);
+
+        delete area;
+    }
+
+    QJsonObject document;
+    document["version"] = 1;
+    document["qt"] = QString(qVersion());
+    document["opencv"] = QString(CV_VERSION);
+    document["isa"] = QString(PixelKernels::isaName(PixelKernels::best().isa));
+    document["threads"] = QThread::idealThreadCount();
+    document["results"] = results;
+    QByteArray json = QJsonDocument(document).toJson();
+
+    if(output.isEmpty())
+    {
+        fwrite(json.constData(), 1, json.size(), stdout);
+        return 0;
+    }
+
+    QFile file(output);
+    if(!file.open(QFile::WriteOnly) || file.write(json) != json.size())
+    {
+        fprintf(stderr, "Unable to write %s\n", output.toLocal8Bit().constData());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+﻿#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QStringList>
+#include <QJsonArray>
+#include <QVector>
+
+#include "toolbox.h"
+
+class ScribbleArea;
+
+/* pmig --benchmark [--sizes 1,16,200] [--brushes 1,10,100] [--output file]
+ *
+ * Times the imaging hot paths on synthetic images and writes one JSON
+ * document, so numbers can be compared across releases. Sizes are in
+ * megapixels. It runs on the offscreen platform, so no display is needed.
+ */
+class Benchmark
+        :protected BrushToolBase,
+        protected EraseToolBase
+{
+public:
+    Benchmark();
+
+    int run(const QStringList &arguments);
+
+private:
+    QList<int> megapixels;
+    QList<int> brushSizes;
+    QJsonArray results;
+
+    void benchConversion(int mp, const QSize &size);
+    void benchStroke(ScribbleArea *area, int mp);
+    void benchErase(ScribbleArea *area, int mp);
+    void benchPaint(ScribbleArea *area, int mp);
+    void waitForFrame(ScribbleArea *area, const QVector<int> &tiles);
+
+    // samples are in nanoseconds
+    void record(const QString &path, int mp, const QSize &size, int brushSize,
+                const QVector<qint64> &samples);
+
+    static QList<int> parseList(const QString &text);
+};
+
+#endif // BENCHMARK_H
@@ -0,0 +1,242 @@
+﻿#include <QLineF>
+#include <QVarLengthArray>
+#include <qmath.h>
+
+#include "brushengine.h"
+#include "pixelkernels.h"
+
+// c * a / 255, rounded as the kernels do
+static inline uint multiplyByAlpha(uint c, uint a)
+{
+    uint t = c * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static inline void storeSample(quint16 *out, double value)
+{
+    *out = (quint16) qBound(0.0, value + 0.5, 65535.0);
+}
+
+static inline void storeSample(float *out, double value)
+{
+    *out = (float) value;
+}
+
+// PixelKernels::blendDab for the samples of a native depth layer
+template<typename Sample>
+static void blendDabNative(const uchar *before, uchar *dst, uchar *coverage, const uchar *mask,
+                           int width, double value, uint flow, uint opacity)
+{
+    const Sample *in = (const Sample *) before;
+    Sample *out = (Sample *) dst;
+    for(int x = 0; x < width; x++)
+    {
+        uint cov = coverage[x];
+        cov += multiplyByAlpha(multiplyByAlpha(mask[x], flow), 255 - cov);
+        coverage[x] = (uchar) cov;
+
+        double alpha = multiplyByAlpha(cov, opacity) / 255.0;
+        storeSample(out + x, in[x] + (value - in[x]) * alpha);
+    }
+}
+
+// one row of a dab on pixels of type, sample for native layers and the
+// premultiplied colour for the others
+static inline void blendRow(int type, const uchar *before, uchar *dst, uchar *coverage, const uchar *mask,
+                            int width, double sample, quint32 premultiplied, uint flow, uint opacity)
+{
+    if(type == CV_16UC1)
+        blendDabNative<quint16>(before, dst, coverage, mask, width, sample, flow, opacity);
+    else if(type == CV_32FC1)
+        blendDabNative<float>(before, dst, coverage, mask, width, sample, flow, opacity);
+    else
+        PixelKernels::best().blendDab(before, dst, coverage, mask, width, premultiplied, flow, opacity);
+}
+
+// native layers are grey, drawn with the sample that shows as the colour's grey
+static double sampleFor(const Layer &layer, const QColor &color)
+{
+    return layer.native.isNull() ? 0 : layer.window.sampleFor(qGray(color.rgb()) * color.alpha() / 255);
+}
+
+
+BrushEngine::BrushEngine()
+    :dabs(MaxSize*MaxSize), clip(0), layerId(-1), distance(0), step(1)
+{
+    ;
+}
+
+QRect BrushEngine::strokeTo(Layer *layer, const QPointF &from, const QPointF &to,
+                            const Settings &settings, const QColor &color,
+                            qreal fromPressure, qreal toPressure)
+{
+    bool isContinued = layerId == layer->id && !before.isNull() && from == lastPoint;
+    if(!isContinued)
+    {
+        endStroke();
+        layerId = layer->id;
+        // shares every tile, the ones the stroke draws on are copied once
+        before = layer->pixels();
+    }
+
+    QLineF line(from, to);
+    qreal length = line.length();
+
+    // a new stroke starts with a dab on from
+    QRect changed;
+    qreal t = isContinued ? step - distance : 0;
+    for(; t <= length; t += step)
+    {
+        qreal along = length > 0 ? t / length : 0;
+        qreal pressure = fromPressure + (toPressure - fromPressure) * along;
+        int size = qMax(1, qRound(settings.size * qBound(qreal(0), pressure, qreal(1))));
+        const Dab *dab = dabFor(settings, size);
+        if(dab) changed |= placeDab(layer, line.pointAt(along), *dab, settings, color);
+        step = qMax(qreal(1), size * settings.spacing / qreal(100));
+    }
+    distance = length - (t - step);
+    lastPoint = to;
+    return changed;
+}
+
+void BrushEngine::endStroke()
+{
+    layerId = -1;
+    before = TiledImage();
+    coverage.clear();
+    distance = 0;
+    step = 1;
+}
+
+QRect BrushEngine::fill(Layer *layer, const SelectionMask &selection, const QColor &color)
+{
+    endStroke();
+    TiledImage &pixels = layer->pixels();
+    if(selection.size() != pixels.size()) return QRect();
+    QRect filled = selection.boundingRect();
+
+    double sample = sampleFor(*layer, color);
+    quint32 premultiplied = qPremultiply(color.rgba());
+    // every pixel starts uncovered and takes the selection as is
+    QByteArray coverageRow(TiledImage::TileSize, 0), fullRow(TiledImage::TileSize, (char) 255);
+
+    foreach(int index, pixels.tilesIn(filled))
+    {
+        const uchar *mask;
+        if(selection.tileCoverage(index, &mask) == SelectionMask::None) continue;
+
+        QRect tileRect = pixels.tileRect(index);
+        QRect part = filled & tileRect;
+        Mat to = pixels.tile(index).mat();
+        int tx = part.left() - tileRect.left();
+        for(int y = part.top(); y <= part.bottom(); y++)
+        {
+            int ty = y - tileRect.top();
+            const uchar *maskRow = mask ? mask + ty*TiledImage::TileSize + tx : (const uchar *) fullRow.constData();
+            uchar *row = to.ptr(ty) + tx*to.elemSize();
+            coverageRow.fill(0);
+            blendRow(pixels.type(), row, row, (uchar *) coverageRow.data(), maskRow, part.width(),
+                     sample, premultiplied, 255, 255);
+        }
+    }
+    return filled;
+}
+
+const BrushEngine::Dab *BrushEngine::dabFor(const Settings &settings, int size)
+{
+    size = qBound(1, size, (int)MaxSize);
+    int hardness = qBound(0, settings.hardness, 100);
+    quint32 key = quint32(size) | quint32(hardness) << 16 | quint32(settings.antiAliasing) << 24
+            | quint32(settings.shape) << 25;
+    if(Dab *dab = dabs.object(key)) return dab;
+
+    Dab *dab = new Dab;
+    dab->size = size;
+    dab->mask.resize(size*size);
+    uchar *mask = (uchar *) dab->mask.data();
+
+    // smoothstep from the hard core out to the radius, the edge antialiased
+    qreal radius = size / qreal(2);
+    qreal core = radius * hardness / 100;
+    for(int y = 0; y < size; y++)
+    {
+        for(int x = 0; x < size; x++)
+        {
+            qreal dx = x + qreal(0.5) - radius, dy = y + qreal(0.5) - radius;
+            qreal d = qSqrt(dx*dx + dy*dy);
+            qreal v;
+            if(settings.shape == Square)
+                v = 1;
+            else if(!settings.antiAliasing)
+                v = d < radius ? 1 : 0;
+            else
+            {
+                v = qBound(qreal(0), radius + qreal(0.5) - d, qreal(1));
+                if(d > core && radius > core)
+                {
+                    qreal s = qMin(qreal(1), (d - core) / (radius - core));
+                    v = qMin(v, 1 - s*s*(3 - 2*s));
+                }
+            }
+            mask[y*size + x] = (uchar) qRound(v * 255);
+        }
+    }
+
+    if(!dabs.insert(key, dab, size*size)) return 0;
+    return dabs.object(key);
+}
+
+QRect BrushEngine::placeDab(Layer *layer, const QPointF &center, const Dab &dab,
+                            const Settings &settings, const QColor &color)
+{
+    TiledImage &pixels = layer->pixels();
+    QRect box(qRound(center.x() - dab.size / qreal(2)), qRound(center.y() - dab.size / qreal(2)),
+              dab.size, dab.size);
+    QRect painted = box & pixels.rect();
+    // a rectangular selection clips by its box alone
+    bool isClipped = clip && !clip->isEmpty() && clip->size() == pixels.size();
+    if(isClipped) painted &= clip->boundingRect();
+    if(clip && clip->isRectangle()) isClipped = false;
+
+    uint flow = qBound(0, settings.flow, 100) * 255 / 100;
+    uint opacity = qBound(0, settings.opacity, 100) * 255 / 100;
+    double sample = sampleFor(*layer, color);
+    quint32 premultiplied = qPremultiply(color.rgba());
+    QVarLengthArray<uchar, 1024> clipped(dab.size);
+
+    foreach(int index, pixels.tilesIn(painted))
+    {
+        const uchar *selectionMask = 0;
+        if(isClipped && clip->tileCoverage(index, &selectionMask) == SelectionMask::None) continue;
+
+        QRect tileRect = pixels.tileRect(index);
+        QRect part = painted & tileRect;
+
+        QByteArray &tileCoverage = coverage[index];
+        if(tileCoverage.isEmpty()) tileCoverage.fill(0, TiledImage::TileSize * TiledImage::TileSize);
+
+        Mat to = pixels.tile(index).mat();
+        Mat from = before.constTile(index).mat();
+        int tx = part.left() - tileRect.left();
+        for(int y = part.top(); y <= part.bottom(); y++)
+        {
+            int ty = y - tileRect.top();
+            const uchar *maskRow = (const uchar *) dab.mask.constData()
+                    + (y - box.top())*dab.size + part.left() - box.left();
+            uchar *coverageRow = (uchar *) tileCoverage.data() + ty*TiledImage::TileSize + tx;
+            const uchar *fromRow = from.ptr(ty) + tx*from.elemSize();
+            uchar *toRow = to.ptr(ty) + tx*to.elemSize();
+
+            if(selectionMask)
+            {
+                const uchar *selectionRow = selectionMask + ty*TiledImage::TileSize + tx;
+                for(int x = 0; x < part.width(); x++)
+                    clipped[x] = (uchar) multiplyByAlpha(maskRow[x], selectionRow[x]);
+                maskRow = clipped.constData();
+            }
+            blendRow(pixels.type(), fromRow, toRow, coverageRow, maskRow, part.width(),
+                     sample, premultiplied, flow, opacity);
+        }
+    }
+    return painted;
+}
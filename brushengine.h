@@ -0,0 +1,96 @@
+﻿#ifndef BRUSHENGINE_H
+#define BRUSHENGINE_H
+
+#include <QCache>
+#include <QHash>
+#include <QByteArray>
+#include <QPointF>
+#include <QRect>
+#include <QColor>
+
+#include "layerstack.h"
+#include "selectionmask.h"
+
+/* Paints strokes as a row of dabs. A dab is the coverage mask for a brush
+ * shape, size and hardness, built once and kept in a QCache, so placing
+ * one only costs the blend over its box. Each dab sits spacing percent of
+ * the size of the one before it further along the path, so light pressure
+ * packs small dabs closer, and the remainder carries over from one segment
+ * to the next.
+ *
+ * Flow is how much one dab adds, opacity caps the whole stroke: the dabs
+ * build up a coverage per stroke, and the layer is its pixels from before
+ * the stroke blended towards the colour by coverage * opacity. The pixels
+ * from before are a copy-on-write snapshot that only keeps the tiles the
+ * stroke draws on. Erasing is painting with a transparent colour, which
+ * takes the premultiplied pixels and their alpha down together.
+ *
+ * With a selection to clip to, dabs are scaled by its coverage; a
+ * rectangular one only shrinks the box a dab is blended over.
+ */
+class BrushEngine
+{
+public:
+    enum Shape{
+        Round=0,
+        Square=1
+    };
+
+    // wider dabs are painted at this size, the largest the cache holds
+    enum { MaxSize = 4096 };
+
+    struct Settings
+    {
+        Shape shape;
+        int size;
+        int hardness;       // percent of the radius that is fully covered
+        int opacity;        // percent
+        int flow;           // percent
+        int spacing;        // percent of the size
+        bool antiAliasing;
+    };
+
+    BrushEngine();
+
+    // paints from..to on layer, which continues the stroke if from is where
+    // the last segment ended; pen pressure (0..1) at either end scales the
+    // dab size. Returns the image rect changed
+    QRect strokeTo(Layer *layer, const QPointF &from, const QPointF &to,
+                   const Settings &settings, const QColor &color,
+                   qreal fromPressure = 1, qreal toPressure = 1);
+    // the next segment starts a new stroke
+    void endStroke();
+
+    // strokes only paint where selection covers, none or an empty one
+    // paints everywhere; it must outlive the engine
+    void clipTo(const SelectionMask *selection) {clip = selection;}
+    // blends layer towards color by the coverage of selection, outside of
+    // any stroke; returns the image rect changed
+    QRect fill(Layer *layer, const SelectionMask &selection, const QColor &color);
+
+private:
+    Q_DISABLE_COPY(BrushEngine)
+
+    struct Dab
+    {
+        int size;
+        QByteArray mask;    // size x size coverage, row by row
+    };
+
+    QCache<quint32, Dab> dabs;
+    const SelectionMask *clip;
+
+    // the stroke in progress
+    int layerId;
+    TiledImage before;
+    QHash<int, QByteArray> coverage;    // per tile, TileSize x TileSize
+    QPointF lastPoint;
+    qreal distance;                     // from the last dab to lastPoint
+    qreal step;                         // from the last dab to the next
+
+    const Dab *dabFor(const Settings &settings, int size);
+    QRect placeDab(Layer *layer, const QPointF &center, const Dab &dab,
+                   const Settings &settings, const QColor &color);
+};
+
+#endif // BRUSHENGINE_H
@@ -0,0 +1,296 @@
+﻿#include <string.h>
+
+#include <QtConcurrent>
+
+#include "floodfill.h"
+#include "pixelkernels.h"
+
+static const int TileSize = TiledImage::TileSize;
+
+struct MatchJob
+{
+    const PixelBuffer *pixels;
+    quint32 color;
+    uint tolerance;
+    QByteArray matches;     // TileSize x TileSize, 255 where it matches
+};
+
+static void matchTile(MatchJob &job)
+{
+    const PixelKernels &kernels = PixelKernels::best();
+    Mat mat = job.pixels->mat();
+    job.matches.fill(0, TileSize*TileSize);
+    uchar *out = (uchar *) job.matches.data();
+    for(int y = 0; y < mat.rows; y++)
+        kernels.matchColor(mat.ptr(y), out + y*TileSize, mat.cols, job.color, job.tolerance);
+}
+
+
+// the match maps of every tile addressed in image coordinates; taking a
+// pixel moves it from the matches to the region
+class SpanGrid
+{
+public:
+    SpanGrid(QVector<QByteArray> &matches, QVector<QByteArray> &region, int columns)
+        :region(region), columns(columns), in(matches.size()), out(matches.size(), 0)
+    {
+        for(int i = 0; i < matches.size(); i++)
+            in[i] = (uchar *) matches[i].data();
+    }
+
+    bool isMatch(int x, int y) const
+    {
+        return in.at(index(x, y))[offset(x, y)] != 0;
+    }
+
+    void take(int x, int y)
+    {
+        int i = index(x, y);
+        if(!out.at(i))
+        {
+            region[i].fill(0, TileSize*TileSize);
+            out[i] = (uchar *) region[i].data();
+        }
+        in[i][offset(x, y)] = 0;
+        out[i][offset(x, y)] = 255;
+    }
+
+private:
+    QVector<QByteArray> &region;
+    int columns;
+    QVector<uchar *> in, out;
+
+    int index(int x, int y) const {return (y / TileSize)*columns + x / TileSize;}
+    static int offset(int x, int y) {return (y % TileSize)*TileSize + x % TileSize;}
+};
+
+// a span fill of the matches connected to seed, taken into region; grid
+// may be a whole image or one tile
+template<typename Grid>
+static void scanlineFill(Grid &grid, const QSize &size, const QPoint &seed)
+{
+    QVector<QPoint> stack;
+    stack.append(seed);
+    while(!stack.isEmpty())
+    {
+        QPoint at = stack.last();
+        stack.removeLast();
+        int y = at.y();
+        if(!grid.isMatch(at.x(), y)) continue;
+
+        int left = at.x(), right = at.x();
+        while(left > 0 && grid.isMatch(left - 1, y)) left--;
+        while(right < size.width() - 1 && grid.isMatch(right + 1, y)) right++;
+        for(int x = left; x <= right; x++)
+            grid.take(x, y);
+
+        // one seed for every run of matches next to the span
+        for(int ny = y - 1; ny <= y + 1; ny += 2)
+        {
+            if(ny < 0 || ny >= size.height()) continue;
+            bool isInRun = false;
+            for(int x = left; x <= right; x++)
+            {
+                bool isMatch = grid.isMatch(x, ny);
+                if(isMatch && !isInRun) stack.append(QPoint(x, ny));
+                isInRun = isMatch;
+            }
+        }
+    }
+}
+
+
+// labels the connected matches of one tile from 1 up, 0 where none; a
+// tile holds at most TileSize*TileSize/2 components, which fit in 16 bits
+class LabelGrid
+{
+public:
+    LabelGrid(const uchar *matches, quint16 *labels, quint16 label)
+        :matches(matches), labels(labels), label(label) {}
+
+    bool isMatch(int x, int y) const
+    {
+        int i = y*TileSize + x;
+        return matches[i] && !labels[i];
+    }
+    void take(int x, int y) {labels[y*TileSize + x] = label;}
+
+private:
+    const uchar *matches;
+    quint16 *labels;
+    quint16 label;
+};
+
+struct LabelJob
+{
+    QSize size;
+    QByteArray matches;
+    QVector<quint16> labels;
+    int count;
+};
+
+static void labelTile(LabelJob &job)
+{
+    job.labels.fill(0, TileSize*TileSize);
+    job.count = 0;
+    const uchar *matches = (const uchar *) job.matches.constData();
+    quint16 *labels = job.labels.data();
+    for(int y = 0; y < job.size.height(); y++)
+    {
+        for(int x = 0; x < job.size.width(); x++)
+        {
+            int i = y*TileSize + x;
+            if(!matches[i] || labels[i]) continue;
+            LabelGrid grid(matches, labels, (quint16) ++job.count);
+            scanlineFill(grid, job.size, QPoint(x, y));
+        }
+    }
+    // the matches are not needed past here
+    job.matches = QByteArray();
+}
+
+struct KeepJob
+{
+    const LabelJob *tile;
+    const int *roots;       // of the tile's labels, roots[label - 1]
+    int root;
+    QByteArray region;
+};
+
+static void keepTile(KeepJob &job)
+{
+    bool isReached = false;
+    for(int l = 0; l < job.tile->count && !isReached; l++)
+        isReached = job.roots[l] == job.root;
+    if(!isReached) return;
+
+    job.region.fill(0, TileSize*TileSize);
+    uchar *out = (uchar *) job.region.data();
+    const quint16 *labels = job.tile->labels.constData();
+    for(int i = 0; i < TileSize*TileSize; i++)
+        if(labels[i] && job.roots[labels[i] - 1] == job.root) out[i] = 255;
+}
+
+static int findRoot(QVector<int> &parents, int id)
+{
+    while(parents.at(id) != id)
+    {
+        // path halving
+        parents[id] = parents.at(parents.at(id));
+        id = parents.at(id);
+    }
+    return id;
+}
+
+static void join(QVector<int> &parents, int a, int b)
+{
+    a = findRoot(parents, a);
+    b = findRoot(parents, b);
+    if(a != b) parents[qMax(a, b)] = qMin(a, b);
+}
+
+static QVector<QByteArray> connectedTiles(const TiledImage &image, QVector<QByteArray> &matches,
+                                          const QPoint &seed)
+{
+    int count = image.tileCount();
+    QVector<LabelJob> tiles(count);
+    for(int i = 0; i < count; i++)
+    {
+        tiles[i].size = image.tileRect(i).size();
+        tiles[i].matches = matches.at(i);
+    }
+    matches.clear();
+    QtConcurrent::blockingMap(tiles, labelTile);
+
+    // every label gets an id over the whole image
+    QVector<int> offsets(count);
+    int total = 0;
+    for(int i = 0; i < count; i++)
+    {
+        offsets[i] = total;
+        total += tiles.at(i).count;
+    }
+    QVector<int> parents(total);
+    for(int id = 0; id < total; id++)
+        parents[id] = id;
+
+    // join the labels touching across the right and bottom tile edges
+    int columns = image.tileColumns();
+    for(int i = 0; i < count; i++)
+    {
+        const LabelJob &tile = tiles.at(i);
+        const quint16 *labels = tile.labels.constData();
+        int w = tile.size.width(), h = tile.size.height();
+        if((i + 1) % columns != 0)
+        {
+            const quint16 *right = tiles.at(i + 1).labels.constData();
+            for(int y = 0; y < h; y++)
+            {
+                quint16 a = labels[y*TileSize + w - 1], b = right[y*TileSize];
+                if(a && b) join(parents, offsets.at(i) + a - 1, offsets.at(i + 1) + b - 1);
+            }
+        }
+        if(i + columns < count)
+        {
+            const quint16 *below = tiles.at(i + columns).labels.constData();
+            for(int x = 0; x < w; x++)
+            {
+                quint16 a = labels[(h - 1)*TileSize + x], b = below[x];
+                if(a && b) join(parents, offsets.at(i) + a - 1, offsets.at(i + columns) + b - 1);
+            }
+        }
+    }
+    for(int id = 0; id < total; id++)
+        parents[id] = findRoot(parents, id);
+
+    QVector<QByteArray> region(count);
+    int seedTile = image.tilesIn(QRect(seed, QSize(1, 1))).first();
+    QPoint local = seed - image.tileRect(seedTile).topLeft();
+    quint16 seedLabel = tiles.at(seedTile).labels.at(local.y()*TileSize + local.x());
+    if(!seedLabel) return region;
+
+    QVector<KeepJob> jobs(count);
+    for(int i = 0; i < count; i++)
+    {
+        jobs[i].tile = &tiles.at(i);
+        jobs[i].roots = parents.constData() + offsets.at(i);
+        jobs[i].root = parents.at(offsets.at(seedTile) + seedLabel - 1);
+    }
+    QtConcurrent::blockingMap(jobs, keepTile);
+    for(int i = 0; i < count; i++)
+        region[i] = jobs.at(i).region;
+    return region;
+}
+
+
+SelectionMask FloodFill::region(const TiledImage &image, const QPoint &seed, int tolerance, bool contiguous)
+{
+    if(!image.rect().contains(seed) || image.type() != CV_8UC4) return SelectionMask(image.size());
+
+    int seedTile = image.tilesIn(QRect(seed, QSize(1, 1))).first();
+    QPoint local = seed - image.tileRect(seedTile).topLeft();
+    quint32 color;
+    memcpy(&color, image.constTile(seedTile).mat().ptr(local.y()) + 4*local.x(), 4);
+
+    QVector<MatchJob> jobs(image.tileCount());
+    for(int i = 0; i < jobs.size(); i++)
+    {
+        jobs[i].pixels = &image.constTile(i);
+        jobs[i].color = color;
+        jobs[i].tolerance = (uint) qBound(0, tolerance, 255);
+    }
+    QtConcurrent::blockingMap(jobs, matchTile);
+    QVector<QByteArray> matches(jobs.size());
+    for(int i = 0; i < jobs.size(); i++)
+        matches[i] = jobs.at(i).matches;
+    jobs.clear();
+
+    if(!contiguous) return SelectionMask(image.size(), matches);
+    if(image.tileCount() >= ParallelTiles)
+        return SelectionMask(image.size(), connectedTiles(image, matches, seed));
+
+    QVector<QByteArray> region(matches.size());
+    SpanGrid grid(matches, region, image.tileColumns());
+    scanlineFill(grid, image.size(), seed);
+    return SelectionMask(image.size(), region);
+}
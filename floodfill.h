@@ -0,0 +1,33 @@
+﻿#ifndef FLOODFILL_H
+#define FLOODFILL_H
+
+#include <QPoint>
+
+#include "tiledimage.h"
+#include "selectionmask.h"
+
+/* Picks the pixels that look like the one under a seed point, for the
+ * bucket fill and the magic wand. A pixel matches when no channel of its
+ * premultiplied BGRA is further than tolerance (0..255) from the seed's;
+ * the test runs a row at a time through PixelKernels::matchColor, on every
+ * tile in parallel.
+ *
+ * The matches connected to the seed are found by a scanline fill that
+ * takes a whole span of a row at once and only looks at the rows above and
+ * below it. From ParallelTiles tiles on that one thread would dominate, so
+ * larger images label the connected spans of each tile in parallel, join
+ * the labels that meet across tile edges and keep the pixels whose label
+ * joined the seed's.
+ */
+namespace FloodFill
+{
+    enum { ParallelTiles = 64 };
+
+    // what matches the seed, only the pixels connected to it (4 way) if
+    // contiguous; empty if seed is off image or image is not BGRA. The
+    // BGRA tiles of a native depth layer are only its window, a tolerance
+    // in them would change as the window moves, so callers keep to 8 bits
+    SelectionMask region(const TiledImage &image, const QPoint &seed, int tolerance, bool contiguous);
+}
+
+#endif // FLOODFILL_H
@@ -0,0 +1,118 @@
+﻿#include <QtConcurrent>
+#include <QImageReader>
+
+#include "imageloader.h"
+#include "windowlevel.h"
+
+ImageLoader::ImageLoader(const QString &fileName, const QSize &canvasSize, QObject *parent)
+    :QObject(parent), path(fileName), canvasSize(canvasSize), isCancelled(0), isLoaded(false)
+{
+    watcher = new QFutureWatcher<void>(this);
+    connect(watcher, SIGNAL(finished()), this, SLOT(taskFinished()));
+}
+
+ImageLoader::~ImageLoader()
+{
+    cancel();
+    watcher->waitForFinished();
+}
+
+void ImageLoader::start()
+{
+    watcher->setFuture(QtConcurrent::run(this, &ImageLoader::load));
+}
+
+void ImageLoader::cancel()
+{
+    isCancelled.store(1);
+}
+
+void ImageLoader::taskFinished()
+{
+    if(!isCancelled.load()) emit finished(isLoaded);
+    deleteLater();
+}
+
+void ImageLoader::load()
+{
+    // runs on the thread pool, everything leaves through queued signals
+    bool isSizeKnown = false;
+    QImageReader reader(path);
+    QSize imageSize = reader.size();
+    if(imageSize.isValid())
+    {
+        // a header read, so the canvas can show up before the decode
+        isSizeKnown = true;
+        if(!canvasSize.isValid()) canvasSize = imageSize;
+        emit sizeKnown(imageSize);
+
+        const int previewSide = 1024;
+        if(qMax(imageSize.width(), imageSize.height()) > previewSide)
+            reader.setScaledSize(imageSize.scaled(previewSide, previewSide, Qt::KeepAspectRatio));
+        QImage preview = reader.read();
+        if(isCancelled.load()) return;
+        if(!preview.isNull())
+            emit previewReady(preview.convertToFormat(QImage::Format_ARGB32_Premultiplied));
+    }
+
+    IplImage *img = PixelBuffer::loadImage(path.toLocal8Bit().constData());
+    if(!img) return;
+    if(isCancelled.load())
+    {
+        cvReleaseImage(&img);
+        return;
+    }
+
+    if(!isSizeKnown)
+    {
+        imageSize = QSize(img->width, img->height);
+        if(!canvasSize.isValid()) canvasSize = imageSize;
+        emit sizeKnown(imageSize);
+    }
+
+    int nativeType = Mat(img).type();
+    WindowLevel window;
+    if(WindowLevel::isNativeType(nativeType))
+    {
+        // every band is shown through the window of the whole image
+        double mini, maxi;
+        minMaxLoc(Mat(img), &mini, &maxi);
+        window = WindowLevel(nativeType);
+        window.setWindow(mini, maxi);
+        emit windowKnown(nativeType, mini, maxi);
+    }
+
+    // float colours are shown through one window for every band too
+    double mini = 0, maxi = 1;
+    if(window.isNull()) PixelBuffer::floatWindow(img, &mini, &maxi);
+
+    // before the bands, or they would land on the heap
+    int bytesPerPixel = 4 + (window.isNull() ? 0 : CV_ELEM_SIZE(nativeType));
+    ScratchFile::reserveFor(qint64(canvasSize.width()) * canvasSize.height() * bytesPerPixel);
+
+    bool ok = true;
+    for(int y = 0; y < canvasSize.height() && ok; y += TiledImage::TileSize)
+    {
+        if(isCancelled.load())
+        {
+            ok = false;
+            break;
+        }
+
+        int bandHeight = qMin((int)TiledImage::TileSize, canvasSize.height() - y);
+        TiledImage band(canvasSize.width(), bandHeight);
+        TiledImage nativeBand;
+        if(window.isNull())
+            ok = band.convertFrom(img, QPoint(0, y), mini, maxi);
+        else
+        {
+            nativeBand = TiledImage(canvasSize.width(), bandHeight, nativeType);
+            ok = nativeBand.copyFrom(img, QPoint(0, y));
+            if(ok) window.render(nativeBand, &band, nativeBand.tilesIn(nativeBand.rect()));
+        }
+        if(ok) emit bandLoaded(band, nativeBand, y / TiledImage::TileSize);
+    }
+    cvReleaseImage(&img);
+
+    isLoaded = ok;
+}
@@ -0,0 +1,60 @@
+﻿#ifndef IMAGELOADER_H
+#define IMAGELOADER_H
+
+#include <QObject>
+#include <QString>
+#include <QSize>
+#include <QImage>
+#include <QAtomicInt>
+#include <QFutureWatcher>
+
+#include "tiledimage.h"
+
+/* Opens an image on the thread pool. A reduced preview comes first, read
+ * through QImageReader::setScaledSize (JPEG decodes it DCT-scaled), then
+ * the full decode is converted into the canvas one row of tiles at a time.
+ * Each row arrives through bandLoaded() as a TiledImage one tile high.
+ *
+ * cvLoadImage itself cannot be interrupted: cancel() drops the result as
+ * soon as it returns. The loader deletes itself once the task is over.
+ */
+class ImageLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    // canvasSize is invalid for the first image, which then sets it
+    ImageLoader(const QString &fileName, const QSize &canvasSize, QObject *parent = 0);
+    // waits for the task, which may still be inside cvLoadImage
+    ~ImageLoader();
+
+    void start();
+    void cancel();
+
+    const QString &fileName() const {return path;}
+
+signals:
+    // emitted once, before any band; the first image's canvas takes this size
+    void sizeKnown(const QSize &imageSize);
+    void previewReady(const QImage &preview);
+    // for 16-bit and float grey images, which keep their depth: the sample
+    // type and the window the bands are rendered with, before any band
+    void windowKnown(int type, double low, double high);
+    // nativeBand holds the samples band shows, null unless windowKnown came
+    void bandLoaded(const TiledImage &band, const TiledImage &nativeBand, int tileRow);
+    void finished(bool ok);
+
+private slots:
+    void taskFinished();
+
+private:
+    QString path;
+    QSize canvasSize;
+    QAtomicInt isCancelled;
+    bool isLoaded;
+    QFutureWatcher<void> *watcher;
+
+    void load();
+};
+
+#endif // IMAGELOADER_H
@@ -0,0 +1,145 @@
+﻿#include <QtConcurrent>
+#include <QSaveFile>
+#include <QImageWriter>
+
+#include "imagesaver.h"
+#include "layercompositor.h"
+#include "pngencoder.h"
+
+ImageSaver::ImageSaver(const LayerStack &layers, const QString &fileName, const QByteArray &format,
+                       QObject *parent)
+    :QObject(parent), layers(layers), fileName(fileName), format(format)
+{
+    watcher = new QFutureWatcher<bool>(this);
+    connect(watcher, SIGNAL(finished()), this, SLOT(taskFinished()));
+}
+
+ImageSaver::~ImageSaver()
+{
+    watcher->waitForFinished();
+}
+
+void ImageSaver::start()
+{
+    watcher->setFuture(QtConcurrent::run(this, &ImageSaver::run));
+}
+
+bool ImageSaver::run()
+{
+    return write(layers, fileName, format, &error);
+}
+
+void ImageSaver::taskFinished()
+{
+    emit finished(watcher->result(), error);
+    deleteLater();
+}
+
+const Layer *ImageSaver::nativeLayer(const LayerStack &layers, const QByteArray &format)
+{
+    QByteArray lowerFormat = format.toLower();
+    if(lowerFormat != "png" && lowerFormat != "tif" && lowerFormat != "tiff") return 0;
+    if(layers.size() != 1) return 0;
+
+    // float samples have no PNG or TIFF writer in OpenCV
+    const Layer &layer = layers.at(0);
+    if(layer.native.isNull() || layer.native.type() != CV_16UC1 || !layer.isVisible
+            || layer.opacity < 1)
+        return 0;
+    return &layer;
+}
+
+bool ImageSaver::reducesDepth(const LayerStack &layers, const QByteArray &format)
+{
+    if(nativeLayer(layers, format)) return false;
+    for(int l = 0; l < layers.size(); l++)
+        if(layers.at(l).isVisible && !layers.at(l).native.isNull()) return true;
+    return false;
+}
+
+bool ImageSaver::write(const LayerStack &layers, const QString &fileName, const QByteArray &format,
+                       QString *error)
+{
+    QString message;
+    if(!error) error = &message;
+    if(layers.isEmpty())
+    {
+        *error = QObject::tr("Nothing to save");
+        return false;
+    }
+
+    QSaveFile file(fileName);
+    if(!file.open(QIODevice::WriteOnly))
+    {
+        *error = file.errorString();
+        return false;
+    }
+
+    QSize size = layers.canvasSize();
+    QByteArray lowerFormat = format.toLower();
+    const Layer *native = nativeLayer(layers, format);
+    if(native)
+    {
+        // the samples as they are, not the window they are shown through
+        Mat samples(size.height(), size.width(), native->native.type());
+        for(int i = 0; i < native->native.tileCount(); i++)
+        {
+            QRect rect = native->native.tileRect(i);
+            native->native.constTile(i).mat().copyTo(
+                        samples(Rect(rect.x(), rect.y(), rect.width(), rect.height())));
+        }
+        std::vector<uchar> encoded;
+        if(!imencode(lowerFormat == "png" ? ".png" : ".tiff", samples, encoded))
+        {
+            *error = QObject::tr("Unable to encode the 16-bit samples");
+            file.cancelWriting();
+            return false;
+        }
+        if(file.write((const char *) &encoded[0], encoded.size()) != qint64(encoded.size()))
+        {
+            *error = file.errorString();
+            file.cancelWriting();
+            return false;
+        }
+    }
+    else if(lowerFormat == "png")
+    {
+        // one row of tiles at a time, never the whole flattened image
+        PngEncoder encoder(&file, size);
+        bool ok = encoder.writeHeader();
+        for(int y = 0; y < size.height() && ok; y += TiledImage::TileSize)
+        {
+            QRect band(0, y, size.width(), qMin((int)TiledImage::TileSize, size.height() - y));
+            ok = encoder.writeBand(LayerCompositor::flatten(layers, band));
+        }
+        if(!ok || !encoder.finish())
+        {
+            *error = file.errorString();
+            file.cancelWriting();
+            return false;
+        }
+    }
+    else
+    {
+        // formats without alpha would turn transparent areas black
+        static const char *opaqueFormats[] = {"jpg", "jpeg", "bmp", "ppm", "pgm", "pbm", "xbm"};
+        QColor background = Qt::transparent;
+        for(uint i = 0; i < sizeof(opaqueFormats) / sizeof(opaqueFormats[0]); i++)
+            if(lowerFormat == opaqueFormats[i]) background = Qt::white;
+
+        QImageWriter writer(&file, format);
+        if(!writer.write(LayerCompositor::flatten(layers, QRect(QPoint(0, 0), size), background)))
+        {
+            *error = writer.errorString();
+            file.cancelWriting();
+            return false;
+        }
+    }
+
+    if(!file.commit())
+    {
+        *error = file.errorString();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,57 @@
+﻿#ifndef IMAGESAVER_H
+#define IMAGESAVER_H
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QFutureWatcher>
+
+#include "layerstack.h"
+
+/* Flattens a copy on write snapshot of the layers and writes it on the
+ * thread pool, so painting goes on while a big file compresses. PNG goes
+ * through PngEncoder band by band, other formats through QImageWriter.
+ * The file is written under a temporary name by QSaveFile and renamed into
+ * place only once complete. The saver deletes itself after finished().
+ *
+ * A lone 16-bit grey layer saved as PNG or TIFF keeps its samples; any
+ * other image with native depth layers is flattened to 8 bits, see
+ * reducesDepth().
+ */
+class ImageSaver : public QObject
+{
+    Q_OBJECT
+
+public:
+    ImageSaver(const LayerStack &layers, const QString &fileName, const QByteArray &format,
+               QObject *parent = 0);
+    // waits for the write to complete
+    ~ImageSaver();
+
+    void start();
+
+    // the same, synchronously
+    static bool write(const LayerStack &layers, const QString &fileName, const QByteArray &format,
+                      QString *error = 0);
+    // true if the samples of a visible native depth layer would be lost
+    static bool reducesDepth(const LayerStack &layers, const QByteArray &format);
+
+signals:
+    void finished(bool ok, const QString &error);
+
+private slots:
+    void taskFinished();
+
+private:
+    LayerStack layers;
+    QString fileName;
+    QByteArray format;
+    QString error;
+    QFutureWatcher<bool> *watcher;
+
+    bool run();
+    // the layer written at its own depth, or 0
+    static const Layer *nativeLayer(const LayerStack &layers, const QByteArray &format);
+};
+
+#endif // IMAGESAVER_H
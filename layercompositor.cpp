@@ -0,0 +1,167 @@
+﻿#include <string.h>
+
+#include "layercompositor.h"
+#include "scratchfile.h"
+
+LayerCompositor::LayerCompositor(const LayerStack *layers)
+    :layers(layers)
+{
+    activeLayer = -1;
+    hasBelow = hasAbove = aboveIsFlat = false;
+}
+
+QPainter::CompositionMode LayerCompositor::compositionMode(Layer::BlendMode mode)
+{
+    switch(mode)
+    {
+    case Layer::Multiply: return QPainter::CompositionMode_Multiply;
+    case Layer::Screen: return QPainter::CompositionMode_Screen;
+    case Layer::Overlay: return QPainter::CompositionMode_Overlay;
+    case Layer::Darken: return QPainter::CompositionMode_Darken;
+    case Layer::Lighten: return QPainter::CompositionMode_Lighten;
+    case Layer::Difference: return QPainter::CompositionMode_Difference;
+    case Layer::Add: return QPainter::CompositionMode_Plus;
+    default: return QPainter::CompositionMode_SourceOver;
+    }
+}
+
+void LayerCompositor::blend(QPainter *painter, const Layer &layer, int index)
+{
+    painter->setCompositionMode(compositionMode(layer.blendMode));
+    painter->setOpacity(layer.opacity);
+    painter->drawImage(0, 0, layer.image.constTile(index).image());
+}
+
+QImage LayerCompositor::flatten(const LayerStack &layers, const QRect &rect, const QColor &background)
+{
+    QImage image(rect.size(), QImage::Format_ARGB32_Premultiplied);
+    image.fill(background);
+    if(layers.isEmpty()) return image;
+
+    QPainter painter(&image);
+    const TiledImage &canvas = layers.first().image;
+    QVector<int> indexes = canvas.tilesIn(rect);
+    for(int i = 0; i < layers.size(); i++)
+    {
+        const Layer &layer = layers.at(i);
+        if(!layer.isVisible) continue;
+
+        painter.setCompositionMode(compositionMode(layer.blendMode));
+        painter.setOpacity(layer.opacity);
+        foreach(int index, indexes)
+        {
+            QRect tileRect = canvas.tileRect(index);
+            QRect part = tileRect & rect;
+            painter.drawImage(part.topLeft() - rect.topLeft(), layer.image.constTile(index).image(),
+                              part.translated(-tileRect.topLeft()));
+        }
+    }
+    return image;
+}
+
+void LayerCompositor::reset(int activeLayer)
+{
+    this->activeLayer = activeLayer;
+    int tileCount = layers->isEmpty() ? 0 : layers->first().image.tileCount();
+
+    hasBelow = hasAbove = false;
+    aboveIsFlat = true;
+    for(int i = 0; i < layers->size(); i++)
+    {
+        const Layer &layer = layers->at(i);
+        if(!layer.isVisible) continue;
+        if(i < activeLayer) hasBelow = true;
+        if(i > activeLayer)
+        {
+            hasAbove = true;
+            if(layer.blendMode != Layer::Normal) aboveIsFlat = false;
+        }
+    }
+
+    belowTiles.clear();
+    aboveTiles.clear();
+    belowTiles.resize(tileCount);
+    aboveTiles.resize(tileCount);
+    compositeTiles.resize(tileCount);
+    compositeValid.fill(false, tileCount);
+}
+
+void LayerCompositor::invalidate(const QRect &rect)
+{
+    if(layers->isEmpty()) return;
+    foreach(int index, layers->first().image.tilesIn(rect))
+        compositeValid[index] = false;
+}
+
+const QImage &LayerCompositor::belowTile(int index)
+{
+    QImage &below = belowTiles[index];
+    if(below.isNull())
+    {
+        QRect rect = layers->first().image.tileRect(index);
+        below = ScratchFile::image(rect.size());
+        below.fill(0);
+
+        QPainter painter(&below);
+        for(int i = 0; i < activeLayer; i++)
+            if(layers->at(i).isVisible) blend(&painter, layers->at(i), index);
+    }
+    return below;
+}
+
+const QImage &LayerCompositor::aboveTile(int index)
+{
+    QImage &above = aboveTiles[index];
+    if(above.isNull())
+    {
+        QRect rect = layers->first().image.tileRect(index);
+        above = ScratchFile::image(rect.size());
+        above.fill(0);
+
+        // all Normal here, so plain source-over with each opacity
+        QPainter painter(&above);
+        for(int i = activeLayer + 1; i < layers->size(); i++)
+            if(layers->at(i).isVisible) blend(&painter, layers->at(i), index);
+    }
+    return above;
+}
+
+const QImage &LayerCompositor::tile(int index)
+{
+    QImage &composite = compositeTiles[index];
+    if(compositeValid.at(index)) return composite;
+
+    QRect rect = layers->first().image.tileRect(index);
+    // a tile handed out earlier is left alone rather than detached
+    if(composite.isNull() || !composite.isDetached())
+        composite = ScratchFile::image(rect.size());
+
+    if(hasBelow)
+    {
+        const QImage &below = belowTile(index);
+        memcpy(composite.bits(), below.constBits(), composite.byteCount());
+    }
+    else
+    {
+        composite.fill(0);
+    }
+
+    QPainter painter(&composite);
+    if(activeLayer >= 0 && activeLayer < layers->size() && layers->at(activeLayer).isVisible)
+        blend(&painter, layers->at(activeLayer), index);
+
+    if(hasAbove && aboveIsFlat)
+    {
+        painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+        painter.setOpacity(1);
+        painter.drawImage(0, 0, aboveTile(index));
+    }
+    else if(hasAbove)
+    {
+        for(int i = activeLayer + 1; i < layers->size(); i++)
+            if(layers->at(i).isVisible) blend(&painter, layers->at(i), index);
+    }
+
+    compositeValid[index] = true;
+    return composite;
+}
@@ -0,0 +1,50 @@
+﻿#ifndef LAYERCOMPOSITOR_H
+#define LAYERCOMPOSITOR_H
+
+#include <QImage>
+#include <QPainter>
+#include <QVector>
+#include <QRect>
+#include <QColor>
+
+#include "layerstack.h"
+
+/* Blends a LayerStack tile by tile. The layers below the active one and the
+ * layers above it are each flattened once into cached tiles, so a stroke on
+ * the active layer only re-blends its dirty tiles against those two caches
+ * however many layers there are. "Over" is associative, so the layers above
+ * can be flattened only while they all use Normal; otherwise they are
+ * blended one by one on top.
+ */
+class LayerCompositor
+{
+public:
+    LayerCompositor(const LayerStack *layers);
+
+    // the layer order, a layer property or the active layer changed
+    void reset(int activeLayer);
+    // the active layer's pixels changed
+    void invalidate(const QRect &rect);
+    void invalidate(int index) {compositeValid[index] = false;}
+
+    const QImage &tile(int index);
+
+    static QPainter::CompositionMode compositionMode(Layer::BlendMode mode);
+    static void blend(QPainter *painter, const Layer &layer, int index);
+    // all visible layers blended over background, uncached, for export
+    static QImage flatten(const LayerStack &layers, const QRect &rect,
+                          const QColor &background = Qt::transparent);
+
+private:
+    const LayerStack *layers;
+    int activeLayer;
+    bool hasBelow, hasAbove, aboveIsFlat;
+
+    QVector<QImage> belowTiles, aboveTiles, compositeTiles;
+    QVector<bool> compositeValid;
+
+    const QImage &belowTile(int index);
+    const QImage &aboveTile(int index);
+};
+
+#endif // LAYERCOMPOSITOR_H
@@ -1,7 +1,46 @@
-﻿#include "layerstack.h"
+﻿#include <QAtomicInt>
+
+#include "layerstack.h"
+
+Layer::Layer()
+    :id(newId()), isVisible(true), opacity(1), blendMode(Normal)
+{
+    ;
+}
+
+Layer::Layer(const TiledImage &image, const QString &name)
+    :image(image), id(newId()), name(name), isVisible(true), opacity(1), blendMode(Normal)
+{
+    ;
+}
+
+QStringList Layer::blendModeNames()
+{
+    // in BlendMode order
+    return QStringList() << "Normal" << "Multiply" << "Screen" << "Overlay"
+                         << "Darken" << "Lighten" << "Difference" << "Add";
+}
+
+int Layer::newId()
+{
+    static QAtomicInt lastId;
+    return lastId.fetchAndAddRelaxed(1) + 1;
+}
 
 
 LayerStack::LayerStack()
 {
     ;
 }
+
+QSize LayerStack::canvasSize() const
+{
+    return isEmpty() ? QSize() : first().image.size();
+}
+
+int LayerStack::indexOf(int layerId) const
+{
+    for(int i = 0; i < size(); i++)
+        if(at(i).id == layerId) return i;
+    return -1;
+}
@@ -2,19 +2,56 @@
 #define LAYERSTACK_H
 
 #include <QStack>
+#include <QString>
+#include <QStringList>
+
+#include "tiledimage.h"
+#include "windowlevel.h"
 
 struct Layer{
+    enum BlendMode{
+        Normal=0,
+        Multiply=1,
+        Screen=2,
+        Overlay=3,
+        Darken=4,
+        Lighten=5,
+        Difference=6,
+        Add=7
+    };
+
+    Layer();
+    Layer(const TiledImage &image, const QString &name);
+
+    TiledImage image;
+    // 16-bit and float grey images keep their samples here and image is
+    // rendered from them through window; null for the other layers
+    TiledImage native;
+    WindowLevel window;
+    // stable across reordering, copies keep it; undo finds layers by it
+    int id;
+    QString name;
     bool isVisible;
-};
+    qreal opacity;
+    BlendMode blendMode;
+
+    // what the tools draw on and undo restores
+    TiledImage &pixels() {return native.isNull() ? image : native;}
+    const TiledImage &pixels() const {return native.isNull() ? image : native;}
 
-//class QStack<int>;
+    static QStringList blendModeNames();
+    static int newId();
+};
 
-class LayerStack:public QStack<int>
+// index 0 is the bottom layer, all layers share the canvas size
+class LayerStack:public QStack<Layer>
 {
 public:
     LayerStack();
 
-    //setVisible(int layerNum);
+    QSize canvasSize() const;
+    // -1 once the layer is gone
+    int indexOf(int layerId) const;
 };
 
 #endif // LAYERSTACK_H
@@ -1,14 +1,40 @@
 ﻿#include <QApplication>
 #include <QSplashScreen>
 #include <QThread>
+#include <string.h>
 
 
 #include "mainwindow.h"
+#include "pixelkernels.h"
+#include "benchmark.h"
+#include "batchprocessor.h"
 
 int main(int argc, char *argv[])
 {
+    // pmig --bench-kernels : report conversion throughput and exit
+    if(argc > 1 && strcmp(argv[1], "--bench-kernels") == 0)
+        return PixelKernels::benchmark();
+
     Q_INIT_RESOURCE(resources);
 
+    // pmig --benchmark ... : time the imaging paths headless, print JSON
+    if(argc > 1 && strcmp(argv[1], "--benchmark") == 0)
+    {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+        QApplication app(argc, argv);
+        Benchmark benchmark;
+        return benchmark.run(app.arguments());
+    }
+
+    // pmig --batch recipe.json ... image... : apply a recipe to every image
+    if(argc > 1 && strcmp(argv[1], "--batch") == 0)
+    {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+        QApplication app(argc, argv);
+        BatchProcessor processor;
+        return processor.run(app.arguments());
+    }
+
     QApplication app(argc, argv);
 //    QSplashScreen *splash = new QSplashScreen;
 //    splash->setPixmap(QPixmap(":images/bg.png"));
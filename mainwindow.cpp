@@ -7,6 +7,7 @@
 #include <QFile>
 #include <QDataStream>
 #include <QFileDialog>
+#include <QFileInfo>
 #include <QMessageBox>
 #include <QSignalMapper>
 #include <QApplication>
@@ -18,6 +19,10 @@
 #include <QPushButton>
 #include <QDockWidget>
 #include <QImageWriter>
+#include <QInputDialog>
+#include <QColorDialog>
+#include <QTimer>
+#include <QActionGroup>
 #include <QtPrintSupport/QPrinter>
 #include <QtPrintSupport/QPrintDialog>
 #include <QBitmap>
@@ -30,6 +35,7 @@
 #include "mainwindow.h"
 #include "colorswatch.h"
 #include "toolbar.h"
+#include "scratchfile.h"
 
 
 #define TILE_SIZE 100
@@ -70,6 +76,8 @@ MainWindow::MainWindow(QWidget *parent)
 
     statusBar()->showMessage(tr("Ready"));
 
+    // once the window is up
+    QTimer::singleShot(0, this, SLOT(recoverWork()));
 }
 
 //MainWindow::~MainWindow()
@@ -84,6 +92,8 @@ void MainWindow::setupToolBar()
     toolsToolBar.insert(ToolType::Brush, new BrushToolTweak(this));
     toolsToolBar.insert(ToolType::Erase, new EraseToolTweak(this));
     toolsToolBar.insert(ToolType::Marquee, new MarqueeToolTweak(this));
+    toolsToolBar.insert(ToolType::Fill, new FillToolTweak(this));
+    toolsToolBar.insert(ToolType::MagicWand, new MagicWandToolTweak(this));
     foreach (ToolType::toolType tmp, toolsToolBar.keys()) {
         addToolBar(toolsToolBar[tmp]);
     }
@@ -118,10 +128,25 @@ void MainWindow::setupToolBar()
     eraseAct->setCheckable(true);
     connect(eraseAct,SIGNAL(toggled(bool)),this,SLOT(setToolErase(bool)));
 
+    // no icons for these yet, the tool box shows their names
+    QAction *fillAct = new QAction(tr("&Fill tool (G)"),this);
+    fillAct->setShortcut(Qt::Key_G);
+    fillAct->setStatusTip(tr("To fill an area of similar colour"));
+    fillAct->setCheckable(true);
+    connect(fillAct,SIGNAL(toggled(bool)),this,SLOT(setToolFill(bool)));
+
+    QAction *magicWandAct = new QAction(tr("Magic &wand tool (W)"),this);
+    magicWandAct->setShortcut(Qt::Key_W);
+    magicWandAct->setStatusTip(tr("To select an area of similar colour"));
+    magicWandAct->setCheckable(true);
+    connect(magicWandAct,SIGNAL(toggled(bool)),this,SLOT(setToolMagicWand(bool)));
+
     toolBoxGroup->addAction(marqueeAct);
     toolBoxGroup->addAction(brushAct);
     toolBoxGroup->addAction(penAct);
     toolBoxGroup->addAction(eraseAct);
+    toolBoxGroup->addAction(fillAct);
+    toolBoxGroup->addAction(magicWandAct);
 
 
     toolBox = addToolBar(tr("Tool box"));
@@ -138,6 +163,8 @@ void MainWindow::setupToolBar()
     toolBox->addAction(brushAct);
     toolBox->addAction(penAct);
     toolBox->addAction(eraseAct);
+    toolBox->addAction(fillAct);
+    toolBox->addAction(magicWandAct);
 
 }
 
@@ -163,6 +190,14 @@ void MainWindow::setupMenuBar()
     openAct->setShortcuts(QKeySequence::Open);
     connect(openAct, SIGNAL(triggered()), this, SLOT(openFile()));
 
+    QAction *saveProjectAct = new QAction(tr("&Save Project"), this);
+    saveProjectAct->setShortcuts(QKeySequence::Save);
+    connect(saveProjectAct, SIGNAL(triggered()), this, SLOT(saveProject()));
+
+    QAction *saveProjectAsAct = new QAction(tr("Save Project As..."), this);
+    saveProjectAsAct->setShortcuts(QKeySequence::SaveAs);
+    connect(saveProjectAsAct, SIGNAL(triggered()), this, SLOT(saveProjectAs()));
+
     foreach (QByteArray format, QImageWriter::supportedImageFormats()) {
         QString text = tr("%1...").arg(QString(format).toUpper());
 
@@ -188,6 +223,8 @@ void MainWindow::setupMenuBar()
     fileMenu = new QMenu(tr("&File"), this);
     menuBar()->addMenu(fileMenu);
     fileMenu->addAction(openAct);
+    fileMenu->addAction(saveProjectAct);
+    fileMenu->addAction(saveProjectAsAct);
     fileMenu->addMenu(saveAsMenu);
     fileMenu->addAction(printAct);
     fileMenu->addSeparator();
@@ -198,6 +235,23 @@ void MainWindow::setupMenuBar()
     fileMenu->addSeparator();
     fileMenu->addAction(exitAct);
 
+    editMenu = menuBar()->addMenu(tr("&Edit"));
+    QAction *undoAct = centerScribbleArea->undoStack()->createUndoAction(this, tr("&Undo"));
+    undoAct->setShortcuts(QKeySequence::Undo);
+    editMenu->addAction(undoAct);
+    QAction *redoAct = centerScribbleArea->undoStack()->createRedoAction(this, tr("&Redo"));
+    redoAct->setShortcuts(QKeySequence::Redo);
+    editMenu->addAction(redoAct);
+    editMenu->addSeparator();
+    QAction *foregroundAct = editMenu->addAction(tr("&Foreground Color..."));
+    connect(foregroundAct, SIGNAL(triggered()), this, SLOT(foregroundColor()));
+    editMenu->addSeparator();
+    QAction *undoMemoryAct = editMenu->addAction(tr("Undo &Memory..."));
+    connect(undoMemoryAct, SIGNAL(triggered()), this, SLOT(undoMemoryBudget()));
+    QAction *canvasMemoryAct = editMenu->addAction(tr("&Canvas Memory..."));
+    connect(canvasMemoryAct, SIGNAL(triggered()), this, SLOT(canvasMemoryLimit()));
+
+    setupLayerMenu();
 
     windowWidgetMenu = menuBar()->addMenu(tr("&Window"));
 
@@ -214,6 +268,127 @@ void MainWindow::setupMenuBar()
     menuBar()->addMenu(aboutMenu);
 }
 
+void MainWindow::setupLayerMenu()
+{
+    layerMenu = menuBar()->addMenu(tr("&Layer"));
+    connect(layerMenu, SIGNAL(aboutToShow()), this, SLOT(updateLayerMenu()));
+
+    QAction *newLayerAct = layerMenu->addAction(tr("&New Layer"));
+    newLayerAct->setShortcut(QKeySequence(Qt::CTRL + Qt::SHIFT + Qt::Key_N));
+    connect(newLayerAct, SIGNAL(triggered()), centerScribbleArea, SLOT(newLayer()));
+
+    QAction *duplicateLayerAct = layerMenu->addAction(tr("&Duplicate Layer"));
+    duplicateLayerAct->setShortcut(QKeySequence(Qt::CTRL + Qt::Key_J));
+    connect(duplicateLayerAct, SIGNAL(triggered()), centerScribbleArea, SLOT(duplicateLayer()));
+
+    QAction *deleteLayerAct = layerMenu->addAction(tr("De&lete Layer"));
+    connect(deleteLayerAct, SIGNAL(triggered()), centerScribbleArea, SLOT(deleteLayer()));
+
+    layerMenu->addSeparator();
+
+    QAction *layerAboveAct = layerMenu->addAction(tr("Select Layer &Above"));
+    layerAboveAct->setShortcut(QKeySequence(Qt::ALT + Qt::Key_BracketRight));
+    connect(layerAboveAct, SIGNAL(triggered()), centerScribbleArea, SLOT(selectLayerAbove()));
+
+    QAction *layerBelowAct = layerMenu->addAction(tr("Select Layer &Below"));
+    layerBelowAct->setShortcut(QKeySequence(Qt::ALT + Qt::Key_BracketLeft));
+    connect(layerBelowAct, SIGNAL(triggered()), centerScribbleArea, SLOT(selectLayerBelow()));
+
+    layerMenu->addSeparator();
+
+    QAction *visibilityAct = layerMenu->addAction(tr("&Toggle Visibility"));
+    connect(visibilityAct, SIGNAL(triggered()), centerScribbleArea, SLOT(toggleLayerVisibility()));
+
+    QAction *opacityAct = layerMenu->addAction(tr("&Opacity..."));
+    connect(opacityAct, SIGNAL(triggered()), this, SLOT(layerOpacity()));
+
+    blendModeMenu = layerMenu->addMenu(tr("Blend &Mode"));
+    blendModeGroup = new QActionGroup(this);
+    blendModeGroup->setExclusive(true);
+    QStringList modeNames = Layer::blendModeNames();
+    for(int i = 0; i < modeNames.size(); i++)
+    {
+        QAction *action = blendModeMenu->addAction(modeNames.at(i));
+        action->setCheckable(true);
+        action->setData(i);
+        blendModeGroup->addAction(action);
+    }
+    connect(blendModeGroup, SIGNAL(triggered(QAction*)), this, SLOT(layerBlendMode(QAction*)));
+}
+
+void MainWindow::updateLayerMenu()
+{
+    // the current layer may have changed since the menu was last shown
+    const Layer *layer = centerScribbleArea->currentLayer();
+    blendModeMenu->setEnabled(layer != 0);
+    if(!layer) return;
+
+    blendModeGroup->actions().at(layer->blendMode)->setChecked(true);
+}
+
+void MainWindow::recoverWork()
+{
+    if (!centerScribbleArea->canRecover())
+        return;
+
+    QMessageBox::StandardButton ret;
+    ret = QMessageBox::question(this, tr("PMIG"),
+                                tr("PMIG was not closed properly, and some work was not saved.\n"
+                                   "Do you want to recover it?"),
+                                QMessageBox::Yes | QMessageBox::Discard);
+    if (ret == QMessageBox::Discard)
+        centerScribbleArea->discardJournal();
+    else if (centerScribbleArea->recoverJournal())
+        foreach (ToolTweak *tweak, toolsToolBar)
+            tweak->refresh();
+}
+
+void MainWindow::foregroundColor()
+{
+    QColor color = QColorDialog::getColor(centerScribbleArea->foregroundColor(), this,
+                                          tr("Foreground Color"));
+    if(color.isValid())
+        centerScribbleArea->setForegroundColor(color);
+}
+
+void MainWindow::undoMemoryBudget()
+{
+    // past this the oldest steps move to a temporary file
+    bool ok;
+    int megabytes = QInputDialog::getInt(this, tr("Undo Memory"), tr("Undo history in memory (MB):"),
+                                         centerScribbleArea->undoMemoryBudget(), 16, 65536, 16, &ok);
+    if(ok)
+        centerScribbleArea->setUndoMemoryBudget(megabytes);
+}
+
+void MainWindow::canvasMemoryLimit()
+{
+    // images past half of it go to the scratch file, see ScratchFile
+    bool ok;
+    int megabytes = QInputDialog::getInt(this, tr("Canvas Memory"), tr("Canvas tiles in memory (MB):"),
+                                         int(ScratchFile::residentLimit() >> 20), 64, 1 << 20, 64, &ok);
+    if(ok)
+        ScratchFile::setResidentLimit(qint64(megabytes) << 20);
+}
+
+void MainWindow::layerOpacity()
+{
+    const Layer *layer = centerScribbleArea->currentLayer();
+    if(!layer) return;
+
+    bool ok;
+    int opacity = QInputDialog::getInt(this, tr("Layer Opacity"),
+                                       tr("Opacity of %1 (%):").arg(layer->name),
+                                       qRound(layer->opacity * 100), 0, 100, 1, &ok);
+    if(ok)
+        centerScribbleArea->setLayerOpacity(opacity / 100.0);
+}
+
+void MainWindow::layerBlendMode(QAction *action)
+{
+    centerScribbleArea->setLayerBlendMode(action->data().toInt());
+}
+
 void MainWindow::setDockOptions()
 {
     DockOptions dockOptions = AnimatedDocks|AllowTabbedDocks|ForceTabbedDocks;
@@ -385,8 +560,15 @@ void MainWindow::openFile()
     if (maybeSave()) {
         QString fileName = QFileDialog::getOpenFileName(this,
                                    tr("Open File"), QDir::currentPath());
-        if (!fileName.isEmpty())
-        {
+        if (fileName.isEmpty())
+            return;
+
+        if (QFileInfo(fileName).suffix().toLower() == "pmig") {
+            if (centerScribbleArea->openProject(fileName)) {
+                foreach (ToolTweak *tweak, toolsToolBar)
+                    tweak->refresh();
+            }
+        } else {
             centerScribbleArea->openImage(fileName);
         }
     }
@@ -412,6 +594,29 @@ bool MainWindow::saveWrite(const QByteArray fileFormat)
     }
 }
 
+bool MainWindow::saveProject()
+{
+    QString fileName = centerScribbleArea->projectFileName();
+    if (fileName.isEmpty())
+        return saveProjectAs();
+    return centerScribbleArea->saveProject(fileName);
+}
+
+bool MainWindow::saveProjectAs()
+{
+    QString initialPath = centerScribbleArea->projectFileName();
+    if (initialPath.isEmpty())
+        initialPath = QDir::currentPath() + "/untitled.pmig";
+
+    QString fileName = QFileDialog::getSaveFileName(this, tr("Save Project As"),
+                               initialPath, tr("PMIG Projects (*.pmig)"));
+    if (fileName.isEmpty())
+        return false;
+    if (QFileInfo(fileName).suffix().isEmpty())
+        fileName += ".pmig";
+    return centerScribbleArea->saveProject(fileName);
+}
+
 void MainWindow::saveFile()
 {
     QAction *action = qobject_cast<QAction *>(sender());
@@ -430,7 +635,7 @@ bool MainWindow::maybeSave()
                           QMessageBox::Save | QMessageBox::Discard
               | QMessageBox::Cancel);
         if (ret == QMessageBox::Save) {
-            return saveWrite("png");
+            return saveProject();
         } else if (ret == QMessageBox::Cancel) {
             return false;
         }
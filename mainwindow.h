@@ -30,6 +30,10 @@ class MainWindow : public QMainWindow
     //QList<ToolBar*> toolBars;
 
     QMenu *fileMenu;
+    QMenu *editMenu;
+    QMenu *layerMenu;
+    QMenu *blendModeMenu;
+    QActionGroup *blendModeGroup;
     QMenu *mainWindowMenu;
     QMenu *windowWidgetMenu;
     QMenu *aboutMenu;
@@ -50,6 +54,8 @@ protected:
 public slots:
     void openFile();
     void saveFile();
+    bool saveProject();
+    bool saveProjectAs();
     bool saveWrite(const QByteArray);
     bool maybeSave();
     //void penColor();
@@ -68,6 +74,7 @@ private:
 
     void setupToolBar();
     void setupMenuBar();
+    void setupLayerMenu();
     void setupWindowWidgets();
     void setDockOptions();
     void switchToolsToolBar(ToolType::toolType newToolType);
@@ -79,6 +86,14 @@ private:
 //    QAction *clearScreenAct;
 
 private slots:
+    void recoverWork();
+    void foregroundColor();
+    void undoMemoryBudget();
+    void canvasMemoryLimit();
+    void layerOpacity();
+    void layerBlendMode(QAction *action);
+    void updateLayerMenu();
+
     void setToolMarquee(bool toggle){
         if(toggle) switchToolsToolBar(ToolType::Marquee);
     }
@@ -91,6 +106,12 @@ private slots:
     void setToolErase(bool toggle){
         if(toggle) switchToolsToolBar(ToolType::Erase);
     }
+    void setToolFill(bool toggle){
+        if(toggle) switchToolsToolBar(ToolType::Fill);
+    }
+    void setToolMagicWand(bool toggle){
+        if(toggle) switchToolsToolBar(ToolType::MagicWand);
+    }
 
 signals:
 
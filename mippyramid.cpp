@@ -0,0 +1,160 @@
+﻿#include <QtConcurrent>
+#include <string.h>
+
+#include "mippyramid.h"
+#include "scratchfile.h"
+
+// 2x2 box filter on premultiplied pixels, the last odd row/column is
+// averaged with itself
+static QImage halfSize(const QImage &source)
+{
+    int width = (source.width() + 1) / 2;
+    int height = (source.height() + 1) / 2;
+    QImage half(width, height, QImage::Format_ARGB32_Premultiplied);
+
+    for(int y = 0; y < height; y++)
+    {
+        const uchar *row0 = source.constScanLine(2*y);
+        const uchar *row1 = source.constScanLine(qMin(2*y + 1, source.height() - 1));
+        uchar *out = half.scanLine(y);
+        for(int x = 0; x < width; x++)
+        {
+            int x0 = 8*x;
+            int x1 = (2*x + 1 < source.width()) ? x0 + 4 : x0;
+            for(int c = 0; c < 4; c++)
+                out[4*x + c] = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2;
+        }
+    }
+    return half;
+}
+
+struct MipTileBuilder
+{
+    typedef MipTile result_type;
+
+    MipTileBuilder(const TiledImage &image, int levelCount)
+        :image(image), levelCount(levelCount) {}
+
+    MipTile operator()(int index) const
+    {
+        MipTile mipTile;
+        mipTile.index = index;
+        // a shallow header, halfSize only reads it
+        QImage level = image.constTile(index).image();
+        for(int k = 1; k <= levelCount; k++)
+        {
+            level = halfSize(level);
+            mipTile.levels.append(level);
+        }
+        return mipTile;
+    }
+
+    TiledImage image;   // snapshot, later strokes detach from it
+    int levelCount;
+};
+
+
+MipPyramid::MipPyramid(QObject *parent)
+    :QObject(parent)
+{
+    isBuilt = false;
+    tileColumns = 0;
+    watcher = new QFutureWatcher<MipTile>(this);
+    connect(watcher, SIGNAL(finished()), this, SLOT(jobFinished()));
+}
+
+MipPyramid::~MipPyramid()
+{
+    watcher->cancel();
+    watcher->waitForFinished();
+}
+
+int MipPyramid::levelFor(qreal zoom) const
+{
+    if(!isBuilt) return 0;
+
+    // the deepest level that is still at least as big as the screen
+    int k = 0;
+    while(k < levels.size() && zoom <= 0.5)
+    {
+        zoom *= 2;
+        k++;
+    }
+    return k;
+}
+
+void MipPyramid::reset(const TiledImage &image)
+{
+    watcher->cancel();
+    watcher->waitForFinished();
+
+    imageSize = image.size();
+    tileColumns = image.tileColumns();
+    isBuilt = false;
+
+    levels.clear();
+    int maxSide = qMax(image.width(), image.height());
+    for(int k = 1; k <= MaxLevels && (maxSide >> (k-1)) > TiledImage::TileSize; k++)
+    {
+        int scale = 1 << k;
+        levels.append(ScratchFile::image(QSize((image.width() + scale - 1) / scale,
+                                               (image.height() + scale - 1) / scale)));
+    }
+
+    dirtyTiles.clear();
+    for(int i = 0; i < image.tileCount(); i++)
+        dirtyTiles.insert(i);
+    update(image);
+}
+
+void MipPyramid::invalidate(const TiledImage &image, const QRect &rect)
+{
+    foreach(int index, image.tilesIn(rect))
+        dirtyTiles.insert(index);
+    update(image);
+}
+
+void MipPyramid::update(const TiledImage &image)
+{
+    if(watcher->isRunning() || dirtyTiles.isEmpty()) return;
+    if(levels.isEmpty())
+    {
+        // too small to need any level
+        dirtyTiles.clear();
+        return;
+    }
+
+    QList<int> indexes = dirtyTiles.toList();
+    dirtyTiles.clear();
+    watcher->setFuture(QtConcurrent::mapped(indexes, MipTileBuilder(image, levels.size())));
+}
+
+void MipPyramid::jobFinished()
+{
+    if(watcher->isCanceled()) return;
+
+    QRect changedRect;
+    QFuture<MipTile> future = watcher->future();
+    for(int i = 0; i < future.resultCount(); i++)
+    {
+        const MipTile &mipTile = future.resultAt(i);
+        int column = mipTile.index % tileColumns;
+        int row = mipTile.index / tileColumns;
+
+        for(int k = 1; k <= mipTile.levels.size(); k++)
+        {
+            const QImage &patch = mipTile.levels.at(k-1);
+            QImage &target = levels[k-1];
+            int x = column * (TiledImage::TileSize >> k);
+            int y = row * (TiledImage::TileSize >> k);
+            for(int line = 0; line < patch.height(); line++)
+                memcpy(target.scanLine(y + line) + 4*x, patch.constScanLine(line), 4*patch.width());
+        }
+
+        changedRect |= QRect(column * TiledImage::TileSize, row * TiledImage::TileSize,
+                             TiledImage::TileSize, TiledImage::TileSize);
+    }
+
+    isBuilt = true;
+    emit updated(changedRect & QRect(QPoint(0, 0), imageSize));
+}
@@ -0,0 +1,64 @@
+﻿#ifndef MIPPYRAMID_H
+#define MIPPYRAMID_H
+
+#include <QObject>
+#include <QImage>
+#include <QVector>
+#include <QSet>
+#include <QRect>
+#include <QFutureWatcher>
+
+#include "tiledimage.h"
+
+// the downscaled copies of one tile, levels[k-1] is 1/2^k of its size
+struct MipTile
+{
+    int index;
+    QVector<QImage> levels;
+};
+
+
+/* Downscaled copies of a TiledImage at 1/2, 1/4, ... so zoomed out views
+ * sample a small image instead of letting QPainter reduce the whole one on
+ * every paint. Levels are built per tile on the thread pool from a copy on
+ * write snapshot, and after a stroke only the tiles it touched are redone.
+ */
+class MipPyramid : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum { MaxLevels = 8 };   // TiledImage::TileSize == 1 << MaxLevels
+
+    MipPyramid(QObject *parent = 0);
+    ~MipPyramid();
+
+    int levelCount() const {return levels.size();}
+    // the level to sample at zoom, 0 means the full resolution tiles
+    int levelFor(qreal zoom) const;
+    const QImage &level(int k) const {return levels.at(k-1);}
+
+    // drops all levels and rebuilds them in the background
+    void reset(const TiledImage &image);
+    void invalidate(const TiledImage &image, const QRect &rect);
+    // starts a job for the dirty tiles unless one is already running
+    void update(const TiledImage &image);
+
+signals:
+    // rect is in full resolution image coordinates
+    void updated(const QRect &rect);
+
+private slots:
+    void jobFinished();
+
+private:
+    QVector<QImage> levels;
+    bool isBuilt;
+    QSet<int> dirtyTiles;
+    QSize imageSize;
+    int tileColumns;
+
+    QFutureWatcher<MipTile> *watcher;
+};
+
+#endif // MIPPYRAMID_H
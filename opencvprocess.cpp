@@ -2,18 +2,26 @@
 #include <QWidget>
 #include <QPainter>
 #include <QBitmap>
+#include <QFileInfo>
 
 #include "opencvprocess.h"
+#include "imagesaver.h"
+#include "floodfill.h"
 
 OpencvProcess::OpencvProcess(QWidget *parent)
     :QWidget(parent)
 {
     currentImageNum=-1;
     toolType=ToolType::Brush;
-    somethingSelected=false;
+    fgColor=Qt::black;
+    bgColor=Qt::white;
 
     brushToolFunction = new BrushToolFunction(this);
     eraseToolFunction = new EraseToolFunction(this);
+    marqueeToolFunction = new MarqueeToolFunction(this);
+    fillToolFunction = new FillToolFunction(this);
+    magicWandToolFunction = new MagicWandToolFunction(this);
+    brushEngine.clipTo(&selection);
 
 }
 
@@ -30,10 +38,43 @@ bool OpencvProcess::openImage(const char*fileName)
 //        qDebug()<<"Unable to load image "<<fileName;
 //        return false;
 //    }
-    IplImage *img = cvLoadImage(fileName);
+    IplImage *img = PixelBuffer::loadImage(fileName);
     if(img)
     {
-        imageStack.append(img);
+        // the first image sets the canvas size, later ones are placed at its
+        // top left and cropped to it
+        QSize canvasSize = layerStack.isEmpty() ? QSize(img->width, img->height)
+                                                : layerStack.canvasSize();
+        if(layerStack.isEmpty()) selection = SelectionMask(canvasSize);
+
+        // keep only the tiled copy, the decoded image is dropped right away
+        Layer layer(TiledImage(canvasSize.width(), canvasSize.height()),
+                    QFileInfo(QString::fromLocal8Bit(fileName)).baseName());
+        bool ok;
+        int type = Mat(img).type();
+        if(WindowLevel::isNativeType(type))
+        {
+            // kept at full precision, the BGRA tiles only show it
+            layer.native = TiledImage(canvasSize.width(), canvasSize.height(), type);
+            layer.window = WindowLevel(type);
+            ok = layer.native.copyFrom(img, QPoint(0, 0));
+        }
+        else
+        {
+            double mini, maxi;
+            PixelBuffer::floatWindow(img, &mini, &maxi);
+            ok = layer.image.convertFrom(img, mini, maxi);
+        }
+        cvReleaseImage(&img);
+        if(!ok) return false;
+
+        if(!layer.native.isNull())
+        {
+            layer.window.fitToRange(layer.native);
+            layer.window.render(layer.native, &layer.image, layer.native.tilesIn(layer.native.rect()));
+        }
+        layerStack.append(layer);
+        currentImageNum = layerStack.size()-1;
         return true;
     }
     else
@@ -45,6 +86,63 @@ bool OpencvProcess::openImage(const char*fileName)
 
 bool OpencvProcess::saveImage(const char *fileName, const char *fileFormat)
 {
+    // ScribbleArea saves in the background through ImageSaver, this is the
+    // blocking path for callers without an event loop
+    QString error;
+    if(ImageSaver::write(layerStack, QString::fromLocal8Bit(fileName), fileFormat, &error))
+        return true;
+
+    qDebug()<<"Unable to save image "<<fileName<<error;
+    return false;
+}
+
+int OpencvProcess::beginLayer(const QSize &imageSize, const QString &name)
+{
+    QSize canvasSize = layerStack.isEmpty() ? imageSize : layerStack.canvasSize();
+    if(layerStack.isEmpty()) selection = SelectionMask(canvasSize);
+
+    TiledImage image(canvasSize.width(), canvasSize.height());
+    image.fill(Scalar::all(0));
+    layerStack.append(Layer(image, name));
+    currentImageNum = layerStack.size()-1;
+    return currentImageNum;
+}
+
+void OpencvProcess::discardLayer(int index)
+{
+    layerStack.remove(index);
+    currentImageNum = qMin(currentImageNum, layerStack.size()-1);
+}
+
+void OpencvProcess::addLayer()
+{
+    if(layerStack.isEmpty()) return;
+
+    TiledImage image(layerStack.canvasSize().width(), layerStack.canvasSize().height());
+    image.fill(Scalar::all(0));
+    currentImageNum++;
+    layerStack.insert(currentImageNum, Layer(image, QString("Layer %1").arg(layerStack.size()+1)));
+}
+
+void OpencvProcess::duplicateLayer()
+{
+    if(currentImageNum < 0) return;
+
+    // shares every tile until one side draws on it
+    Layer layer = layerStack.at(currentImageNum);
+    layer.id = Layer::newId();
+    layer.name += " copy";
+    currentImageNum++;
+    layerStack.insert(currentImageNum, layer);
+}
+
+bool OpencvProcess::removeLayer()
+{
+    // the bottom layer carries the canvas size, keep at least one
+    if(layerStack.size() <= 1) return false;
+
+    layerStack.remove(currentImageNum);
+    currentImageNum = qMin(currentImageNum, layerStack.size()-1);
     return true;
 }
 
@@ -53,12 +151,23 @@ void OpencvProcess::updateCursor()
     switch(toolType)
     {
     case ToolType::Marquee:
+    case ToolType::Fill:
+    case ToolType::MagicWand:
         parentWidget()->setCursor(QCursor(Qt::CrossCursor));
         break;
     case ToolType::Erase:
     {
-        QPixmap cursorPixmap(eraseToolFunction->getEraseSize(), eraseToolFunction->getEraseSize());
-        cursorPixmap.fill(Qt::white);
+        // the outline of the eraser shape
+        int size = eraseToolFunction->getEraseSize();
+        QPixmap cursorPixmap(size + 2, size + 2);
+        cursorPixmap.fill(Qt::transparent);
+        QPainter painter(&cursorPixmap);
+        painter.setPen(Qt::gray);
+        if(eraseToolFunction->getEraseShape() == EraseToolBase::Square)
+            painter.drawRect(0, 0, size, size);
+        else
+            painter.drawEllipse(0, 0, size, size);
+        painter.end();
         parentWidget()->setCursor(QCursor(cursorPixmap));
     }
         break;
@@ -75,71 +184,227 @@ void OpencvProcess::setToolType(ToolType::toolType toolType)
 
 void OpencvProcess::ApplyToolFunction(QPoint lastPoint, QPoint currentPoint)
 {
-    switch (toolType) {
-    case ToolType::Brush:
-        drawLineTo(lastPoint, currentPoint);
-        break;
-    default:
-        break;
+    QVector<StrokeSegment> segments;
+    segments.append(StrokeSegment(QLineF(lastPoint, currentPoint)));
+    ApplyToolFunction(segments);
+}
+
+void OpencvProcess::ApplyToolFunction(const QVector<StrokeSegment> &segments)
+{
+    foreach(const StrokeSegment &segment, segments)
+    {
+        switch (toolType) {
+        case ToolType::Brush:
+            markDirty(drawSegment(segment));
+            break;
+        case ToolType::Erase:
+            markDirty(eraseSegment(segment));
+            break;
+        default:
+            break;
+        }
     }
 
     //ALL CHANGE MADE TO IMAGE MUST CALL THIS TO DISPALY
-    emit updateDisplay(currentImageNum);
+    // one update for the whole batch
+    flushDirty();
 }
 
 void OpencvProcess::ApplyToolFunction(QPoint currentPoint)
 {
     switch(toolType){
     case ToolType::Erase:
-        vertexA.x=currentPoint.rx() - eraseToolFunction->getEraseSize()/2;
-        vertexA.y=currentPoint.ry() - eraseToolFunction->getEraseSize()/2;
-        vertexB.x=vertexA.x + eraseToolFunction->getEraseSize();
-        vertexB.y=vertexA.y + eraseToolFunction->getEraseSize();
-        ApplyToolFunction();
+        markDirty(eraseAt(currentPoint));
+        break;
+    case ToolType::Fill:
+        markDirty(fillAt(currentPoint));
         break;
     default:
         break;
     }
 
-    //ALL CHANGE MADE TO IMAGE MUST CALL THIS TO DISPALY
-    emit updateDisplay(currentImageNum);
+    flushDirty();
 }
 
 void OpencvProcess::ApplyToolFunction()
 {
     switch (toolType) {
     case ToolType::Erase:
-        cvRectangle(imageStack[currentImageNum], vertexA, vertexB, CV_RGB(255,255,255), -1);
+        markDirty(eraseSelection());
         break;
     default:
         break;
     }
 
-    emit updateDisplay(currentImageNum);
+    flushDirty();
 }
 
-void OpencvProcess::drawLineTo(QPoint lastPoint, QPoint currentPoint)
+QRect OpencvProcess::eraseAt(QPoint currentPoint)
 {
+    return eraseSegment(StrokeSegment(QLineF(currentPoint, currentPoint)));
+}
 
-    int lineType = CV_AA; // change it to 8 to see non-antialiased graphics
-    if(brushToolFunction->getAntiAliasing())
-        lineType = CV_AA;
-    else
-        lineType = 8;
-    //Mat image = Mat::zeros(height, width, CV_8UC3);
-    //Mat image(imageStack[currentImageNum]);
+QRect OpencvProcess::eraseSegment(const StrokeSegment &segment)
+{
+    if(!layerStack.at(currentImageNum).native.isNull()) return QRect();
+
+    // a soft eraser is a round one without a hard core
+    int shape = eraseToolFunction->getEraseShape();
+    BrushEngine::Settings settings;
+    settings.shape = shape == EraseToolBase::Square ? BrushEngine::Square : BrushEngine::Round;
+    settings.size = eraseToolFunction->getEraseSize();
+    settings.hardness = shape == EraseToolBase::Soft ? 0 : 100;
+    settings.opacity = 100;
+    settings.flow = 100;
+    settings.spacing = 10;
+    settings.antiAliasing = true;
+    return brushEngine.strokeTo(&layerStack[currentImageNum], segment.line.p1(), segment.line.p2(),
+                                settings, QColor(0, 0, 0, 0), segment.startPressure, segment.endPressure);
+}
+
+QRect OpencvProcess::eraseRect(CvPoint cornerA, CvPoint cornerB)
+{
+    // cvRectangle fills both corners inclusive
+    QRect rect = QRect(QPoint(cornerA.x, cornerA.y), QPoint(cornerB.x, cornerB.y)).normalized();
+    Layer &layer = layerStack[currentImageNum];
+    if(!layer.native.isNull()) return QRect();
+    TiledImage &image = layer.image;
+    Scalar color = Scalar(0,0,0,0);
+    foreach(int index, image.tilesIn(rect))
+    {
+        QPoint origin = image.tileRect(index).topLeft();
+        cvRectangle(image.tile(index).iplImage(),
+                    cvPoint(cornerA.x - origin.x(), cornerA.y - origin.y()),
+                    cvPoint(cornerB.x - origin.x(), cornerB.y - origin.y()),
+                    color, -1);
+    }
+    return rect;
+}
+
+QRect OpencvProcess::eraseSelection()
+{
+    if(!layerStack.at(currentImageNum).native.isNull()) return QRect();
+    return brushEngine.fill(&layerStack[currentImageNum], selection, QColor(0, 0, 0, 0));
+}
+
+void OpencvProcess::select(const QPolygonF &points, SelectionMask::Mode mode)
+{
+    if(points.isEmpty() || layerStack.isEmpty()) return;
+    // a selection left from a canvas of another size starts over
+    if(selection.size() != layerStack.canvasSize())
+        selection = SelectionMask(layerStack.canvasSize());
+
+    QRect box = QRect(points.first().toPoint(), points.last().toPoint()).normalized();
+    switch(marqueeToolFunction->getSelectionType())
+    {
+    case MarqueeToolBase::Ellipse:
+        selection.selectEllipse(box, mode);
+        break;
+    case MarqueeToolBase::Lasso:
+        selection.selectPolygon(points, mode);
+        break;
+    default:
+        selection.selectRect(box, mode);
+        break;
+    }
+}
+
+void OpencvProcess::clearSelection()
+{
+    selection = SelectionMask(layerStack.canvasSize());
+}
+
+void OpencvProcess::selectSimilar(QPoint point, SelectionMask::Mode mode)
+{
+    // on native layers the display would set the tolerance, see FloodFill
+    if(currentImageNum < 0 || !layerStack.at(currentImageNum).native.isNull()) return;
+    if(selection.size() != layerStack.canvasSize())
+        selection = SelectionMask(layerStack.canvasSize());
+
+    SelectionMask region = FloodFill::region(layerStack.at(currentImageNum).image, point,
+                                             magicWandToolFunction->getTolerance(),
+                                             magicWandToolFunction->getContiguous());
+    selection.select(region, mode);
+}
+
+QRect OpencvProcess::fillAt(QPoint point)
+{
+    Layer &layer = layerStack[currentImageNum];
+    if(!layer.native.isNull()) return QRect();
+    SelectionMask region = FloodFill::region(layer.image, point, fillToolFunction->getTolerance(),
+                                             fillToolFunction->getContiguous());
+    if(!selection.isEmpty() && selection.size() == region.size())
+        region.select(selection, SelectionMask::Intersect);
+    return brushEngine.fill(&layer, region, fgColor);
+}
 
-    Point pt1, pt2;
+QRect OpencvProcess::drawLineTo(QPoint lastPoint, QPoint currentPoint)
+{
+    return drawSegment(StrokeSegment(QLineF(lastPoint, currentPoint)));
+}
+
+QRect OpencvProcess::drawSegment(const StrokeSegment &segment)
+{
+    // dabs of the foreground colour, see BrushEngine
+    BrushEngine::Settings settings;
+    settings.shape = BrushEngine::Round;
+    settings.size = brushToolFunction->getBrushSize();
+    settings.hardness = brushToolFunction->getHardness();
+    settings.opacity = brushToolFunction->getOpacity();
+    settings.flow = brushToolFunction->getFlow();
+    settings.spacing = brushToolFunction->getSpacing();
+    settings.antiAliasing = brushToolFunction->getAntiAliasing();
+    return drawSegment(segment, settings, fgColor);
+}
+
+QRect OpencvProcess::drawSegment(const StrokeSegment &segment, const BrushEngine::Settings &settings,
+                                 const QColor &color)
+{
+    return brushEngine.strokeTo(&layerStack[currentImageNum], segment.line.p1(), segment.line.p2(),
+                                settings, color, segment.startPressure, segment.endPressure);
+}
+
+void OpencvProcess::endStroke()
+{
+    brushEngine.endStroke();
+}
 
-    pt1.x=lastPoint.x();
-    pt1.y=lastPoint.y();
-    pt2.x=currentPoint.x();
-    pt2.y=currentPoint.y();
+void OpencvProcess::markDirty(const QRect &rect)
+{
+    dirtyRect |= rect;
+}
+
+void OpencvProcess::flushDirty()
+{
+    if(currentImageNum < 0 || dirtyRect.isEmpty()) return;
 
-    //line( image, pt1, pt2,  Scalar(icolor&255, (icolor>>8)&255, (icolor>>16)&255), rng.uniform(1,10), lineType );
-    cvLine(imageStack[currentImageNum], pt1, pt2, cvScalar(100,50,50,50), brushToolFunction->getBrushSize(), lineType);
+    QRect changedRect = dirtyRect & layerStack.at(currentImageNum).image.rect();
+    dirtyRect = QRect();
+    changedRect = refreshNative(currentImageNum, changedRect);
 
-    return;
+    if(!changedRect.isEmpty())
+        emit updateDisplay(currentImageNum, changedRect);
 }
 
+void OpencvProcess::notifyChanged(int imageNum, const QRect &changedRect)
+{
+    if(imageNum < 0 || imageNum >= layerStack.size()) return;
+    emit updateDisplay(imageNum, refreshNative(imageNum, changedRect & layerStack.at(imageNum).image.rect()));
+}
 
+QRect OpencvProcess::refreshNative(int imageNum, const QRect &changedRect)
+{
+    if(layerStack.at(imageNum).native.isNull() || changedRect.isEmpty()) return changedRect;
+    Layer &layer = layerStack[imageNum];
+
+    // the window follows the samples, only the changed tiles are rescanned
+    QVector<int> tiles = layer.native.tilesIn(changedRect);
+    layer.window.invalidate(tiles);
+    if(layer.window.fitToRange(layer.native))
+    {
+        layer.window.render(layer.native, &layer.image, layer.native.tilesIn(layer.native.rect()));
+        return layer.image.rect();
+    }
+    layer.window.render(layer.native, &layer.image, tiles);
+    return changedRect;
+}
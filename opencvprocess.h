@@ -5,17 +5,36 @@
 #include <QWidget>
 #include <QList>
 #include <QPoint>
+#include <QRect>
+#include <QLine>
 #include <QVector>
 #include <QColor>
+#include <QPolygonF>
 #include <QDebug>
 
 #include <cv.h>
 #include <highgui.h>
 
 #include "toolbox.h"
+#include "tiledimage.h"
+#include "layerstack.h"
+#include "brushengine.h"
+#include "selectionmask.h"
 
 using namespace cv;
 
+// a piece of a stroke in image coordinates, with the pen pressure (0..1)
+// at either end
+struct StrokeSegment
+{
+    StrokeSegment() :startPressure(1), endPressure(1) {}
+    StrokeSegment(const QLineF &line, qreal startPressure = 1, qreal endPressure = 1)
+        :line(line), startPressure(startPressure), endPressure(endPressure) {}
+
+    QLineF line;
+    qreal startPressure, endPressure;
+};
+
 class OpencvProcess:public QWidget
 {
     Q_OBJECT
@@ -24,35 +43,86 @@ private:
     ToolType::toolType toolType;
     BrushToolFunction *brushToolFunction;
     EraseToolFunction *eraseToolFunction;
+    MarqueeToolFunction *marqueeToolFunction;
+    FillToolFunction *fillToolFunction;
+    MagicWandToolFunction *magicWandToolFunction;
+    BrushEngine brushEngine;
+
+    // region of the current image touched since the last updateDisplay
+    QRect dirtyRect;
+    void markDirty(const QRect &rect);
+    void flushDirty();
+    // renders the BGRA tiles of a native depth layer from its samples,
+    // returns the rect to update, all of it if the window moved
+    QRect refreshNative(int imageNum, const QRect &changedRect);
 
 protected:
 
 public:
     int currentImageNum;
 
-
-    bool somethingSelected;
-    //QRect rectangleSelection;
-    CvPoint vertexA, vertexB;  // ellipse selection also uses this
-    QVector<CvPoint> irregularSelectionPoints;
-    long int irregularSelectionPointNum;
+    // the tools paint only inside it, when there is one
+    SelectionMask selection;
+    // a marquee shape of the current MarqueeToolBase::SelectionType, the
+    // opposite corners of a rectangle or an ellipse's box, or the points of
+    // a lasso, in image coordinates
+    void select(const QPolygonF &points, SelectionMask::Mode mode);
+    void clearSelection();
+    // the magic wand: what matches the pixel at point, see FloodFill; not
+    // on native depth layers, like fillAt
+    void selectSimilar(QPoint point, SelectionMask::Mode mode);
+    SelectionMask::Mode selectionMode() const {return SelectionMask::Mode(marqueeToolFunction->getSelectionMode());}
+    int selectionType() const {return marqueeToolFunction->getSelectionType();}
 
     QColor fgColor, bgColor;
+    int brushSize() const {return brushToolFunction->getBrushSize();}
 
     void setToolType(ToolType::toolType toolType);
 
-    void drawLineTo(QPoint lastPoint, QPoint currentPoint);
+    QRect drawLineTo(QPoint lastPoint, QPoint currentPoint);
+    QRect drawSegment(const StrokeSegment &segment);
+    // with settings and color of its own rather than the tool panel's
+    QRect drawSegment(const StrokeSegment &segment, const BrushEngine::Settings &settings,
+                      const QColor &color);
+    // the next drawLineTo starts a new brush stroke
+    void endStroke();
+    // dabs of the eraser shape taking the alpha down, see BrushEngine.
+    // Native depth layers have no alpha to take down, every erase leaves
+    // them as they are
+    QRect eraseAt(QPoint currentPoint);
+    QRect eraseSegment(const StrokeSegment &segment);
+    // clears the rectangle, corners inclusive
+    QRect eraseRect(CvPoint cornerA, CvPoint cornerB);
+    // clears the selection, by its coverage
+    QRect eraseSelection();
+    // the bucket: what matches the pixel at point, inside the selection if
+    // there is one, takes the foreground colour. Native depth layers are
+    // left as they are, their tolerance would be in display greys
+    QRect fillAt(QPoint point);
 
     //IplImage* toolIndicationImage;
-    QList<IplImage*> imageStack;
+    // shared with ScribbleArea, which composites the tiles directly
+    LayerStack layerStack;
 //    QList<Mat> imageStack;
 
     OpencvProcess(QWidget *parent);
     bool openImage(const char *fileName);
     bool saveImage(const char *fileName, const char *fileFormat);
+    // a transparent top layer for an image being loaded, which sets the
+    // canvas size if it is the first one; returns its index
+    int beginLayer(const QSize &imageSize, const QString &name);
+    void discardLayer(int index);
+    // new layers go right above currentImageNum and become current
+    void addLayer();
+    void duplicateLayer();
+    bool removeLayer();
+    // for changes made outside the tools, e.g. undo
+    void notifyChanged(int imageNum, const QRect &changedRect);
     //void setCurrentImageNum(int num);
 
     void ApplyToolFunction(QPoint lastPoint, QPoint currentPoint);
+    // a batch of mouse segments, rasterized with a single updateDisplay
+    void ApplyToolFunction(const QVector<StrokeSegment> &segments);
     void ApplyToolFunction(QPoint currentPoint);
     void ApplyToolFunction();
 
@@ -60,7 +130,8 @@ public slots:
     void updateCursor();
 
 signals:
-    void updateDisplay(int changedImageNum);
+    // changedRect is in image coordinates
+    void updateDisplay(int changedImageNum, const QRect &changedRect);
 };
 
 #endif // OPENCVPROCESS_H
@@ -0,0 +1,140 @@
+﻿#include <QDebug>
+#include <string.h>
+
+#include "pixelbuffer.h"
+#include "pixelconverter.h"
+
+PixelBuffer::PixelBuffer(int width, int height, int type)
+    :slot(-1)
+{
+    uchar *data = CV_ELEM_SIZE(type)*width*height <= ScratchFile::SlotSize ? ScratchFile::allocate(&slot) : 0;
+    pixels = data ? Mat(height, width, type, data) : Mat(height, width, type);
+
+    iplHeader = pixels;
+    if(type == CV_8UC4)
+        qImage = QImage(pixels.data, width, height, (int)pixels.step, QImage::Format_ARGB32_Premultiplied);
+}
+
+PixelBuffer::~PixelBuffer()
+{
+    if(slot >= 0) ScratchFile::release(slot);
+}
+
+void PixelBuffer::copyFrom(const PixelBuffer &other)
+{
+    // same size and type, so copyTo writes into our rows instead of reallocating
+    other.pixels.copyTo(pixels);
+}
+
+QByteArray PixelBuffer::compressed(int level) const
+{
+    int rowBytes = (int)pixels.elemSize()*width();
+    QByteArray raw(rowBytes*height(), Qt::Uninitialized);
+    for(int y = 0; y < height(); y++)
+        memcpy(raw.data() + y*rowBytes, pixels.ptr(y), rowBytes);
+    return qCompress(raw, level);
+}
+
+bool PixelBuffer::uncompress(const uchar *data, int size)
+{
+    QByteArray raw = qUncompress(data, size);
+    int rowBytes = (int)pixels.elemSize()*width();
+    if(raw.size() != rowBytes*height()) return false;
+
+    for(int y = 0; y < height(); y++)
+        memcpy(pixels.ptr(y), raw.constData() + y*rowBytes, rowBytes);
+    return true;
+}
+
+IplImage *PixelBuffer::loadImage(const char *fileName)
+{
+    IplImage *img = cvLoadImage(fileName, CV_LOAD_IMAGE_UNCHANGED);
+    if(!img || PixelConverter::forLayout(img->depth, img->nChannels)) return img;
+
+    IplImage *reduced = cvCreateImage(cvGetSize(img), IPL_DEPTH_8U, img->nChannels);
+    cvConvertScale(img, reduced, img->depth == IPL_DEPTH_16U ? 1/256.0 : 1);
+    cvReleaseImage(&img);
+    return reduced;
+}
+
+template <typename Sample>
+static void widenToColours(const Mat &image, double *mini, double *maxi)
+{
+    int channels = image.channels();
+    int colours = channels == 4 ? 3 : channels;
+    for(int y = 0; y < image.rows; y++)
+    {
+        const Sample *row = image.ptr<Sample>(y);
+        for(int x = 0; x < image.cols; x++, row += channels)
+        {
+            for(int c = 0; c < colours; c++)
+            {
+                // NaNs compare false and are left out
+                if(row[c] < *mini) *mini = row[c];
+                if(row[c] > *maxi) *maxi = row[c];
+            }
+        }
+    }
+}
+
+void PixelBuffer::floatWindow(const IplImage *iplImage, double *mini, double *maxi)
+{
+    *mini = 0;
+    *maxi = 1;
+    if(iplImage->depth == IPL_DEPTH_32F)
+        widenToColours<float>(Mat(iplImage), mini, maxi);
+    else if(iplImage->depth == IPL_DEPTH_64F)
+        widenToColours<double>(Mat(iplImage), mini, maxi);
+}
+
+bool PixelBuffer::convertFrom(const IplImage *iplImage, const QRect &sourceRect, const QPoint &target,
+                              double mini, double maxi)
+{
+    if(!QRect(0, 0, iplImage->width, iplImage->height).contains(sourceRect)
+            || !rect().contains(QRect(target, sourceRect.size())))
+    {
+        qDebug("PixelBuffer: region out of the %dx%d source", iplImage->width, iplImage->height);
+        return false;
+    }
+
+    /* Note here that OpenCV image is stored so that each lined is
+    32-bits aligned thus
+    * explaining the necessity to "skip" the few last bytes of each
+    line of OpenCV image buffer.
+    */
+    PixelConverter::Row convertRow = PixelConverter::forLayout(iplImage->depth, iplImage->nChannels);
+    if(!convertRow)
+    {
+        qDebug("PixelBuffer: image format is not supported : depth=%d and %d channels ", iplImage->depth, iplImage->nChannels);
+        return false;
+    }
+
+    int bytesPerPixel = (iplImage->depth & 255) / 8 * iplImage->nChannels;
+    const uchar *iplImageRow = (const uchar *) iplImage->imageData
+            + sourceRect.top()*iplImage->widthStep + sourceRect.left()*bytesPerPixel;
+    for(int y = 0; y < sourceRect.height(); y++)
+    {
+        uchar *bufferRow = pixels.ptr<uchar>(target.y() + y) + 4*target.x();
+        convertRow(iplImageRow, bufferRow, sourceRect.width(), mini, maxi);
+        iplImageRow += iplImage->widthStep;
+    }
+
+    return true;
+}
+
+bool PixelBuffer::copyFrom(const IplImage *iplImage, const QRect &sourceRect, const QPoint &target)
+{
+    Mat source(iplImage);
+    if(source.type() != type()
+            || !QRect(0, 0, iplImage->width, iplImage->height).contains(sourceRect)
+            || !rect().contains(QRect(target, sourceRect.size())))
+    {
+        qDebug("PixelBuffer: cannot copy depth=%d and %d channels", iplImage->depth, iplImage->nChannels);
+        return false;
+    }
+
+    // same size and type, so copyTo writes into our rows
+    Mat part = pixels(Rect(target.x(), target.y(), sourceRect.width(), sourceRect.height()));
+    source(Rect(sourceRect.x(), sourceRect.y(), sourceRect.width(), sourceRect.height())).copyTo(part);
+    return true;
+}
@@ -0,0 +1,72 @@
+﻿#ifndef PIXELBUFFER_H
+#define PIXELBUFFER_H
+
+#include <QImage>
+#include <QByteArray>
+#include <QRect>
+
+#include <cv.h>
+#include <highgui.h>
+
+#include "scratchfile.h"
+
+using namespace cv;
+
+/* One pixel store of 32-bit premultiplied BGRA rows. OpenCV tools see it through an
+ * IplImage / Mat header and ScribbleArea paints it through a QImage header,
+ * so both sides always look at the same memory and no conversion pass is
+ * needed after a tool edits the image.
+ *
+ * Layers that keep their native depth store their samples in buffers of
+ * another type (see WindowLevel), those have no QImage header.
+ */
+class PixelBuffer
+{
+public:
+    PixelBuffer(int width, int height, int type = CV_8UC4);
+    ~PixelBuffer();
+
+    int width() const {return pixels.cols;}
+    int height() const {return pixels.rows;}
+    QRect rect() const {return QRect(0, 0, pixels.cols, pixels.rows);}
+    int type() const {return pixels.type();}
+
+    IplImage *iplImage() {return &iplHeader;}
+    Mat mat() const {return pixels;}
+    // null unless the type is CV_8UC4
+    const QImage &image() const {return qImage;}
+
+    // marks the pixels recently used, for the scratch file's LRU
+    void touch() const {if(slot >= 0) ScratchFile::touch(slot);}
+
+    void copyFrom(const PixelBuffer &other);
+    void fill(const Scalar &value) {pixels.setTo(value);}
+
+    // the rows packed and qCompress'ed, for .pmig files and undo
+    QByteArray compressed(int level = 1) const;
+    bool uncompress(const uchar *data, int size);
+
+    // decodes keeping the alpha channel and depth, layouts convertFrom has no
+    // converter for are reduced to 8 bits; release with cvReleaseImage
+    static IplImage *loadImage(const char *fileName);
+    // the mini/maxi for convertFrom: [0, 1] widened to whatever the float
+    // colour samples of iplImage reach past it, alpha aside
+    static void floatWindow(const IplImage *iplImage, double *mini, double *maxi);
+
+    // imports sourceRect of iplImage to target, any supported depth/channel
+    // layout, mini/maxi scale float data; straight alpha is premultiplied
+    bool convertFrom(const IplImage *iplImage, const QRect &sourceRect, const QPoint &target,
+                     double mini, double maxi);
+    // the same for an iplImage of our own type, copied as is
+    bool copyFrom(const IplImage *iplImage, const QRect &sourceRect, const QPoint &target);
+
+private:
+    Q_DISABLE_COPY(PixelBuffer)
+
+    Mat pixels;         // owns the rows unless they are in the scratch file, CV_8UC4 but for native layers
+    int slot;           // see ScratchFile, -1 on the heap
+    IplImage iplHeader;
+    QImage qImage;      // Format_ARGB32_Premultiplied over pixels.data, never detached
+};
+
+#endif // PIXELBUFFER_H
@@ -0,0 +1,52 @@
+﻿#include "pixelconverter.h"
+
+namespace PixelConverter
+{
+
+// the SIMD kernels, for the layouts that have one
+template<PixelKernels::ConvertRow PixelKernels::*Kernel>
+static void simdRow(const uchar *src, uchar *dst, int width, double, double)
+{
+    (PixelKernels::best().*Kernel)(src, dst, width);
+}
+
+template<PixelKernels::ConvertScaledRow PixelKernels::*Kernel>
+static void simdScaledRow(const uchar *src, uchar *dst, int width, double mini, double maxi)
+{
+    (PixelKernels::best().*Kernel)(src, dst, width, mini, maxi);
+}
+
+Row forLayout(int depth, int channels)
+{
+    const QImage::Format format = QImage::Format_ARGB32_Premultiplied;
+
+    // one entry per supported layout; a new one has to instantiate cleanly
+    switch(depth)
+    {
+    case IPL_DEPTH_8U:
+        if(channels == 1) return simdRow<&PixelKernels::gray8ToBGRA>;
+        if(channels == 3) return simdRow<&PixelKernels::bgr8ToBGRA>;
+        if(channels == 4) return simdRow<&PixelKernels::bgra8ToBGRA>;
+        break;
+    case IPL_DEPTH_16U:
+        if(channels == 1) return simdRow<&PixelKernels::gray16ToBGRA>;
+        if(channels == 3) return Converter<IPL_DEPTH_16U, 3, format>::row;
+        if(channels == 4) return Converter<IPL_DEPTH_16U, 4, format>::row;
+        break;
+    case IPL_DEPTH_32F:
+        if(channels == 1) return simdScaledRow<&PixelKernels::gray32FToBGRA>;
+        if(channels == 3) return Converter<IPL_DEPTH_32F, 3, format>::row;
+        if(channels == 4) return Converter<IPL_DEPTH_32F, 4, format>::row;
+        break;
+    case IPL_DEPTH_64F:
+        if(channels == 1) return simdScaledRow<&PixelKernels::gray64FToBGRA>;
+        if(channels == 3) return Converter<IPL_DEPTH_64F, 3, format>::row;
+        if(channels == 4) return Converter<IPL_DEPTH_64F, 4, format>::row;
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+}
@@ -0,0 +1,110 @@
+﻿#ifndef PIXELCONVERTER_H
+#define PIXELCONVERTER_H
+
+#include <QImage>
+#include <QtGlobal>
+
+#include <cv.h>
+
+#include "pixelkernels.h"
+
+/* Row converters from every OpenCV layout PMIG imports to the rows of a
+ * QImage, one instantiation per source depth, channel count and
+ * destination format. Depth, channel count and format are template
+ * arguments, so the per pixel code has no branches left: integer depths
+ * scale by a compile time shift, float depths by [mini, maxi], and alpha
+ * is premultiplied only where both sides have it. Float alpha is always
+ * [0, 1], whatever window the colour has. A layout without a
+ * specialisation does not compile. The layouts PixelKernels has SIMD
+ * kernels for use those.
+ */
+namespace PixelConverter
+{
+
+typedef PixelKernels::ConvertScaledRow Row;
+
+template<int Depth> struct Depth_
+{
+    // dependent on Depth, so it only fires for an unsupported depth
+    Q_STATIC_ASSERT_X(Depth != Depth, "PixelConverter: unsupported IPL depth");
+};
+
+template<> struct Depth_<IPL_DEPTH_8U>
+{
+    typedef uchar Sample;
+    enum { IsFloat = 0, Shift = 0 };
+};
+
+template<> struct Depth_<IPL_DEPTH_16U>
+{
+    typedef quint16 Sample;
+    enum { IsFloat = 0, Shift = 8 };    // the high byte
+};
+
+template<> struct Depth_<IPL_DEPTH_32F>
+{
+    typedef float Sample;
+    enum { IsFloat = 1, Shift = 0 };
+};
+
+template<> struct Depth_<IPL_DEPTH_64F>
+{
+    typedef double Sample;
+    enum { IsFloat = 1, Shift = 0 };
+};
+
+template<int Depth, int Channels, QImage::Format Format>
+struct Converter
+{
+    Q_STATIC_ASSERT_X(Channels == 1 || Channels == 3 || Channels == 4,
+                      "PixelConverter: grey, BGR or BGRA sources only");
+    Q_STATIC_ASSERT_X(Format == QImage::Format_ARGB32_Premultiplied || Format == QImage::Format_RGB32,
+                      "PixelConverter: 32-bit BGRA destinations only");
+
+    typedef Depth_<Depth> Traits;
+    typedef typename Traits::Sample Sample;
+    enum { HasAlpha = Channels == 4 && Format == QImage::Format_ARGB32_Premultiplied };
+
+    // float samples take the scale, the rest the shift, both clamp without a branch
+    static inline uint toByte(Sample value, float scale, float offset)
+    {
+        if(Traits::IsFloat)
+            return (uint) qMin(qMax(float(value) * scale + offset, 0.0f), 255.0f);
+        return uint(value) >> Traits::Shift;
+    }
+
+    static void row(const uchar *src, uchar *dst, int width, double mini, double maxi)
+    {
+        const Sample *in = (const Sample *) src;
+        float scale = Traits::IsFloat ? float(255 / (maxi - mini)) : 1.0f;
+        float offset = Traits::IsFloat ? float(-mini) * scale : 0.0f;
+
+        for(int x = 0; x < width; x++)
+        {
+            uint b = toByte(in[0], scale, offset);
+            uint g = Channels == 1 ? b : toByte(in[Channels == 1 ? 0 : 1], scale, offset);
+            uint r = Channels == 1 ? b : toByte(in[Channels == 1 ? 0 : 2], scale, offset);
+            uint a = HasAlpha ? toByte(in[Channels - 1], Traits::IsFloat ? 255.0f : 1.0f, 0.0f) : 255;
+            if(HasAlpha)
+            {
+                // c * a / 255, rounded
+                b = b * a + 128; b = (b + (b >> 8)) >> 8;
+                g = g * a + 128; g = (g + (g >> 8)) >> 8;
+                r = r * a + 128; r = (r + (r >> 8)) >> 8;
+            }
+            dst[0] = (uchar) b;
+            dst[1] = (uchar) g;
+            dst[2] = (uchar) r;
+            dst[3] = (uchar) a;
+            in += Channels;
+            dst += 4;
+        }
+    }
+};
+
+// the 0 for layouts not handled, checked where the layout is only known at run time
+Row forLayout(int depth, int channels);
+
+}
+
+#endif // PIXELCONVERTER_H
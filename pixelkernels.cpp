@@ -0,0 +1,933 @@
+﻿#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <QElapsedTimer>
+
+#include "pixelkernels.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define PMIG_X86_KERNELS
+#define PMIG_TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#define PMIG_X86_KERNELS
+#define PMIG_TARGET(isa)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+
+//+++++++++++++Scalar+++++++++++++++++++++++++++++++++++++++++
+static void gray8ToBGRAScalar(const uchar *src, uchar *dst, int width)
+{
+    for(int x = 0; x < width; x++)
+    {
+        dst[0] = dst[1] = dst[2] = src[x];
+        dst[3] = 255;
+        dst += 4;
+    }
+}
+
+static void bgr8ToBGRAScalar(const uchar *src, uchar *dst, int width)
+{
+    for(int x = 0; x < width; x++)
+    {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = 255;
+        dst += 4;
+        src += 3;
+    }
+}
+
+// c * a / 255, rounded, without a division
+static inline uchar multiplyByAlpha(uint c, uint a)
+{
+    uint t = c * a + 128;
+    return (uchar)((t + (t >> 8)) >> 8);
+}
+
+static void bgra8ToBGRAScalar(const uchar *src, uchar *dst, int width)
+{
+    for(int x = 0; x < width; x++)
+    {
+        uint a = src[3];
+        dst[0] = multiplyByAlpha(src[0], a);
+        dst[1] = multiplyByAlpha(src[1], a);
+        dst[2] = multiplyByAlpha(src[2], a);
+        dst[3] = (uchar) a;
+        dst += 4;
+        src += 4;
+    }
+}
+
+static void unpremultiplyToRGBAScalar(const uchar *src, uchar *dst, int width)
+{
+    // the same float steps as the vector versions, so the results match
+    for(int x = 0; x < width; x++)
+    {
+        uint a = src[3];
+        float factor = a ? 255.0f / (float) a : 0.0f;
+        for(int c = 0; c < 3; c++)
+        {
+            float v = (float) src[2-c] * factor + 0.5f;
+            dst[c] = (uchar)(int)(v < 255.0f ? v : 255.0f);
+        }
+        dst[3] = (uchar) a;
+        dst += 4;
+        src += 4;
+    }
+}
+
+static void blendDabScalar(const uchar *before, uchar *dst, uchar *coverage, const uchar *mask,
+                           int width, quint32 color, uint flow, uint opacity)
+{
+    for(int x = 0; x < width; x++)
+    {
+        uint cov = coverage[x];
+        cov += multiplyByAlpha(multiplyByAlpha(mask[x], flow), 255 - cov);
+        coverage[x] = (uchar) cov;
+
+        // one rounding for both terms, the weights add up to 255
+        uint alpha = multiplyByAlpha(cov, opacity);
+        for(int c = 0; c < 4; c++)
+        {
+            uint t = before[c] * (255 - alpha) + ((color >> 8*c) & 255) * alpha + 128;
+            dst[c] = (uchar)((t + (t >> 8)) >> 8);
+        }
+        before += 4;
+        dst += 4;
+    }
+}
+
+static void matchColorScalar(const uchar *src, uchar *dst, int width, quint32 color, uint tolerance)
+{
+    for(int x = 0; x < width; x++)
+    {
+        bool isMatch = true;
+        for(int c = 0; c < 4; c++)
+        {
+            int d = int(src[c]) - int((color >> 8*c) & 255);
+            isMatch = isMatch && uint(d < 0 ? -d : d) <= tolerance;
+        }
+        dst[x] = isMatch ? 255 : 0;
+        src += 4;
+    }
+}
+
+static void gray16ToBGRAScalar(const uchar *src, uchar *dst, int width)
+{
+    const quint16 *srcPtr = (const quint16 *) src;
+    for(int x = 0; x < width; x++)
+    {
+        // We take only the highest part of the 16 bit value.
+        dst[0] = dst[1] = dst[2] = srcPtr[x] >> 8;
+        dst[3] = 255;
+        dst += 4;
+    }
+}
+
+static void gray32FToBGRAScalar(const uchar *src, uchar *dst, int width, double mini, double maxi)
+{
+    const float *srcPtr = (const float *) src;
+    float scale = (float)(255 / (maxi - mini));
+    float offset = (float)(-mini) * scale;
+    for(int x = 0; x < width; x++)
+    {
+        uchar p;
+        float pf = srcPtr[x] * scale + offset;
+        if(pf < 0) p = 0;
+        else if(pf > 255) p = 255;
+        else p = (uchar) pf;
+
+        dst[0] = dst[1] = dst[2] = p;
+        dst[3] = 255;
+        dst += 4;
+    }
+}
+
+static void gray64FToBGRAScalar(const uchar *src, uchar *dst, int width, double mini, double maxi)
+{
+    const double *srcPtr = (const double *) src;
+    double scale = 255 / (maxi - mini);
+    double offset = -mini * scale;
+    for(int x = 0; x < width; x++)
+    {
+        uchar p;
+        double pf = srcPtr[x] * scale + offset;
+        if(pf < 0) p = 0;
+        else if(pf > 255) p = 255;
+        else p = (uchar) pf;
+
+        dst[0] = dst[1] = dst[2] = p;
+        dst[3] = 255;
+        dst += 4;
+    }
+}
+
+
+#ifdef PMIG_X86_KERNELS
+//+++++++++++++SSSE3++++++++++++++++++++++++++++++++++++++++++
+// -1 in a shuffle mask clears the byte, the alpha is or-ed in afterwards
+
+PMIG_TARGET("ssse3")
+static void gray8ToBGRASSSE3(const uchar *src, uchar *dst, int width)
+{
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    const __m128i mask0 = _mm_setr_epi8(0,0,0,-1, 1,1,1,-1, 2,2,2,-1, 3,3,3,-1);
+    const __m128i mask1 = _mm_setr_epi8(4,4,4,-1, 5,5,5,-1, 6,6,6,-1, 7,7,7,-1);
+    const __m128i mask2 = _mm_setr_epi8(8,8,8,-1, 9,9,9,-1, 10,10,10,-1, 11,11,11,-1);
+    const __m128i mask3 = _mm_setr_epi8(12,12,12,-1, 13,13,13,-1, 14,14,14,-1, 15,15,15,-1);
+
+    int x = 0;
+    for(; x + 16 <= width; x += 16)
+    {
+        __m128i gray = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i *out = (__m128i *)(dst + 4*x);
+        _mm_storeu_si128(out + 0, _mm_or_si128(_mm_shuffle_epi8(gray, mask0), alpha));
+        _mm_storeu_si128(out + 1, _mm_or_si128(_mm_shuffle_epi8(gray, mask1), alpha));
+        _mm_storeu_si128(out + 2, _mm_or_si128(_mm_shuffle_epi8(gray, mask2), alpha));
+        _mm_storeu_si128(out + 3, _mm_or_si128(_mm_shuffle_epi8(gray, mask3), alpha));
+    }
+    gray8ToBGRAScalar(src + x, dst + 4*x, width - x);
+}
+
+PMIG_TARGET("ssse3")
+static void bgr8ToBGRASSSE3(const uchar *src, uchar *dst, int width)
+{
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    const __m128i mask = _mm_setr_epi8(0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+
+    // each 16 byte load uses 12 bytes, stay 6 pixels clear of the row end
+    int x = 0;
+    for(; x + 18 <= width; x += 16)
+    {
+        const uchar *in = src + 3*x;
+        __m128i *out = (__m128i *)(dst + 4*x);
+        __m128i p0 = _mm_loadu_si128((const __m128i *)(in + 0));
+        __m128i p1 = _mm_loadu_si128((const __m128i *)(in + 12));
+        __m128i p2 = _mm_loadu_si128((const __m128i *)(in + 24));
+        __m128i p3 = _mm_loadu_si128((const __m128i *)(in + 36));
+        _mm_storeu_si128(out + 0, _mm_or_si128(_mm_shuffle_epi8(p0, mask), alpha));
+        _mm_storeu_si128(out + 1, _mm_or_si128(_mm_shuffle_epi8(p1, mask), alpha));
+        _mm_storeu_si128(out + 2, _mm_or_si128(_mm_shuffle_epi8(p2, mask), alpha));
+        _mm_storeu_si128(out + 3, _mm_or_si128(_mm_shuffle_epi8(p3, mask), alpha));
+    }
+    bgr8ToBGRAScalar(src + 3*x, dst + 4*x, width - x);
+}
+
+// four pixels: each colour word times its alpha, the alpha word times 255
+PMIG_TARGET("ssse3")
+static inline __m128i premultiplySSSE3(__m128i pixels)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i alpha255 = _mm_setr_epi16(0,0,0,255, 0,0,0,255);
+    const __m128i spreadLo = _mm_setr_epi8(3,-1,3,-1,3,-1,-1,-1, 7,-1,7,-1,7,-1,-1,-1);
+    const __m128i spreadHi = _mm_setr_epi8(11,-1,11,-1,11,-1,-1,-1, 15,-1,15,-1,15,-1,-1,-1);
+
+    __m128i lo = _mm_unpacklo_epi8(pixels, zero);
+    __m128i hi = _mm_unpackhi_epi8(pixels, zero);
+    lo = _mm_add_epi16(_mm_mullo_epi16(lo, _mm_or_si128(_mm_shuffle_epi8(pixels, spreadLo), alpha255)), round);
+    hi = _mm_add_epi16(_mm_mullo_epi16(hi, _mm_or_si128(_mm_shuffle_epi8(pixels, spreadHi), alpha255)), round);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+
+PMIG_TARGET("ssse3")
+static void bgra8ToBGRASSSE3(const uchar *src, uchar *dst, int width)
+{
+    int x = 0;
+    for(; x + 4 <= width; x += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(src + 4*x));
+        _mm_storeu_si128((__m128i *)(dst + 4*x), premultiplySSSE3(pixels));
+    }
+    bgra8ToBGRAScalar(src + 4*x, dst + 4*x, width - x);
+}
+
+// one channel of four pixels as floats, picked by mask
+PMIG_TARGET("ssse3")
+static inline __m128 channelSSSE3(__m128i pixels, int channel)
+{
+    const __m128i mask = _mm_setr_epi8(0,-1,-1,-1, 4,-1,-1,-1, 8,-1,-1,-1, 12,-1,-1,-1);
+    return _mm_cvtepi32_ps(_mm_shuffle_epi8(pixels, _mm_add_epi8(mask, _mm_set1_epi32(channel))));
+}
+
+PMIG_TARGET("ssse3")
+static void unpremultiplyToRGBASSSE3(const uchar *src, uchar *dst, int width)
+{
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 top = _mm_set1_ps(255.0f);
+    const __m128 zero = _mm_setzero_ps();
+
+    int x = 0;
+    for(; x + 4 <= width; x += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(src + 4*x));
+        __m128 a = channelSSSE3(pixels, 3);
+        // 0 where alpha is 0, rather than 0 * inf
+        __m128 factor = _mm_and_ps(_mm_div_ps(top, a), _mm_cmpgt_ps(a, zero));
+
+        __m128i r = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(_mm_mul_ps(channelSSSE3(pixels, 2), factor), half), top));
+        __m128i g = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(_mm_mul_ps(channelSSSE3(pixels, 1), factor), half), top));
+        __m128i b = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(_mm_mul_ps(channelSSSE3(pixels, 0), factor), half), top));
+        __m128i alpha = _mm_and_si128(pixels, _mm_set1_epi32(0xff000000));
+
+        __m128i rgba = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)),
+                                    _mm_or_si128(_mm_slli_epi32(b, 16), alpha));
+        _mm_storeu_si128((__m128i *)(dst + 4*x), rgba);
+    }
+    unpremultiplyToRGBAScalar(src + 4*x, dst + 4*x, width - x);
+}
+
+PMIG_TARGET("ssse3")
+static void gray16ToBGRASSSE3(const uchar *src, uchar *dst, int width)
+{
+    // picking the odd (high) byte of every little endian word is the >> 8
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    const __m128i mask0 = _mm_setr_epi8(1,1,1,-1, 3,3,3,-1, 5,5,5,-1, 7,7,7,-1);
+    const __m128i mask1 = _mm_setr_epi8(9,9,9,-1, 11,11,11,-1, 13,13,13,-1, 15,15,15,-1);
+
+    int x = 0;
+    for(; x + 8 <= width; x += 8)
+    {
+        __m128i gray = _mm_loadu_si128((const __m128i *)(src + 2*x));
+        __m128i *out = (__m128i *)(dst + 4*x);
+        _mm_storeu_si128(out + 0, _mm_or_si128(_mm_shuffle_epi8(gray, mask0), alpha));
+        _mm_storeu_si128(out + 1, _mm_or_si128(_mm_shuffle_epi8(gray, mask1), alpha));
+    }
+    gray16ToBGRAScalar(src + 2*x, dst + 4*x, width - x);
+}
+
+// spreads four 32-bit lanes holding 0..255 over B, G and R
+PMIG_TARGET("ssse3")
+static inline __m128i spreadGraySSSE3(__m128i lanes)
+{
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    const __m128i mask = _mm_setr_epi8(0,0,0,-1, 4,4,4,-1, 8,8,8,-1, 12,12,12,-1);
+    return _mm_or_si128(_mm_shuffle_epi8(lanes, mask), alpha);
+}
+
+PMIG_TARGET("ssse3")
+static void gray32FToBGRASSSE3(const uchar *src, uchar *dst, int width, double mini, double maxi)
+{
+    const float *srcPtr = (const float *) src;
+    float scaleValue = (float)(255 / (maxi - mini));
+    const __m128 scale = _mm_set1_ps(scaleValue);
+    const __m128 offset = _mm_set1_ps((float)(-mini) * scaleValue);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 top = _mm_set1_ps(255.0f);
+
+    int x = 0;
+    for(; x + 4 <= width; x += 4)
+    {
+        __m128 pf = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(srcPtr + x), scale), offset);
+        pf = _mm_min_ps(_mm_max_ps(pf, zero), top);
+        _mm_storeu_si128((__m128i *)(dst + 4*x), spreadGraySSSE3(_mm_cvttps_epi32(pf)));
+    }
+    gray32FToBGRAScalar(src + 4*x, dst + 4*x, width - x, mini, maxi);
+}
+
+PMIG_TARGET("ssse3")
+static void gray64FToBGRASSSE3(const uchar *src, uchar *dst, int width, double mini, double maxi)
+{
+    const double *srcPtr = (const double *) src;
+    double scaleValue = 255 / (maxi - mini);
+    const __m128d scale = _mm_set1_pd(scaleValue);
+    const __m128d offset = _mm_set1_pd(-mini * scaleValue);
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d top = _mm_set1_pd(255.0);
+
+    int x = 0;
+    for(; x + 4 <= width; x += 4)
+    {
+        // clamp and truncate in double so the result matches the scalar path
+        __m128d lo = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(srcPtr + x), scale), offset);
+        __m128d hi = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(srcPtr + x + 2), scale), offset);
+        lo = _mm_min_pd(_mm_max_pd(lo, zero), top);
+        hi = _mm_min_pd(_mm_max_pd(hi, zero), top);
+        __m128i lanes = _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+        _mm_storeu_si128((__m128i *)(dst + 4*x), spreadGraySSSE3(lanes));
+    }
+    gray64FToBGRAScalar(src + 8*x, dst + 4*x, width - x, mini, maxi);
+}
+
+// x / 255 for the words of x*y + 128, rounded as multiplyByAlpha
+PMIG_TARGET("ssse3")
+static inline __m128i divide255SSSE3(__m128i t)
+{
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// four pixels, the coverage steps in the low words
+PMIG_TARGET("ssse3")
+static void blendDabSSSE3(const uchar *before, uchar *dst, uchar *coverage, const uchar *mask,
+                          int width, quint32 color, uint flow, uint opacity)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i flows = _mm_set1_epi16((short) flow);
+    const __m128i opacities = _mm_set1_epi16((short) opacity);
+    const __m128i colors = _mm_unpacklo_epi8(_mm_set1_epi32((int) color), zero);
+
+    int x = 0;
+    for(; x + 4 <= width; x += 4)
+    {
+        int maskBytes, coverageBytes;
+        memcpy(&maskBytes, mask + x, 4);
+        memcpy(&coverageBytes, coverage + x, 4);
+        __m128i m = _mm_unpacklo_epi8(_mm_cvtsi32_si128(maskBytes), zero);
+        __m128i cov = _mm_unpacklo_epi8(_mm_cvtsi32_si128(coverageBytes), zero);
+
+        __m128i a = divide255SSSE3(_mm_add_epi16(_mm_mullo_epi16(m, flows), round));
+        a = divide255SSSE3(_mm_add_epi16(_mm_mullo_epi16(a, _mm_sub_epi16(full, cov)), round));
+        cov = _mm_add_epi16(cov, a);
+        coverageBytes = _mm_cvtsi128_si32(_mm_packus_epi16(cov, zero));
+        memcpy(coverage + x, &coverageBytes, 4);
+
+        __m128i alpha = divide255SSSE3(_mm_add_epi16(_mm_mullo_epi16(cov, opacities), round));
+        alpha = _mm_unpacklo_epi16(alpha, alpha);
+        __m128i alphaLo = _mm_unpacklo_epi32(alpha, alpha);
+        __m128i alphaHi = _mm_unpackhi_epi32(alpha, alpha);
+
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(before + 4*x));
+        __m128i lo = _mm_unpacklo_epi8(pixels, zero);
+        __m128i hi = _mm_unpackhi_epi8(pixels, zero);
+        lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(lo, _mm_sub_epi16(full, alphaLo)),
+                                         _mm_mullo_epi16(colors, alphaLo)), round);
+        hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(hi, _mm_sub_epi16(full, alphaHi)),
+                                         _mm_mullo_epi16(colors, alphaHi)), round);
+        _mm_storeu_si128((__m128i *)(dst + 4*x), _mm_packus_epi16(divide255SSSE3(lo), divide255SSSE3(hi)));
+    }
+    blendDabScalar(before + 4*x, dst + 4*x, coverage + x, mask + x, width - x, color, flow, opacity);
+}
+
+// all ones in the dwords of the four pixels that match; the distance is
+// the larger of the two saturated differences
+PMIG_TARGET("ssse3")
+static inline __m128i matchPixelsSSSE3(const uchar *in, __m128i colors, __m128i tolerances)
+{
+    __m128i pixels = _mm_loadu_si128((const __m128i *) in);
+    __m128i distance = _mm_or_si128(_mm_subs_epu8(pixels, colors), _mm_subs_epu8(colors, pixels));
+    return _mm_cmpeq_epi32(_mm_subs_epu8(distance, tolerances), _mm_setzero_si128());
+}
+
+// sixteen pixels, the dword masks packed down to bytes
+PMIG_TARGET("ssse3")
+static void matchColorSSSE3(const uchar *src, uchar *dst, int width, quint32 color, uint tolerance)
+{
+    const __m128i colors = _mm_set1_epi32((int) color);
+    const __m128i tolerances = _mm_set1_epi8((char) tolerance);
+
+    int x = 0;
+    for(; x + 16 <= width; x += 16)
+    {
+        const uchar *in = src + 4*x;
+        __m128i lo = _mm_packs_epi32(matchPixelsSSSE3(in, colors, tolerances),
+                                     matchPixelsSSSE3(in + 16, colors, tolerances));
+        __m128i hi = _mm_packs_epi32(matchPixelsSSSE3(in + 32, colors, tolerances),
+                                     matchPixelsSSSE3(in + 48, colors, tolerances));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packs_epi16(lo, hi));
+    }
+    matchColorScalar(src + 4*x, dst + x, width - x, color, tolerance);
+}
+
+
+//+++++++++++++AVX2+++++++++++++++++++++++++++++++++++++++++++
+// _mm256_shuffle_epi8 works inside each 128-bit lane, so the lanes are fed
+// with the source bytes they need
+
+PMIG_TARGET("avx2")
+static void gray8ToBGRAAVX2(const uchar *src, uchar *dst, int width)
+{
+    // with the 16 grey bytes in both lanes, lane 1 simply indexes 4 further
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    const __m256i mask0 = _mm256_setr_epi8(0,0,0,-1, 1,1,1,-1, 2,2,2,-1, 3,3,3,-1,
+                                           4,4,4,-1, 5,5,5,-1, 6,6,6,-1, 7,7,7,-1);
+    const __m256i mask1 = _mm256_setr_epi8(8,8,8,-1, 9,9,9,-1, 10,10,10,-1, 11,11,11,-1,
+                                           12,12,12,-1, 13,13,13,-1, 14,14,14,-1, 15,15,15,-1);
+
+    int x = 0;
+    for(; x + 32 <= width; x += 32)
+    {
+        __m256i *out = (__m256i *)(dst + 4*x);
+        __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(src + x)));
+        __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(src + x + 16)));
+        _mm256_storeu_si256(out + 0, _mm256_or_si256(_mm256_shuffle_epi8(lo, mask0), alpha));
+        _mm256_storeu_si256(out + 1, _mm256_or_si256(_mm256_shuffle_epi8(lo, mask1), alpha));
+        _mm256_storeu_si256(out + 2, _mm256_or_si256(_mm256_shuffle_epi8(hi, mask0), alpha));
+        _mm256_storeu_si256(out + 3, _mm256_or_si256(_mm256_shuffle_epi8(hi, mask1), alpha));
+    }
+    gray8ToBGRASSSE3(src + x, dst + 4*x, width - x);
+}
+
+PMIG_TARGET("avx2")
+static inline __m256i loadBGR8x8(const uchar *in)
+{
+    // 4 pixels (12 of the 16 loaded bytes) per lane
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)in)),
+                                   _mm_loadu_si128((const __m128i *)(in + 12)), 1);
+}
+
+PMIG_TARGET("avx2")
+static void bgr8ToBGRAAVX2(const uchar *src, uchar *dst, int width)
+{
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    const __m256i mask = _mm256_setr_epi8(0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1,
+                                          0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+
+    int x = 0;
+    for(; x + 18 <= width; x += 16)
+    {
+        const uchar *in = src + 3*x;
+        __m256i *out = (__m256i *)(dst + 4*x);
+        _mm256_storeu_si256(out + 0, _mm256_or_si256(_mm256_shuffle_epi8(loadBGR8x8(in), mask), alpha));
+        _mm256_storeu_si256(out + 1, _mm256_or_si256(_mm256_shuffle_epi8(loadBGR8x8(in + 24), mask), alpha));
+    }
+    bgr8ToBGRAScalar(src + 3*x, dst + 4*x, width - x);
+}
+
+PMIG_TARGET("avx2")
+static void bgra8ToBGRAAVX2(const uchar *src, uchar *dst, int width)
+{
+    // premultiplySSSE3 on both lanes, every step stays inside its lane
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi16(128);
+    const __m256i alpha255 = _mm256_setr_epi16(0,0,0,255, 0,0,0,255, 0,0,0,255, 0,0,0,255);
+    const __m256i spreadLo = _mm256_setr_epi8(3,-1,3,-1,3,-1,-1,-1, 7,-1,7,-1,7,-1,-1,-1,
+                                              3,-1,3,-1,3,-1,-1,-1, 7,-1,7,-1,7,-1,-1,-1);
+    const __m256i spreadHi = _mm256_setr_epi8(11,-1,11,-1,11,-1,-1,-1, 15,-1,15,-1,15,-1,-1,-1,
+                                              11,-1,11,-1,11,-1,-1,-1, 15,-1,15,-1,15,-1,-1,-1);
+
+    int x = 0;
+    for(; x + 8 <= width; x += 8)
+    {
+        __m256i pixels = _mm256_loadu_si256((const __m256i *)(src + 4*x));
+        __m256i lo = _mm256_unpacklo_epi8(pixels, zero);
+        __m256i hi = _mm256_unpackhi_epi8(pixels, zero);
+        lo = _mm256_add_epi16(_mm256_mullo_epi16(lo, _mm256_or_si256(_mm256_shuffle_epi8(pixels, spreadLo), alpha255)), round);
+        hi = _mm256_add_epi16(_mm256_mullo_epi16(hi, _mm256_or_si256(_mm256_shuffle_epi8(pixels, spreadHi), alpha255)), round);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+        _mm256_storeu_si256((__m256i *)(dst + 4*x), _mm256_packus_epi16(lo, hi));
+    }
+    bgra8ToBGRASSSE3(src + 4*x, dst + 4*x, width - x);
+}
+
+PMIG_TARGET("avx2")
+static inline __m256 channelAVX2(__m256i pixels, int channel)
+{
+    const __m256i mask = _mm256_setr_epi8(0,-1,-1,-1, 4,-1,-1,-1, 8,-1,-1,-1, 12,-1,-1,-1,
+                                          0,-1,-1,-1, 4,-1,-1,-1, 8,-1,-1,-1, 12,-1,-1,-1);
+    return _mm256_cvtepi32_ps(_mm256_shuffle_epi8(pixels, _mm256_add_epi8(mask, _mm256_set1_epi32(channel))));
+}
+
+PMIG_TARGET("avx2")
+static void unpremultiplyToRGBAAVX2(const uchar *src, uchar *dst, int width)
+{
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 top = _mm256_set1_ps(255.0f);
+    const __m256 zero = _mm256_setzero_ps();
+
+    int x = 0;
+    for(; x + 8 <= width; x += 8)
+    {
+        __m256i pixels = _mm256_loadu_si256((const __m256i *)(src + 4*x));
+        __m256 a = channelAVX2(pixels, 3);
+        __m256 factor = _mm256_and_ps(_mm256_div_ps(top, a), _mm256_cmp_ps(a, zero, _CMP_GT_OQ));
+
+        __m256i r = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(channelAVX2(pixels, 2), factor), half), top));
+        __m256i g = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(channelAVX2(pixels, 1), factor), half), top));
+        __m256i b = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(channelAVX2(pixels, 0), factor), half), top));
+        __m256i alpha = _mm256_and_si256(pixels, _mm256_set1_epi32(0xff000000));
+
+        __m256i rgba = _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi32(g, 8)),
+                                       _mm256_or_si256(_mm256_slli_epi32(b, 16), alpha));
+        _mm256_storeu_si256((__m256i *)(dst + 4*x), rgba);
+    }
+    unpremultiplyToRGBASSSE3(src + 4*x, dst + 4*x, width - x);
+}
+
+PMIG_TARGET("avx2")
+static void gray16ToBGRAAVX2(const uchar *src, uchar *dst, int width)
+{
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    const __m256i mask0 = _mm256_setr_epi8(1,1,1,-1, 3,3,3,-1, 5,5,5,-1, 7,7,7,-1,
+                                           1,1,1,-1, 3,3,3,-1, 5,5,5,-1, 7,7,7,-1);
+    const __m256i mask1 = _mm256_setr_epi8(9,9,9,-1, 11,11,11,-1, 13,13,13,-1, 15,15,15,-1,
+                                           9,9,9,-1, 11,11,11,-1, 13,13,13,-1, 15,15,15,-1);
+
+    int x = 0;
+    for(; x + 16 <= width; x += 16)
+    {
+        __m256i gray = _mm256_loadu_si256((const __m256i *)(src + 2*x));
+        // a holds pixels 0-3 | 8-11, b holds 4-7 | 12-15
+        __m256i a = _mm256_or_si256(_mm256_shuffle_epi8(gray, mask0), alpha);
+        __m256i b = _mm256_or_si256(_mm256_shuffle_epi8(gray, mask1), alpha);
+        __m256i *out = (__m256i *)(dst + 4*x);
+        _mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    gray16ToBGRASSSE3(src + 2*x, dst + 4*x, width - x);
+}
+
+PMIG_TARGET("avx2")
+static inline __m256i spreadGrayAVX2(__m256i lanes)
+{
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    const __m256i mask = _mm256_setr_epi8(0,0,0,-1, 4,4,4,-1, 8,8,8,-1, 12,12,12,-1,
+                                          0,0,0,-1, 4,4,4,-1, 8,8,8,-1, 12,12,12,-1);
+    return _mm256_or_si256(_mm256_shuffle_epi8(lanes, mask), alpha);
+}
+
+PMIG_TARGET("avx2")
+static void gray32FToBGRAAVX2(const uchar *src, uchar *dst, int width, double mini, double maxi)
+{
+    const float *srcPtr = (const float *) src;
+    float scaleValue = (float)(255 / (maxi - mini));
+    const __m256 scale = _mm256_set1_ps(scaleValue);
+    const __m256 offset = _mm256_set1_ps((float)(-mini) * scaleValue);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 top = _mm256_set1_ps(255.0f);
+
+    int x = 0;
+    for(; x + 8 <= width; x += 8)
+    {
+        __m256 pf = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(srcPtr + x), scale), offset);
+        pf = _mm256_min_ps(_mm256_max_ps(pf, zero), top);
+        _mm256_storeu_si256((__m256i *)(dst + 4*x), spreadGrayAVX2(_mm256_cvttps_epi32(pf)));
+    }
+    gray32FToBGRASSSE3(src + 4*x, dst + 4*x, width - x, mini, maxi);
+}
+
+PMIG_TARGET("avx2")
+static void gray64FToBGRAAVX2(const uchar *src, uchar *dst, int width, double mini, double maxi)
+{
+    const double *srcPtr = (const double *) src;
+    double scaleValue = 255 / (maxi - mini);
+    const __m256d scale = _mm256_set1_pd(scaleValue);
+    const __m256d offset = _mm256_set1_pd(-mini * scaleValue);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d top = _mm256_set1_pd(255.0);
+
+    int x = 0;
+    for(; x + 8 <= width; x += 8)
+    {
+        __m256d lo = _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(srcPtr + x), scale), offset);
+        __m256d hi = _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(srcPtr + x + 4), scale), offset);
+        lo = _mm256_min_pd(_mm256_max_pd(lo, zero), top);
+        hi = _mm256_min_pd(_mm256_max_pd(hi, zero), top);
+        __m256i lanes = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm256_cvttpd_epi32(lo)),
+                                                _mm256_cvttpd_epi32(hi), 1);
+        _mm256_storeu_si256((__m256i *)(dst + 4*x), spreadGrayAVX2(lanes));
+    }
+    gray64FToBGRASSSE3(src + 8*x, dst + 4*x, width - x, mini, maxi);
+}
+
+PMIG_TARGET("avx2")
+static inline __m256i divide255AVX2(__m256i t)
+{
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+// eight pixels, the coverage in eight words; the pixel words of lane 0
+// are pixels 0,1 (lo) and 2,3 (hi), of lane 1 pixels 4,5 and 6,7
+PMIG_TARGET("avx2")
+static void blendDabAVX2(const uchar *before, uchar *dst, uchar *coverage, const uchar *mask,
+                         int width, quint32 color, uint flow, uint opacity)
+{
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i flows = _mm_set1_epi16((short) flow);
+    const __m128i opacities = _mm_set1_epi16((short) opacity);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round256 = _mm256_set1_epi16(128);
+    const __m256i full256 = _mm256_set1_epi16(255);
+    const __m256i colors = _mm256_unpacklo_epi8(_mm256_set1_epi32((int) color), zero);
+
+    int x = 0;
+    for(; x + 8 <= width; x += 8)
+    {
+        __m128i m = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(mask + x)));
+        __m128i cov = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(coverage + x)));
+
+        __m128i a = divide255SSSE3(_mm_add_epi16(_mm_mullo_epi16(m, flows), round));
+        a = divide255SSSE3(_mm_add_epi16(_mm_mullo_epi16(a, _mm_sub_epi16(full, cov)), round));
+        cov = _mm_add_epi16(cov, a);
+        _mm_storel_epi64((__m128i *)(coverage + x), _mm_packus_epi16(cov, cov));
+
+        __m128i alpha = divide255SSSE3(_mm_add_epi16(_mm_mullo_epi16(cov, opacities), round));
+        __m128i alpha03 = _mm_unpacklo_epi16(alpha, alpha);
+        __m128i alpha47 = _mm_unpackhi_epi16(alpha, alpha);
+        __m256i alphaLo = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi32(alpha03, alpha03)),
+                                                  _mm_unpacklo_epi32(alpha47, alpha47), 1);
+        __m256i alphaHi = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpackhi_epi32(alpha03, alpha03)),
+                                                  _mm_unpackhi_epi32(alpha47, alpha47), 1);
+
+        __m256i pixels = _mm256_loadu_si256((const __m256i *)(before + 4*x));
+        __m256i lo = _mm256_unpacklo_epi8(pixels, zero);
+        __m256i hi = _mm256_unpackhi_epi8(pixels, zero);
+        lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(lo, _mm256_sub_epi16(full256, alphaLo)),
+                                               _mm256_mullo_epi16(colors, alphaLo)), round256);
+        hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(hi, _mm256_sub_epi16(full256, alphaHi)),
+                                               _mm256_mullo_epi16(colors, alphaHi)), round256);
+        _mm256_storeu_si256((__m256i *)(dst + 4*x), _mm256_packus_epi16(divide255AVX2(lo), divide255AVX2(hi)));
+    }
+    blendDabSSSE3(before + 4*x, dst + 4*x, coverage + x, mask + x, width - x, color, flow, opacity);
+}
+
+PMIG_TARGET("avx2")
+static inline __m256i matchPixelsAVX2(const uchar *in, __m256i colors, __m256i tolerances)
+{
+    __m256i pixels = _mm256_loadu_si256((const __m256i *) in);
+    __m256i distance = _mm256_or_si256(_mm256_subs_epu8(pixels, colors), _mm256_subs_epu8(colors, pixels));
+    return _mm256_cmpeq_epi32(_mm256_subs_epu8(distance, tolerances), _mm256_setzero_si256());
+}
+
+// thirty two pixels; packing works per lane, which leaves the dwords of
+// bytes in the order 0 2 4 6 1 3 5 7
+PMIG_TARGET("avx2")
+static void matchColorAVX2(const uchar *src, uchar *dst, int width, quint32 color, uint tolerance)
+{
+    const __m256i colors = _mm256_set1_epi32((int) color);
+    const __m256i tolerances = _mm256_set1_epi8((char) tolerance);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    int x = 0;
+    for(; x + 32 <= width; x += 32)
+    {
+        const uchar *in = src + 4*x;
+        __m256i lo = _mm256_packs_epi32(matchPixelsAVX2(in, colors, tolerances),
+                                        matchPixelsAVX2(in + 32, colors, tolerances));
+        __m256i hi = _mm256_packs_epi32(matchPixelsAVX2(in + 64, colors, tolerances),
+                                        matchPixelsAVX2(in + 96, colors, tolerances));
+        __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packs_epi16(lo, hi), order);
+        _mm256_storeu_si256((__m256i *)(dst + x), bytes);
+    }
+    matchColorSSSE3(src + 4*x, dst + x, width - x, color, tolerance);
+}
+#endif // PMIG_X86_KERNELS
+
+
+bool PixelKernels::isSupported(Isa isa)
+{
+    switch(isa)
+    {
+    case Scalar:
+        return true;
+#if defined(PMIG_X86_KERNELS) && defined(__GNUC__)
+    case SSSE3:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("ssse3");
+    case AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#elif defined(PMIG_X86_KERNELS)
+    case SSSE3:
+    {
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 9)) != 0;
+    }
+    case AVX2:
+    {
+        int info[4];
+        __cpuid(info, 1);
+        // the OS has to save the ymm registers too
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        if(!osxsave || (_xgetbv(0) & 6) != 6) return false;
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+const char *PixelKernels::isaName(Isa isa)
+{
+    switch(isa)
+    {
+    case SSSE3: return "SSSE3";
+    case AVX2: return "AVX2";
+    default: return "Scalar";
+    }
+}
+
+PixelKernels PixelKernels::forIsa(Isa isa)
+{
+    PixelKernels kernels;
+    kernels.isa = Scalar;
+    kernels.gray8ToBGRA = gray8ToBGRAScalar;
+    kernels.bgr8ToBGRA = bgr8ToBGRAScalar;
+    kernels.bgra8ToBGRA = bgra8ToBGRAScalar;
+    kernels.gray16ToBGRA = gray16ToBGRAScalar;
+    kernels.gray32FToBGRA = gray32FToBGRAScalar;
+    kernels.gray64FToBGRA = gray64FToBGRAScalar;
+    kernels.unpremultiplyToRGBA = unpremultiplyToRGBAScalar;
+    kernels.blendDab = blendDabScalar;
+    kernels.matchColor = matchColorScalar;
+
+#ifdef PMIG_X86_KERNELS
+    if(isa == SSSE3)
+    {
+        kernels.isa = SSSE3;
+        kernels.gray8ToBGRA = gray8ToBGRASSSE3;
+        kernels.bgr8ToBGRA = bgr8ToBGRASSSE3;
+        kernels.bgra8ToBGRA = bgra8ToBGRASSSE3;
+        kernels.gray16ToBGRA = gray16ToBGRASSSE3;
+        kernels.gray32FToBGRA = gray32FToBGRASSSE3;
+        kernels.gray64FToBGRA = gray64FToBGRASSSE3;
+        kernels.unpremultiplyToRGBA = unpremultiplyToRGBASSSE3;
+        kernels.blendDab = blendDabSSSE3;
+        kernels.matchColor = matchColorSSSE3;
+    }
+    else if(isa == AVX2)
+    {
+        kernels.isa = AVX2;
+        kernels.gray8ToBGRA = gray8ToBGRAAVX2;
+        kernels.bgr8ToBGRA = bgr8ToBGRAAVX2;
+        kernels.bgra8ToBGRA = bgra8ToBGRAAVX2;
+        kernels.gray16ToBGRA = gray16ToBGRAAVX2;
+        kernels.gray32FToBGRA = gray32FToBGRAAVX2;
+        kernels.gray64FToBGRA = gray64FToBGRAAVX2;
+        kernels.unpremultiplyToRGBA = unpremultiplyToRGBAAVX2;
+        kernels.blendDab = blendDabAVX2;
+        kernels.matchColor = matchColorAVX2;
+    }
+#endif
+
+    return kernels;
+}
+
+static PixelKernels detectBest()
+{
+    if(PixelKernels::isSupported(PixelKernels::AVX2))
+        return PixelKernels::forIsa(PixelKernels::AVX2);
+    if(PixelKernels::isSupported(PixelKernels::SSSE3))
+        return PixelKernels::forIsa(PixelKernels::SSSE3);
+    return PixelKernels::forIsa(PixelKernels::Scalar);
+}
+
+const PixelKernels &PixelKernels::best()
+{
+    static const PixelKernels kernels = detectBest();
+    return kernels;
+}
+
+
+//+++++++++++++Benchmark++++++++++++++++++++++++++++++++++++++
+struct KernelCase
+{
+    const char *name;
+    int srcBytesPerPixel;
+    PixelKernels::ConvertRow PixelKernels::*row;
+    PixelKernels::ConvertScaledRow PixelKernels::*scaledRow;
+    PixelKernels::DabRow PixelKernels::*dabRow;
+    PixelKernels::MatchRow PixelKernels::*matchRow;
+};
+
+// one pass of a case over every row; dab rows take the source as both the
+// pixels and, shifted, the mask, match rows write a byte per pixel
+static void runCase(const PixelKernels &kernels, const KernelCase &k, const uchar *input, uchar *output,
+                    uchar *coverage, int rows, int rowWidth, size_t srcStep, size_t dstStep)
+{
+    for(int y = 0; y < rows; y++)
+    {
+        if(k.row)
+            (kernels.*(k.row))(input + y*srcStep, output + y*dstStep, rowWidth);
+        else if(k.scaledRow)
+            (kernels.*(k.scaledRow))(input + y*srcStep, output + y*dstStep, rowWidth, 0, 1000);
+        else if(k.matchRow)
+            (kernels.*(k.matchRow))(input + y*srcStep, output + y*dstStep, rowWidth, 0xff336699u, 100);
+        else
+            (kernels.*(k.dabRow))(input + y*srcStep, output + y*dstStep, coverage + y*rowWidth,
+                                  input + y*srcStep + 1, rowWidth, 0xff336699u, 200, 180);
+    }
+}
+
+int PixelKernels::benchmark()
+{
+    static const KernelCase cases[] = {
+        { "gray8", 1, &PixelKernels::gray8ToBGRA, 0, 0, 0 },
+        { "bgr8", 3, &PixelKernels::bgr8ToBGRA, 0, 0, 0 },
+        { "bgra8", 4, &PixelKernels::bgra8ToBGRA, 0, 0, 0 },
+        { "gray16", 2, &PixelKernels::gray16ToBGRA, 0, 0, 0 },
+        { "gray32f", 4, 0, &PixelKernels::gray32FToBGRA, 0, 0 },
+        { "gray64f", 8, 0, &PixelKernels::gray64FToBGRA, 0, 0 },
+        { "unpremul", 4, &PixelKernels::unpremultiplyToRGBA, 0, 0, 0 },
+        { "dab", 4, 0, 0, &PixelKernels::blendDab, 0 },
+        { "match", 4, 0, 0, 0, &PixelKernels::matchColor }
+    };
+    const int caseCount = sizeof(cases) / sizeof(KernelCase);
+
+    // an odd width so every kernel also runs its tail
+    const int width = 4099, height = 512, rounds = 8;
+
+    uchar *src = (uchar *) malloc((size_t)width*height*8);
+    uchar *dst = (uchar *) malloc((size_t)width*height*4);
+    uchar *reference = (uchar *) malloc((size_t)width*height*4);
+    uchar *coverage = (uchar *) malloc((size_t)width*height);
+    srand(1);
+    for(size_t i = 0; i < (size_t)width*height*8; i++)
+        src[i] = (uchar) rand();
+    // keep the float rows finite, mapping them onto [0, 1000)
+    for(size_t i = 0; i < (size_t)width*height; i++)
+    {
+        ((float *) src)[i] = (float)(rand() % 1000);
+    }
+    // doubles go after the floats so the two don't overlap
+    double *doubles = (double *)(src + (size_t)width*height*4);
+    for(size_t i = 0; i < (size_t)width*height/2; i++)
+        doubles[i] = rand() % 1000;
+
+    int failures = 0;
+    PixelKernels scalar = forIsa(Scalar);
+    printf("%-8s %-10s %10s\n", "isa", "kernel", "GB/s");
+
+    for(int isa = Scalar; isa <= AVX2; isa++)
+    {
+        if(!isSupported((Isa) isa)) continue;
+        PixelKernels kernels = forIsa((Isa) isa);
+
+        for(int c = 0; c < caseCount; c++)
+        {
+            const KernelCase &k = cases[c];
+            const uchar *input = (k.srcBytesPerPixel == 8) ? (const uchar *) doubles : src;
+            int rowWidth = (k.srcBytesPerPixel == 8) ? width/2 : width;
+            size_t srcStep = (size_t)rowWidth * k.srcBytesPerPixel;
+            size_t dstStep = (size_t)rowWidth * (k.matchRow ? 1 : 4);
+            int rows = (k.srcBytesPerPixel == 8) ? height/2 : height;
+
+            QElapsedTimer timer;
+            timer.start();
+            for(int r = 0; r < rounds; r++)
+                runCase(kernels, k, input, dst, coverage, rows, rowWidth, srcStep, dstStep);
+            qint64 nsecs = timer.nsecsElapsed();
+
+            // dabs change the coverage, both sides start from the same one
+            memcpy(coverage, src + 2, (size_t)width*height);
+            runCase(kernels, k, input, dst, coverage, rows, rowWidth, srcStep, dstStep);
+            memcpy(coverage, src + 2, (size_t)width*height);
+            runCase(scalar, k, input, reference, coverage, rows, rowWidth, srcStep, dstStep);
+            bool same = memcmp(dst, reference, dstStep*rows) == 0;
+            if(!same) failures++;
+
+            double bytes = (double)(srcStep + dstStep) * rows * rounds;
+            printf("%-8s %-10s %10.2f%s\n", isaName((Isa) isa), k.name,
+                   nsecs > 0 ? bytes / nsecs : 0.0, same ? "" : "  MISMATCH");
+        }
+    }
+
+    free(src);
+    free(dst);
+    free(reference);
+    free(coverage);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+﻿#ifndef PIXELKERNELS_H
+#define PIXELKERNELS_H
+
+#include <QtGlobal>
+
+/* Row kernels that expand the layouts OpenCV decodes into the premultiplied
+ * 32-bit BGRA rows of a PixelBuffer, turn those back into the straight
+ * alpha RGBA that PNG stores, blend brush dabs into them and pick the
+ * pixels close to a colour. Every kernel exists as a scalar version and, on x86,
+ * as SSSE3 and AVX2 versions; best() picks the fastest set the CPU supports
+ * once, on first use.
+ */
+class PixelKernels
+{
+public:
+    enum Isa{
+        Scalar=0,
+        SSSE3=1,
+        AVX2=2
+    };
+
+    typedef void (*ConvertRow)(const uchar *src, uchar *dst, int width);
+    // float rows map [mini, maxi] onto [0, 255], clamping the rest
+    typedef void (*ConvertScaledRow)(const uchar *src, uchar *dst, int width,
+                                     double mini, double maxi);
+    /* one row of a brush dab, see BrushEngine: coverage builds up by
+     * mask * flow, dst is before blended towards color by coverage * opacity.
+     * color is premultiplied BGRA, flow and opacity are 0..255 */
+    typedef void (*DabRow)(const uchar *before, uchar *dst, uchar *coverage, const uchar *mask,
+                           int width, quint32 color, uint flow, uint opacity);
+    // dst is 255 where no channel of the BGRA pixel is further than
+    // tolerance (0..255) from color, 0 elsewhere; one byte per pixel
+    typedef void (*MatchRow)(const uchar *src, uchar *dst, int width, quint32 color, uint tolerance);
+
+    ConvertRow gray8ToBGRA;
+    ConvertRow bgr8ToBGRA;
+    ConvertRow bgra8ToBGRA;     // premultiplies
+    ConvertRow gray16ToBGRA;
+    ConvertScaledRow gray32FToBGRA;
+    ConvertScaledRow gray64FToBGRA;
+    ConvertRow unpremultiplyToRGBA;
+    DabRow blendDab;
+    MatchRow matchColor;
+
+    Isa isa;
+
+    static const PixelKernels &best();
+    static PixelKernels forIsa(Isa isa);
+    static bool isSupported(Isa isa);
+    static const char *isaName(Isa isa);
+
+    // times every kernel of every supported isa and prints GB/s
+    static int benchmark();
+};
+
+#endif // PIXELKERNELS_H
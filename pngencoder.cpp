@@ -0,0 +1,178 @@
+﻿#include <QtConcurrent>
+#include <QtEndian>
+#include <string.h>
+#include <zlib.h>
+
+#include "pngencoder.h"
+#include "pixelkernels.h"
+
+// one slice of filtered scanlines, deflated on its own
+struct DeflateJob
+{
+    QByteArray data;
+    QByteArray dictionary;
+    int level;
+};
+
+struct DeflatedChunk
+{
+    QByteArray data;
+    quint32 adler;
+    int length;
+};
+
+static DeflatedChunk deflateChunk(const DeflateJob &job)
+{
+    DeflatedChunk chunk;
+    chunk.adler = adler32(adler32(0, Z_NULL, 0), (const Bytef *) job.data.constData(), job.data.size());
+    chunk.length = job.data.size();
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // raw deflate, the zlib header and trailer are written once for all chunks
+    deflateInit2(&stream, job.level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    if(!job.dictionary.isEmpty())
+        deflateSetDictionary(&stream, (const Bytef *) job.dictionary.constData(), job.dictionary.size());
+
+    chunk.data.resize(deflateBound(&stream, job.data.size()) + 16);
+    stream.next_in = (Bytef *) job.data.constData();
+    stream.avail_in = job.data.size();
+    stream.next_out = (Bytef *) chunk.data.data();
+    stream.avail_out = chunk.data.size();
+    // byte aligned and not final, so the next chunk can follow directly
+    deflate(&stream, Z_SYNC_FLUSH);
+    chunk.data.resize(chunk.data.size() - stream.avail_out);
+    deflateEnd(&stream);
+    return chunk;
+}
+
+static inline uchar paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = qAbs(p - a), pb = qAbs(p - b), pc = qAbs(p - c);
+    if(pa <= pb && pa <= pc) return a;
+    return (pb <= pc) ? b : c;
+}
+
+// Paeth filters one RGBA row, prefixed with its filter type byte
+static void filterRow(const uchar *row, const uchar *above, int bytes, uchar *out)
+{
+    *out++ = 4;
+    for(int i = 0; i < bytes; i++)
+    {
+        int a = (i >= 4) ? row[i-4] : 0;
+        int b = above[i];
+        int c = (i >= 4) ? above[i-4] : 0;
+        out[i] = row[i] - paeth(a, b, c);
+    }
+}
+
+
+PngEncoder::PngEncoder(QIODevice *device, const QSize &size, int level)
+    :device(device), size(size), level(level)
+{
+    rowsWritten = 0;
+    isStreamStarted = false;
+    adler = adler32(0, Z_NULL, 0);
+    previousRow.fill(0, 4*size.width());
+}
+
+bool PngEncoder::writeChunk(const char *type, const QByteArray &data)
+{
+    uchar length[4];
+    qToBigEndian<quint32>(data.size(), length);
+    quint32 crc = crc32(0, (const Bytef *) type, 4);
+    crc = crc32(crc, (const Bytef *) data.constData(), data.size());
+    uchar crcBytes[4];
+    qToBigEndian<quint32>(crc, crcBytes);
+
+    return device->write((const char *) length, 4) == 4
+            && device->write(type, 4) == 4
+            && device->write(data) == data.size()
+            && device->write((const char *) crcBytes, 4) == 4;
+}
+
+bool PngEncoder::writeHeader()
+{
+    static const char signature[8] = {'\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n'};
+    if(device->write(signature, 8) != 8) return false;
+
+    QByteArray header(13, 0);
+    qToBigEndian<quint32>(size.width(), (uchar *) header.data());
+    qToBigEndian<quint32>(size.height(), (uchar *) header.data() + 4);
+    header[8] = 8;      // bit depth
+    header[9] = 6;      // RGBA
+    return writeChunk("IHDR", header);
+}
+
+bool PngEncoder::writeBand(const QImage &band)
+{
+    // PNG stores straight alpha
+    const PixelKernels &kernels = PixelKernels::best();
+    QImage rgba(band.size(), QImage::Format_RGBA8888);
+    for(int y = 0; y < band.height(); y++)
+        kernels.unpremultiplyToRGBA(band.constScanLine(y), rgba.scanLine(y), band.width());
+    int rowBytes = 4*size.width();
+
+    // about 128K of input per chunk, as pigz does
+    int rowsPerChunk = qMax(1, (128*1024) / (rowBytes + 1));
+    QList<DeflateJob> jobs;
+    for(int first = 0; first < rgba.height(); first += rowsPerChunk)
+    {
+        int rows = qMin(rowsPerChunk, rgba.height() - first);
+        DeflateJob job;
+        job.level = level;
+        job.data.resize(rows * (rowBytes + 1));
+        uchar *out = (uchar *) job.data.data();
+        for(int y = first; y < first + rows; y++)
+        {
+            const uchar *above = (y > 0) ? rgba.constScanLine(y-1) : (const uchar *) previousRow.constData();
+            filterRow(rgba.constScanLine(y), above, rowBytes, out);
+            out += rowBytes + 1;
+        }
+
+        // the window slides over the filtered stream, chunk by chunk
+        job.dictionary = window;
+        window = (window + job.data).right(32768);
+        jobs.append(job);
+    }
+    memcpy(previousRow.data(), rgba.constScanLine(rgba.height()-1), rowBytes);
+    rowsWritten += rgba.height();
+
+    QList<DeflatedChunk> chunks = QtConcurrent::blockingMapped<QList<DeflatedChunk> >(jobs, deflateChunk);
+
+    QByteArray data;
+    if(!isStreamStarted)
+    {
+        data.append('\x78').append('\x9c');
+        isStreamStarted = true;
+    }
+    foreach(const DeflatedChunk &chunk, chunks)
+    {
+        data.append(chunk.data);
+        adler = adler32_combine(adler, chunk.adler, chunk.length);
+    }
+    return writeChunk("IDAT", data);
+}
+
+bool PngEncoder::finish()
+{
+    if(rowsWritten != size.height()) return false;
+
+    // an empty final block closes the deflate stream, then the adler32
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    QByteArray data(64, 0);
+    stream.next_out = (Bytef *) data.data();
+    stream.avail_out = data.size();
+    deflate(&stream, Z_FINISH);
+    data.resize(data.size() - stream.avail_out);
+    deflateEnd(&stream);
+
+    uchar trailer[4];
+    qToBigEndian<quint32>(adler, trailer);
+    data.append((const char *) trailer, 4);
+
+    return writeChunk("IDAT", data) && writeChunk("IEND", QByteArray());
+}
@@ -0,0 +1,38 @@
+﻿#ifndef PNGENCODER_H
+#define PNGENCODER_H
+
+#include <QIODevice>
+#include <QByteArray>
+#include <QImage>
+#include <QSize>
+
+/* Writes an 8-bit RGBA PNG band by band, deflating each band in parallel
+ * chunks the way pigz does. Every chunk is primed with the 32K of filtered
+ * data before it and ends on a sync flush, so the chunks concatenate into
+ * one ordinary zlib stream, and their adler32s are combined for its
+ * trailer. Any PNG reader can open the result.
+ */
+class PngEncoder
+{
+public:
+    PngEncoder(QIODevice *device, const QSize &size, int level = 6);
+
+    bool writeHeader();
+    // the next rows of the image, Format_ARGB32_Premultiplied, full width
+    bool writeBand(const QImage &band);
+    bool finish();
+
+private:
+    QIODevice *device;
+    QSize size;
+    int level;
+    int rowsWritten;
+    bool isStreamStarted;
+    quint32 adler;
+    QByteArray previousRow;     // unfiltered, for the Up and Paeth filters
+    QByteArray window;          // the last 32K of filtered data
+
+    bool writeChunk(const char *type, const QByteArray &data);
+};
+
+#endif // PNGENCODER_H
@@ -0,0 +1,418 @@
+﻿#include <QtConcurrent>
+#include <QDataStream>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QHash>
+#include <QtEndian>
+
+#include "projectfile.h"
+#include "opencvprocess.h"
+#include "toolbox.h"
+
+static const quint32 projectMagic = 0x50494d47;     // "PMIG"
+static const quint32 projectVersion = 1;
+static const int headerSize = 8;
+static const int footerSize = 16;
+
+// compressed tile bytes: reused as they are if the tile is still in a file
+static QByteArray tileBytes(const Tile *tile)
+{
+    TileLocation location = tile->location();
+    if(!location.isNull())
+        return location.file->rawTile(location);
+
+    // the fastest level, a save should not wait on the compressor
+    return tile->pixels().compressed(1);
+}
+
+// the tile grids of a layer that go into the file, native samples last
+static QList<const TiledImage *> imagesOf(const Layer &layer)
+{
+    QList<const TiledImage *> images;
+    images.append(&layer.image);
+    if(!layer.native.isNull()) images.append(&layer.native);
+    return images;
+}
+
+static void writeLocations(QDataStream &index, const TiledImage &image,
+                           const QHash<const Tile *, QPair<qint64, int> > &written,
+                           const QHash<const Tile *, TileLocation> &locations)
+{
+    for(int i = 0; i < image.tileCount(); i++)
+    {
+        const Tile *tile = &image.tileData(i);
+        if(written.contains(tile))
+            index << written.value(tile).first << (qint32) written.value(tile).second;
+        else
+            index << locations.value(tile).offset << (qint32) locations.value(tile).length;
+    }
+}
+
+
+ProjectFile::ProjectFile(const QString &fileName)
+    :path(fileName), file(fileName), map(0), mappedSize(0), endOffset(0), liveBytes(0)
+{
+    ;
+}
+
+ProjectFile::~ProjectFile()
+{
+    if(map) file.unmap(map);
+}
+
+QSharedPointer<ProjectFile> ProjectFile::mapFile(const QString &fileName, QString *error)
+{
+    QSharedPointer<ProjectFile> project(new ProjectFile(QFileInfo(fileName).absoluteFilePath()));
+    if(!project->file.open(QIODevice::ReadOnly))
+    {
+        *error = project->file.errorString();
+        return QSharedPointer<ProjectFile>();
+    }
+
+    // without a mapping the tiles are read through the file instead
+    project->endOffset = project->file.size();
+    project->map = project->file.map(0, project->endOffset);
+    if(project->map) project->mappedSize = project->endOffset;
+    return project;
+}
+
+QByteArray ProjectFile::rawTile(const TileLocation &location) const
+{
+    if(location.offset + location.length <= mappedSize)
+        return QByteArray((const char *) map + location.offset, location.length);
+
+    QMutexLocker locker(&readMutex);
+    if(!file.seek(location.offset)) return QByteArray();
+    return file.read(location.length);
+}
+
+bool ProjectFile::readTile(const TileLocation &location, PixelBuffer *pixels) const
+{
+    if(location.offset + location.length <= mappedSize)
+        return pixels->uncompress(map + location.offset, location.length);
+
+    QByteArray data = rawTile(location);
+    return pixels->uncompress((const uchar *) data.constData(), data.size());
+}
+
+QVector<TileLocation> ProjectFile::readLocations(QDataStream &index, int tileCount,
+                                                 const QSharedPointer<ProjectFile> &project,
+                                                 qint64 indexOffset)
+{
+    QVector<TileLocation> locations(tileCount);
+    for(int i = 0; i < tileCount; i++)
+    {
+        TileLocation &location = locations[i];
+        qint32 length;
+        index >> location.offset >> length;
+        location.length = length;
+        location.file = project;
+        if(location.offset < headerSize || location.offset + length > indexOffset)
+            index.setStatus(QDataStream::ReadCorruptData);
+        project->liveBytes += length;
+    }
+    return locations;
+}
+
+qint64 ProjectFile::findFooter(qint64 *indexOffset, quint32 *indexLength) const
+{
+    // the last footer right behind its index; a save cut short leaves a
+    // partial tail after it. Scanned from the end a chunk at a time, chunks
+    // overlap by a footer less a byte
+    const qint64 chunkSize = 1 << 20;
+    qint64 end = file.size();
+    while(end >= headerSize + footerSize)
+    {
+        qint64 start = qMax(qint64(headerSize), end - chunkSize);
+        if(!file.seek(start)) return -1;
+        QByteArray chunk = file.read(end - start);
+        if(chunk.size() != end - start) return -1;
+
+        const uchar *data = (const uchar *) chunk.constData();
+        for(qint64 p = end - footerSize; p >= start; p--)
+        {
+            const uchar *footer = data + (p - start);
+            if(qFromBigEndian<quint32>(footer + 12) != projectMagic) continue;
+            qint64 offset = qFromBigEndian<qint64>(footer);
+            quint32 length = qFromBigEndian<quint32>(footer + 8);
+            if(offset < headerSize || offset + length != p) continue;
+
+            *indexOffset = offset;
+            *indexLength = length;
+            return p + footerSize;
+        }
+        if(start == headerSize) break;
+        end = start + footerSize - 1;
+    }
+    return -1;
+}
+
+QSharedPointer<ProjectFile> ProjectFile::open(const QString &fileName, OpencvProcess *process,
+                                              QString *error)
+{
+    QSharedPointer<ProjectFile> project = mapFile(fileName, error);
+    if(!project) return project;
+
+    QFile &file = project->file;
+    qint64 size = file.size();
+    if(size < headerSize + footerSize)
+    {
+        *error = QObject::tr("Not a PMIG project");
+        return QSharedPointer<ProjectFile>();
+    }
+
+    quint32 magic, version;
+    QDataStream header(file.read(headerSize));
+    header >> magic >> version;
+
+    qint64 indexOffset = 0;
+    quint32 indexLength = 0;
+    qint64 footerEnd = magic == projectMagic ? project->findFooter(&indexOffset, &indexLength) : -1;
+    if(footerEnd < 0 || version > projectVersion)
+    {
+        *error = QObject::tr("Not a PMIG project, or a damaged one");
+        return QSharedPointer<ProjectFile>();
+    }
+    // the next save rewrites the file whole, without the tail
+    if(footerEnd != size)
+        qWarning("ProjectFile: ignoring %lld bytes of an unfinished save", size - footerEnd);
+    project->endOffset = footerEnd;
+
+    file.seek(indexOffset);
+    QDataStream index(file.read(indexLength));
+    index.setVersion(QDataStream::Qt_5_0);
+
+    qint32 width, height, layerCount;
+    index >> width >> height >> layerCount;
+    if(width <= 0 || height <= 0 || layerCount <= 0)
+    {
+        *error = QObject::tr("The project has no layers");
+        return QSharedPointer<ProjectFile>();
+    }
+
+    LayerStack layerStack;
+    for(int l = 0; l < layerCount && index.status() == QDataStream::Ok; l++)
+    {
+        Layer layer;
+        qint32 blendMode, tileCount;
+        index >> layer.name >> layer.isVisible >> layer.opacity >> blendMode >> tileCount;
+        layer.blendMode = Layer::BlendMode(blendMode);
+
+        qint64 columns = (width + TiledImage::TileSize - 1) / TiledImage::TileSize;
+        qint64 rows = (height + TiledImage::TileSize - 1) / TiledImage::TileSize;
+        if(tileCount != columns*rows) break;
+        // only the locations for now, see Tile
+        layer.image = TiledImage(width, height, CV_8UC4,
+                                 readLocations(index, tileCount, project, indexOffset));
+
+        qint32 nativeType;
+        index >> nativeType;
+        if(nativeType >= 0)
+        {
+            if(!WindowLevel::isNativeType(nativeType)) break;
+            double low, high;
+            index >> low >> high;
+            layer.native = TiledImage(width, height, nativeType,
+                                      readLocations(index, tileCount, project, indexOffset));
+            layer.window = WindowLevel(nativeType);
+            layer.window.setWindow(low, high);
+        }
+        layerStack.append(layer);
+    }
+
+    qint32 currentLayer;
+    ToolSettings toolSettings;
+    QColor fgColor, bgColor;
+    SelectionMask selection(layerStack.canvasSize());
+    index >> currentLayer >> selection;
+    if(selection.size() != layerStack.canvasSize())
+        index.setStatus(QDataStream::ReadCorruptData);
+    index >> toolSettings >> fgColor >> bgColor;
+
+    if(index.status() != QDataStream::Ok || layerStack.size() != layerCount)
+    {
+        *error = QObject::tr("The project index is damaged");
+        return QSharedPointer<ProjectFile>();
+    }
+
+    process->layerStack = layerStack;
+    process->currentImageNum = qBound(0, (int)currentLayer, layerStack.size()-1);
+    process->selection = selection;
+    process->fgColor = fgColor;
+    process->bgColor = bgColor;
+    toolSettings.apply();
+    return project;
+}
+
+QSharedPointer<ProjectFile> ProjectFile::save(const QString &fileName, OpencvProcess *process,
+                                              const QSharedPointer<ProjectFile> &current,
+                                              QString *error)
+{
+    const LayerStack &layerStack = process->layerStack;
+    if(layerStack.isEmpty())
+    {
+        *error = QObject::tr("Nothing to save");
+        return QSharedPointer<ProjectFile>();
+    }
+
+    // appending is only safe onto the very file the locations point into
+    QString path = QFileInfo(fileName).absoluteFilePath();
+    bool isAppending = current && current->fileName() == path
+            && QFileInfo(path).size() == current->endOffset;
+
+    // each distinct tile once: duplicated layers share theirs
+    QList<const Tile *> pending;
+    QHash<const Tile *, TileLocation> locations;
+    qint64 liveBytes = 0;
+    for(int l = 0; l < layerStack.size(); l++)
+    {
+        foreach(const TiledImage *image, imagesOf(layerStack.at(l)))
+        {
+            for(int i = 0; i < image->tileCount(); i++)
+            {
+                const Tile *tile = &image->tileData(i);
+                if(locations.contains(tile)) continue;
+
+                TileLocation location = tile->location();
+                if(isAppending && location.file == current)
+                {
+                    liveBytes += location.length;
+                }
+                else
+                {
+                    location = TileLocation();
+                    pending.append(tile);
+                }
+                locations.insert(tile, location);
+            }
+        }
+    }
+
+    // too much dead data behind: compact by writing the whole file anew
+    if(isAppending && current->endOffset - liveBytes > liveBytes + (64 << 20))
+    {
+        isAppending = false;
+        pending.clear();
+        for(QHash<const Tile *, TileLocation>::iterator it = locations.begin(); it != locations.end(); ++it)
+        {
+            it.value() = TileLocation();
+            pending.append(it.key());
+        }
+    }
+
+    QFile appendFile(path);
+    QSaveFile saveFile(path);
+    QIODevice *device;
+    if(isAppending)
+    {
+        if(!appendFile.open(QIODevice::ReadWrite) || !appendFile.seek(current->endOffset))
+        {
+            *error = appendFile.errorString();
+            return QSharedPointer<ProjectFile>();
+        }
+        device = &appendFile;
+    }
+    else
+    {
+        // QSaveFile replaces the target only once it is complete
+        if(!saveFile.open(QIODevice::WriteOnly))
+        {
+            *error = saveFile.errorString();
+            return QSharedPointer<ProjectFile>();
+        }
+        QByteArray header;
+        QDataStream stream(&header, QIODevice::WriteOnly);
+        stream << projectMagic << projectVersion;
+        saveFile.write(header);
+        device = &saveFile;
+    }
+
+    // compressed in parallel, a batch at a time to bound the memory
+    QHash<const Tile *, QPair<qint64, int> > written;
+    const int batchSize = 256;
+    for(int first = 0; first < pending.size(); first += batchSize)
+    {
+        QList<const Tile *> batch = pending.mid(first, batchSize);
+        QList<QByteArray> blobs = QtConcurrent::blockingMapped<QList<QByteArray> >(batch, tileBytes);
+        for(int i = 0; i < batch.size(); i++)
+        {
+            written.insert(batch.at(i), qMakePair(device->pos(), blobs.at(i).size()));
+            if(blobs.at(i).isEmpty() || device->write(blobs.at(i)) != blobs.at(i).size())
+            {
+                *error = blobs.at(i).isEmpty() ? QObject::tr("Unable to read a tile back")
+                                                : device->errorString();
+                // back to the last complete save
+                if(isAppending)
+                    appendFile.resize(current->endOffset);
+                else
+                    saveFile.cancelWriting();
+                return QSharedPointer<ProjectFile>();
+            }
+            liveBytes += blobs.at(i).size();
+        }
+    }
+
+    QByteArray indexData;
+    QDataStream index(&indexData, QIODevice::WriteOnly);
+    index.setVersion(QDataStream::Qt_5_0);
+    QSize canvas = layerStack.canvasSize();
+    index << (qint32) canvas.width() << (qint32) canvas.height() << (qint32) layerStack.size();
+    for(int l = 0; l < layerStack.size(); l++)
+    {
+        const Layer &layer = layerStack.at(l);
+        index << layer.name << layer.isVisible << layer.opacity << (qint32) layer.blendMode
+              << (qint32) layer.image.tileCount();
+        writeLocations(index, layer.image, written, locations);
+        // the native samples and their window, -1 for an 8-bit layer
+        index << (qint32) (layer.native.isNull() ? -1 : layer.native.type());
+        if(layer.native.isNull()) continue;
+        index << layer.window.low() << layer.window.high();
+        writeLocations(index, layer.native, written, locations);
+    }
+    index << (qint32) process->currentImageNum << process->selection << ToolSettings::current()
+          << process->fgColor << process->bgColor;
+
+    QByteArray footerData;
+    QDataStream footer(&footerData, QIODevice::WriteOnly);
+    footer << (qint64) device->pos() << (quint32) indexData.size() << projectMagic;
+
+    bool ok = device->write(indexData) == indexData.size();
+    if(isAppending)
+    {
+        // the footer only goes out once what it points to has, see open()
+        ok = ok && appendFile.flush()
+                && appendFile.write(footerData) == footerData.size() && appendFile.flush();
+        if(!ok)
+        {
+            *error = appendFile.errorString();
+            appendFile.resize(current->endOffset);
+        }
+        appendFile.close();
+    }
+    else
+    {
+        ok = ok && saveFile.write(footerData) == footerData.size() && saveFile.commit();
+        if(!ok) *error = saveFile.errorString();
+    }
+    if(!ok) return QSharedPointer<ProjectFile>();
+
+    // from now on the written tiles can be skipped by the next save
+    QSharedPointer<ProjectFile> project = current;
+    if(isAppending)
+        project->endOffset = QFileInfo(path).size();
+    else
+        project = mapFile(path, error);
+    if(!project) return project;
+    project->liveBytes = liveBytes;
+
+    for(QHash<const Tile *, QPair<qint64, int> >::const_iterator it = written.constBegin();
+        it != written.constEnd(); ++it)
+    {
+        TileLocation location;
+        location.file = project;
+        location.offset = it.value().first;
+        location.length = it.value().second;
+        it.key()->setLocation(location);
+    }
+    return project;
+}
@@ -0,0 +1,71 @@
+﻿#ifndef PROJECTFILE_H
+#define PROJECTFILE_H
+
+#include <QFile>
+#include <QString>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QDataStream>
+
+#include "tiledimage.h"
+
+class OpencvProcess;
+
+/* The native .pmig project: every layer with its properties, the
+ * selection and the tool settings. A 16-bit or float grey layer keeps its
+ * samples and window next to the tiles it is shown with.
+ *
+ *   "PMIG" version
+ *   tile, tile, ...              each qCompress'ed on its own
+ *   index                        QDataStream: layers, tile offsets, state
+ *   index offset, length, "PMIG" fixed size footer
+ *
+ * Opening maps the file and reads only the index; tiles are decompressed
+ * the first time they are used, see Tile. Saving again to the same file
+ * appends just the tiles written since and a new index, the old index is
+ * left behind as dead bytes; once those outweigh the live ones the file is
+ * rewritten whole. An append that fails is cut off again, and one a crash
+ * left unfinished is skipped on opening, back to the last footer. A
+ * ProjectFile stays alive while any tile points into it.
+ */
+class ProjectFile
+{
+public:
+    ~ProjectFile();
+
+    const QString &fileName() const {return path;}
+
+    bool readTile(const TileLocation &location, PixelBuffer *pixels) const;
+    // the compressed bytes, for copying a tile into another file unchanged
+    QByteArray rawTile(const TileLocation &location) const;
+
+    // replace process' layers, selection and tool settings
+    static QSharedPointer<ProjectFile> open(const QString &fileName, OpencvProcess *process,
+                                            QString *error);
+    // current is the file the project was last opened from or saved to
+    static QSharedPointer<ProjectFile> save(const QString &fileName, OpencvProcess *process,
+                                            const QSharedPointer<ProjectFile> &current,
+                                            QString *error);
+
+private:
+    ProjectFile(const QString &fileName);
+    Q_DISABLE_COPY(ProjectFile)
+
+    QString path;
+    mutable QFile file;
+    mutable QMutex readMutex;   // for reads past the mapping
+    uchar *map;
+    qint64 mappedSize;
+    qint64 endOffset;           // where the next save appends
+    qint64 liveBytes;           // bytes of tiles the last index refers to
+
+    static QSharedPointer<ProjectFile> mapFile(const QString &fileName, QString *error);
+    // the end of the last complete save, -1 if there is none
+    qint64 findFooter(qint64 *indexOffset, quint32 *indexLength) const;
+    // tileCount locations from the index, which must lie before it
+    static QVector<TileLocation> readLocations(QDataStream &index, int tileCount,
+                                               const QSharedPointer<ProjectFile> &project,
+                                               qint64 indexOffset);
+};
+
+#endif // PROJECTFILE_H
@@ -0,0 +1,416 @@
+﻿#include <QtConcurrent>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QDir>
+#include <QSet>
+#include <QDebug>
+#include <zlib.h>
+
+#include "recoveryjournal.h"
+#include "opencvprocess.h"
+
+static const quint32 journalMagic = 0x504d494a;     // "PMIJ"
+static const quint32 journalVersion = 1;
+static const quint32 recordMagic = 0x5245434f;      // "RECO"
+static const int headerSize = 8;
+
+static QByteArray compressTile(const Tile *tile)
+{
+    return tile->pixels().compressed(1);
+}
+
+// tile index of a layer in the journal: the native samples, if any, are
+// numbered after the display tiles
+static const Tile &journalTile(const Layer &layer, int index)
+{
+    int count = layer.image.tileCount();
+    return index < count ? layer.image.tileData(index) : layer.native.tileData(index - count);
+}
+
+struct DecodeJob
+{
+    PixelBuffer *pixels;
+    QByteArray data;
+    bool ok;
+};
+
+static void decodeTile(DecodeJob &job)
+{
+    job.ok = job.pixels->uncompress((const uchar *) job.data.constData(), job.data.size());
+}
+
+
+RecoveryJournal::RecoveryJournal(QObject *parent)
+    :QObject(parent),
+      path(QDir(QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation))
+           .filePath("recovery.pmij")),
+      lock(path + ".lock"),
+      endOffset(0), liveBytes(0), needsRestart(true)
+{
+    QDir().mkpath(QFileInfo(path).path());
+    lock.setStaleLockTime(0);
+    if(!lock.tryLock(0))
+        qWarning() << "Recovery: journal in use by another instance, autosave is off";
+
+    watcher = new QFutureWatcher<bool>(this);
+    connect(watcher, SIGNAL(finished()), this, SLOT(writeFinished()));
+}
+
+RecoveryJournal::~RecoveryJournal()
+{
+    watcher->waitForFinished();
+}
+
+bool RecoveryJournal::canRecover() const
+{
+    return isEnabled() && QFileInfo(path).size() > headerSize;
+}
+
+void RecoveryJournal::append(const OpencvProcess *process)
+{
+    if(!isEnabled() || watcher->isRunning() || process->layerStack.isEmpty()) return;
+
+    JournalBatch batch;
+    batch.layers = process->layerStack;
+    batch.isRestart = needsRestart;
+
+    QSize size = batch.layers.canvasSize();
+    QDataStream layout(&batch.layout, QIODevice::WriteOnly);
+    layout.setVersion(QDataStream::Qt_5_0);
+    layout << qint32(size.width()) << qint32(size.height()) << qint32(batch.layers.size());
+
+    // a tile the layer no longer shares with the journaled one was drawn on
+    bool isDirty = false;
+    for(int l = 0; l < batch.layers.size(); l++)
+    {
+        const Layer &layer = batch.layers.at(l);
+        layout << qint32(layer.id) << layer.name << layer.isVisible << layer.opacity
+               << qint32(layer.blendMode)
+               << qint32(layer.native.isNull() ? -1 : layer.native.type());
+        if(!layer.native.isNull())
+            layout << layer.window.low() << layer.window.high();
+
+        int journaledIndex = batch.isRestart ? -1 : journaled.indexOf(layer.id);
+        const Layer *before = journaledIndex < 0 ? 0 : &journaled.at(journaledIndex);
+        // a layer made native since, or no longer, starts over
+        if(before && before->native.isNull() != layer.native.isNull()) before = 0;
+        QVector<int> dirty;
+        int count = layer.image.tileCount();
+        for(int i = 0; i < count; i++)
+        {
+            if(!before || !layer.image.sharesTile(before->image, i))
+                dirty.append(i);
+        }
+        for(int i = 0; i < layer.native.tileCount(); i++)
+        {
+            if(!before || !layer.native.sharesTile(before->native, i))
+                dirty.append(count + i);
+        }
+        isDirty = isDirty || !dirty.isEmpty();
+        batch.dirtyTiles.append(dirty);
+    }
+    layout << qint32(process->currentImageNum) << process->fgColor << process->bgColor;
+
+    if(!isDirty && !batch.isRestart && batch.layout == lastLayout) return;
+
+    journaled = batch.layers;
+    lastLayout = batch.layout;
+    needsRestart = false;
+    watcher->setFuture(QtConcurrent::run(this, &RecoveryJournal::write, batch));
+}
+
+void RecoveryJournal::writeFinished()
+{
+    if(!watcher->result())
+    {
+        // the file is back to its last complete record, start over from it
+        journaled.clear();
+        needsRestart = true;
+        return;
+    }
+
+    // mostly superseded tiles: rewrite it with just the live ones
+    if(endOffset > 2*liveBytes + (64 << 20))
+    {
+        journaled.clear();
+        needsRestart = true;
+    }
+}
+
+void RecoveryJournal::discard()
+{
+    if(!isEnabled()) return;
+
+    watcher->waitForFinished();
+    file.close();
+    QFile::remove(path);
+    journaled.clear();
+    lastLayout.clear();
+    tileBytes.clear();
+    endOffset = liveBytes = 0;
+    needsRestart = true;
+}
+
+bool RecoveryJournal::write(const JournalBatch &batch)
+{
+    if(batch.isRestart)
+    {
+        // the old journal stays in place until the new one is complete
+        QSaveFile saveFile(path);
+        tileBytes.clear();
+        liveBytes = 0;
+        if(!saveFile.open(QIODevice::WriteOnly))
+        {
+            qWarning() << "Recovery: unable to write" << path << saveFile.errorString();
+            return false;
+        }
+        QDataStream header(&saveFile);
+        header << journalMagic << journalVersion;
+        endOffset = headerSize;
+        file.close();
+        if(!writeRecord(&saveFile, batch) || !saveFile.commit())
+        {
+            qWarning() << "Recovery: unable to write" << path << saveFile.errorString();
+            return false;
+        }
+    }
+
+    if(!file.isOpen())
+    {
+        file.setFileName(path);
+        if(!file.open(QIODevice::ReadWrite))
+        {
+            qWarning() << "Recovery: unable to open" << path << file.errorString();
+            return false;
+        }
+    }
+    if(batch.isRestart) return true;
+
+    if(!file.seek(endOffset) || !writeRecord(&file, batch) || !file.flush())
+    {
+        qWarning() << "Recovery: unable to append to" << path << file.errorString();
+        file.resize(endOffset);
+        return false;
+    }
+    return true;
+}
+
+bool RecoveryJournal::writeRecord(QFileDevice *device, const JournalBatch &batch)
+{
+    QList<const Tile *> tiles;
+    for(int l = 0; l < batch.layers.size(); l++)
+        foreach(int index, batch.dirtyTiles.at(l))
+            tiles.append(&journalTile(batch.layers.at(l), index));
+    QList<QByteArray> blobs = QtConcurrent::blockingMapped<QList<QByteArray> >(tiles, compressTile);
+
+    QByteArray payload = batch.layout;
+    QDataStream stream(&payload, QIODevice::WriteOnly | QIODevice::Append);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << qint32(blobs.size());
+
+    QHash<QPair<int, int>, int> written;
+    int b = 0;
+    for(int l = 0; l < batch.layers.size(); l++)
+    {
+        int layerId = batch.layers.at(l).id;
+        foreach(int index, batch.dirtyTiles.at(l))
+        {
+            stream << qint32(layerId) << qint32(index) << blobs.at(b);
+            written.insert(qMakePair(layerId, index), blobs.at(b).size());
+            b++;
+        }
+    }
+
+    QByteArray record;
+    QDataStream header(&record, QIODevice::WriteOnly);
+    header << recordMagic << quint32(payload.size());
+    record += payload;
+    QDataStream trailer(&record, QIODevice::WriteOnly | QIODevice::Append);
+    trailer << quint32(crc32(0, (const Bytef *) payload.constData(), payload.size()));
+
+    if(device->write(record) != record.size()) return false;
+    endOffset += record.size();
+
+    // deleted layers drop out, their tiles are dead bytes now
+    QSet<int> layerIds;
+    for(int l = 0; l < batch.layers.size(); l++)
+        layerIds.insert(batch.layers.at(l).id);
+    for(QHash<QPair<int, int>, int>::iterator it = written.begin(); it != written.end(); ++it)
+        tileBytes.insert(it.key(), it.value());
+    liveBytes = 0;
+    for(QHash<QPair<int, int>, int>::iterator it = tileBytes.begin(); it != tileBytes.end(); )
+    {
+        if(!layerIds.contains(it.key().first))
+        {
+            it = tileBytes.erase(it);
+            continue;
+        }
+        liveBytes += it.value();
+        ++it;
+    }
+    return true;
+}
+
+bool RecoveryJournal::recover(OpencvProcess *process, QString *error)
+{
+    watcher->waitForFinished();
+    file.close();
+    file.setFileName(path);
+    if(!file.open(QIODevice::ReadWrite))
+    {
+        *error = file.errorString();
+        return false;
+    }
+
+    quint32 magic, version;
+    QDataStream header(file.read(headerSize));
+    header >> magic >> version;
+    if(magic != journalMagic || version > journalVersion)
+    {
+        *error = tr("Not a recovery journal");
+        return false;
+    }
+
+    // the newest copy of every tile, and the newest layout
+    QHash<QPair<int, int>, QByteArray> tiles;
+    QByteArray layout;
+    qint64 offset = headerSize;
+    forever
+    {
+        QDataStream recordHeader(file.read(8));
+        quint32 tag, length;
+        recordHeader >> tag >> length;
+        if(recordHeader.status() != QDataStream::Ok || tag != recordMagic) break;
+
+        QByteArray payload = file.read(length);
+        QDataStream trailer(file.read(4));
+        quint32 checksum;
+        trailer >> checksum;
+        if(payload.size() != int(length) || trailer.status() != QDataStream::Ok
+                || checksum != crc32(0, (const Bytef *) payload.constData(), payload.size()))
+            break;
+
+        // the layout block has no length of its own, read past it
+        QDataStream stream(payload);
+        stream.setVersion(QDataStream::Qt_5_0);
+        qint32 width, height, layerCount;
+        stream >> width >> height >> layerCount;
+        for(int l = 0; l < layerCount && stream.status() == QDataStream::Ok; l++)
+        {
+            qint32 id, blendMode, nativeType;
+            QString name;
+            bool isVisible;
+            qreal opacity;
+            double low, high;
+            stream >> id >> name >> isVisible >> opacity >> blendMode >> nativeType;
+            if(nativeType >= 0) stream >> low >> high;
+        }
+        qint32 currentLayer;
+        QColor fgColor, bgColor;
+        stream >> currentLayer >> fgColor >> bgColor;
+        layout = payload.left(stream.device()->pos());
+
+        qint32 tileCount;
+        stream >> tileCount;
+        for(int t = 0; t < tileCount && stream.status() == QDataStream::Ok; t++)
+        {
+            qint32 layerId, index;
+            QByteArray blob;
+            stream >> layerId >> index >> blob;
+            tiles.insert(qMakePair(int(layerId), int(index)), blob);
+        }
+        if(stream.status() != QDataStream::Ok) break;
+        offset = file.pos();
+    }
+    if(layout.isEmpty())
+    {
+        *error = tr("The recovery journal is empty or damaged");
+        return false;
+    }
+
+    QDataStream stream(layout);
+    stream.setVersion(QDataStream::Qt_5_0);
+    qint32 width, height, layerCount;
+    stream >> width >> height >> layerCount;
+    if(width <= 0 || height <= 0 || layerCount <= 0)
+    {
+        *error = tr("The recovery journal has no layers");
+        return false;
+    }
+
+    // decoded in parallel straight into the new layers' tiles
+    LayerStack layerStack;
+    QList<DecodeJob> jobs;
+    for(int l = 0; l < layerCount; l++)
+    {
+        qint32 id, blendMode, nativeType;
+        Layer layer(TiledImage(width, height), QString());
+        stream >> id >> layer.name >> layer.isVisible >> layer.opacity >> blendMode >> nativeType;
+        if(WindowLevel::isNativeType(nativeType))
+        {
+            double low, high;
+            stream >> low >> high;
+            layer.native = TiledImage(width, height, nativeType);
+            layer.window = WindowLevel(nativeType);
+            layer.window.setWindow(low, high);
+        }
+        else if(nativeType >= 0)
+        {
+            stream.setStatus(QDataStream::ReadCorruptData);
+        }
+        layer.blendMode = Layer::BlendMode(blendMode);
+        layer.id = id;
+        layerStack.append(layer);
+    }
+    if(stream.status() != QDataStream::Ok)
+    {
+        *error = tr("The recovery journal is damaged");
+        return false;
+    }
+    for(int l = 0; l < layerStack.size(); l++)
+    {
+        // the native samples are numbered after the display tiles
+        QList<TiledImage *> images;
+        images << &layerStack[l].image;
+        if(!layerStack.at(l).native.isNull()) images << &layerStack[l].native;
+        int index = 0;
+        foreach(TiledImage *image, images)
+        {
+            image->fill(Scalar::all(0));
+            for(int i = 0; i < image->tileCount(); i++, index++)
+            {
+                QPair<int, int> key(layerStack.at(l).id, index);
+                if(!tiles.contains(key)) continue;
+                DecodeJob job;
+                job.pixels = &image->tile(i);
+                job.data = tiles.take(key);
+                jobs.append(job);
+            }
+        }
+    }
+    QtConcurrent::blockingMap(jobs, decodeTile);
+    foreach(const DecodeJob &job, jobs)
+        if(!job.ok) qWarning() << "Recovery: a damaged tile was left blank";
+
+    qint32 currentLayer;
+    QColor fgColor, bgColor;
+    stream >> currentLayer >> fgColor >> bgColor;
+
+    // the recovered layers get fresh ids, so the next append starts a new
+    // journal; until it is complete this one stays, cut to its good records
+    for(int l = 0; l < layerStack.size(); l++)
+        layerStack[l].id = Layer::newId();
+    file.resize(offset);
+    file.close();
+
+    process->layerStack = layerStack;
+    process->currentImageNum = qBound(0, (int)currentLayer, layerStack.size()-1);
+    process->selection = SelectionMask(layerStack.canvasSize());
+    process->fgColor = fgColor;
+    process->bgColor = bgColor;
+    journaled.clear();
+    lastLayout.clear();
+    needsRestart = true;
+    return true;
+}
@@ -0,0 +1,82 @@
+﻿#ifndef RECOVERYJOURNAL_H
+#define RECOVERYJOURNAL_H
+
+#include <QObject>
+#include <QFile>
+#include <QLockFile>
+#include <QHash>
+#include <QPair>
+#include <QColor>
+#include <QFutureWatcher>
+
+#include "layerstack.h"
+
+class OpencvProcess;
+
+// what one append() hands to the write task
+struct JournalBatch
+{
+    LayerStack layers;                  // copy on write snapshot
+    QVector<QVector<int> > dirtyTiles;  // per layer
+    QByteArray layout;                  // layers, their properties and the tool state
+    bool isRestart;                     // a new journal with every tile
+};
+
+/* An append only file of the tiles changed since the last append, so work
+ * since the last save survives a crash.
+ *
+ *   "PMIJ" version
+ *   record, record, ...      magic, length, payload, crc32 of the payload
+ *
+ * A payload is the layout (canvas size, layers with their properties and
+ * the window of native depth ones, current layer, colours) followed by the
+ * tiles dirtied since the record before, each qCompress'ed; the native
+ * samples of a layer count as tiles after its display ones. Recovery replays the records up to the first
+ * incomplete one. append() only takes a snapshot on the GUI thread, the
+ * compression and the write run on the thread pool. Once the file is mostly
+ * superseded tiles it is rewritten whole, under a temporary name.
+ */
+class RecoveryJournal : public QObject
+{
+    Q_OBJECT
+
+public:
+    RecoveryJournal(QObject *parent = 0);
+    // waits for the write in flight
+    ~RecoveryJournal();
+
+    // false if another instance holds the journal
+    bool isEnabled() const {return lock.isLocked();}
+    // a journal left behind by a session that did not end cleanly
+    bool canRecover() const;
+
+    // skipped while the previous append is still being written
+    void append(const OpencvProcess *process);
+    // the document is saved, or replaced
+    void discard();
+    // replace process' layers and tool state
+    bool recover(OpencvProcess *process, QString *error);
+
+private slots:
+    void writeFinished();
+
+private:
+    QString path;
+    QLockFile lock;
+    QFile file;
+    QFutureWatcher<bool> *watcher;
+
+    // written by the task, read once it is finished
+    qint64 endOffset;
+    qint64 liveBytes;
+    QHash<QPair<int, int>, int> tileBytes;  // layer id, tile index
+
+    LayerStack journaled;   // what the journal holds, tiles shared
+    QByteArray lastLayout;
+    bool needsRestart;
+
+    bool write(const JournalBatch &batch);
+    bool writeRecord(QFileDevice *device, const JournalBatch &batch);
+};
+
+#endif // RECOVERYJOURNAL_H
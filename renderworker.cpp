@@ -0,0 +1,73 @@
+﻿#include <QElapsedTimer>
+#include <QMutexLocker>
+
+#include "renderworker.h"
+
+RenderWorker::RenderWorker()
+    :compositor(&layers)
+{
+    isScheduled = false;
+    pendingActiveLayer = -1;
+    pendingReset = false;
+}
+
+void RenderWorker::post(const LayerStack &layers, int activeLayer, bool layersChanged,
+                        const QVector<int> &tiles, const QVector<int> &revisions)
+{
+    QMutexLocker locker(&mutex);
+    pendingLayers = layers;
+    pendingActiveLayer = activeLayer;
+    pendingReset |= layersChanged;
+    for(int i = 0; i < tiles.size(); i++)
+        pendingTiles.insert(tiles.at(i), revisions.at(i));
+
+    if(!isScheduled)
+    {
+        isScheduled = true;
+        QMetaObject::invokeMethod(this, "process", Qt::QueuedConnection);
+    }
+}
+
+void RenderWorker::process()
+{
+    mutex.lock();
+    layers = pendingLayers;
+    int activeLayer = pendingActiveLayer;
+    bool reset = pendingReset;
+    QMap<int, int> tiles = pendingTiles;
+    pendingLayers.clear();
+    pendingTiles.clear();
+    pendingReset = false;
+    isScheduled = false;
+    mutex.unlock();
+
+    if(layers.isEmpty()) return;
+    if(reset) compositor.reset(activeLayer);
+
+    // hand tiles back every few milliseconds so the view fills in progressively
+    RenderedTiles batch;
+    QElapsedTimer timer;
+    timer.start();
+    for(QMap<int, int>::const_iterator it = tiles.constBegin(); it != tiles.constEnd(); ++it)
+    {
+        compositor.invalidate(it.key());
+        batch.indexes.append(it.key());
+        batch.revisions.append(it.value());
+        batch.images.append(compositor.tile(it.key()));
+
+        if(timer.elapsed() >= 8)
+        {
+            emit tilesRendered(batch);
+            batch = RenderedTiles();
+            timer.restart();
+
+            // a structural change makes the rest of this job stale, the GUI
+            // asks for those tiles again with new revisions
+            QMutexLocker locker(&mutex);
+            if(pendingReset) break;
+        }
+    }
+
+    if(!batch.indexes.isEmpty())
+        emit tilesRendered(batch);
+}
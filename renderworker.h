@@ -0,0 +1,61 @@
+﻿#ifndef RENDERWORKER_H
+#define RENDERWORKER_H
+
+#include <QObject>
+#include <QMutex>
+#include <QMap>
+#include <QVector>
+#include <QImage>
+#include <QMetaType>
+
+#include "layerstack.h"
+#include "layercompositor.h"
+
+// composited canvas tiles, revisions[i] is what the GUI asked for
+struct RenderedTiles
+{
+    QVector<int> indexes;
+    QVector<int> revisions;
+    QVector<QImage> images;
+};
+Q_DECLARE_METATYPE(RenderedTiles)
+
+
+/* Composes canvas tiles on its own thread. The GUI posts copy on write
+ * snapshots of the LayerStack with the tiles it wants, tools keep drawing
+ * on the live layers meanwhile, and the finished tiles come back through
+ * tilesRendered() ready to blit. Posts made while a job runs are merged
+ * into one.
+ */
+class RenderWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    RenderWorker();
+
+    // thread safe; layersChanged means anything but the active layer's
+    // pixels changed since the last post
+    void post(const LayerStack &layers, int activeLayer, bool layersChanged,
+              const QVector<int> &tiles, const QVector<int> &revisions);
+
+signals:
+    void tilesRendered(const RenderedTiles &tiles);
+
+private slots:
+    void process();
+
+private:
+    QMutex mutex;
+    bool isScheduled;
+    LayerStack pendingLayers;
+    int pendingActiveLayer;
+    bool pendingReset;
+    QMap<int, int> pendingTiles;    // index -> revision
+
+    // only touched on the worker thread
+    LayerStack layers;
+    LayerCompositor compositor;
+};
+
+#endif // RENDERWORKER_H
@@ -0,0 +1,259 @@
+﻿#include <QMutex>
+#include <QMutexLocker>
+#include <QTemporaryFile>
+#include <QAtomicInt>
+#include <QSettings>
+#include <QVector>
+#include <QPair>
+#include <QDir>
+#include <QDebug>
+#include <algorithm>
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
+
+#include "scratchfile.h"
+
+namespace {
+
+enum {
+    SlotsPerSegment = 256,          // 64MB mapped at a time
+    MaxSegments = 16384             // 1TB
+};
+
+struct Segment
+{
+    uchar *data;
+    QAtomicInt lastUse[SlotsPerSegment];
+    QAtomicInt isResident[SlotsPerSegment];
+    bool isTile[SlotsPerSegment];
+};
+
+struct Scratch
+{
+    Scratch() :segmentCount(0), residentSlots(0), clock(0)
+    {
+        limitSlots.store(int((qint64(QSettings().value("scratch/residentLimit", 1024).toInt()) << 20)
+                             / ScratchFile::SlotSize));
+    }
+
+    QMutex mutex;           // allocation and growth
+    QMutex trimMutex;
+    QAtomicInt isEnabled;
+    QTemporaryFile file;
+    Segment *segments[MaxSegments];
+    QAtomicInt segmentCount;
+    QVector<int> freeSlots;
+    QAtomicInt residentSlots;
+    QAtomicInt limitSlots;
+    QAtomicInt clock;
+};
+
+Scratch &scratch()
+{
+    static Scratch instance;
+    return instance;
+}
+
+Segment *segmentOf(int slot)
+{
+    return scratch().segments[slot / SlotsPerSegment];
+}
+
+uchar *slotData(int slot)
+{
+    return segmentOf(slot)->data + qint64(slot % SlotsPerSegment) * ScratchFile::SlotSize;
+}
+
+void dropPages(int slot)
+{
+#ifdef Q_OS_UNIX
+    // the pages stay in the file, only the process lets go of them
+    madvise(slotData(slot), ScratchFile::SlotSize, MADV_DONTNEED);
+#else
+    Q_UNUSED(slot);
+#endif
+}
+
+// drops the least recently used tiles down to three quarters of the limit
+void trim()
+{
+    Scratch &s = scratch();
+    if(!s.trimMutex.tryLock()) return;
+
+    QVector<QPair<int, int> > resident;     // last use, slot
+    int slotCount = s.segmentCount.load() * SlotsPerSegment;
+    for(int slot = 0; slot < slotCount; slot++)
+    {
+        Segment *segment = segmentOf(slot);
+        int i = slot % SlotsPerSegment;
+        if(segment->isResident[i].load())
+            resident.append(qMakePair(segment->lastUse[i].load(), slot));
+    }
+    std::sort(resident.begin(), resident.end());
+
+    int target = s.limitSlots.load() * 3 / 4;
+    for(int i = 0; i < resident.size() && s.residentSlots.load() > target; i++)
+    {
+        int slot = resident.at(i).second;
+        if(!segmentOf(slot)->isResident[slot % SlotsPerSegment].testAndSetOrdered(1, 0)) continue;
+        s.residentSlots.deref();
+        dropPages(slot);
+    }
+    s.trimMutex.unlock();
+}
+
+bool grow()
+{
+    Scratch &s = scratch();
+    int count = s.segmentCount.load();
+    if(count >= MaxSegments) return false;
+
+    qint64 offset = qint64(count) * SlotsPerSegment * ScratchFile::SlotSize;
+    qint64 size = qint64(SlotsPerSegment) * ScratchFile::SlotSize;
+    if(!s.file.resize(offset + size)) return false;
+    uchar *data = s.file.map(offset, size);
+    if(!data) return false;
+
+    Segment *segment = new Segment;
+    segment->data = data;
+    for(int i = 0; i < SlotsPerSegment; i++)
+        segment->isTile[i] = false;
+    s.segments[count] = segment;
+    s.segmentCount.storeRelease(count + 1);
+
+    for(int i = SlotsPerSegment - 1; i >= 0; i--)
+        s.freeSlots.append(count * SlotsPerSegment + i);
+    return true;
+}
+
+int allocateSlot(bool isTile)
+{
+    Scratch &s = scratch();
+    QMutexLocker locker(&s.mutex);
+    if(s.freeSlots.isEmpty() && !grow())
+    {
+        qWarning() << "Scratch: unable to grow" << s.file.fileName() << s.file.errorString();
+        return -1;
+    }
+
+    int slot = s.freeSlots.takeLast();
+    segmentOf(slot)->isTile[slot % SlotsPerSegment] = isTile;
+    return slot;
+}
+
+void releaseImage(void *info)
+{
+    ScratchFile::release(int(reinterpret_cast<quintptr>(info)));
+}
+
+void releaseFile(void *info)
+{
+    // closing unmaps it, and a QTemporaryFile removes itself
+    delete static_cast<QTemporaryFile *>(info);
+}
+
+}
+
+
+bool ScratchFile::isEnabled()
+{
+    return scratch().isEnabled.load();
+}
+
+void ScratchFile::reserveFor(qint64 imageBytes)
+{
+    Scratch &s = scratch();
+    if(s.isEnabled.load() || imageBytes <= residentLimit() / 2) return;
+
+    QMutexLocker locker(&s.mutex);
+    if(s.isEnabled.load()) return;
+
+    QString directory = QSettings().value("scratch/directory", QDir::tempPath()).toString();
+    s.file.setFileTemplate(QDir(directory).filePath("pmig-scratch-XXXXXX"));
+    if(!s.file.open())
+    {
+        qWarning() << "Scratch: unable to create a scratch file in" << directory;
+        return;
+    }
+    s.isEnabled.store(1);
+}
+
+qint64 ScratchFile::residentLimit()
+{
+    return qint64(scratch().limitSlots.load()) * SlotSize;
+}
+
+void ScratchFile::setResidentLimit(qint64 bytes)
+{
+    QSettings().setValue("scratch/residentLimit", int(bytes >> 20));
+    scratch().limitSlots.store(int(bytes / SlotSize));
+    if(isEnabled()) trim();
+}
+
+uchar *ScratchFile::allocate(int *slot)
+{
+    *slot = isEnabled() ? allocateSlot(true) : -1;
+    if(*slot < 0) return 0;
+
+    touch(*slot);
+    return slotData(*slot);
+}
+
+void ScratchFile::release(int slot)
+{
+    Scratch &s = scratch();
+    Segment *segment = segmentOf(slot);
+    int i = slot % SlotsPerSegment;
+    if(segment->isResident[i].testAndSetOrdered(1, 0))
+        s.residentSlots.deref();
+    dropPages(slot);
+
+    QMutexLocker locker(&s.mutex);
+    segment->isTile[i] = false;
+    s.freeSlots.append(slot);
+}
+
+void ScratchFile::touch(int slot)
+{
+    Scratch &s = scratch();
+    Segment *segment = segmentOf(slot);
+    int i = slot % SlotsPerSegment;
+    segment->lastUse[i].store(s.clock.fetchAndAddRelaxed(1));
+    if(!segment->isTile[i] || !segment->isResident[i].testAndSetOrdered(0, 1)) return;
+
+    if(s.residentSlots.fetchAndAddOrdered(1) + 1 > s.limitSlots.load())
+        trim();
+}
+
+QImage ScratchFile::image(const QSize &size)
+{
+    qint64 bytes = qint64(size.width()) * size.height() * 4;
+    if(!isEnabled() || bytes == 0)
+        return QImage(size, QImage::Format_ARGB32_Premultiplied);
+
+    // tile sized ones share the slots, bigger ones (pyramid levels) get
+    // a file of their own
+    if(bytes <= SlotSize)
+    {
+        int slot = allocateSlot(false);
+        if(slot >= 0)
+            return QImage(slotData(slot), size.width(), size.height(), size.width() * 4,
+                          QImage::Format_ARGB32_Premultiplied, releaseImage,
+                          reinterpret_cast<void *>(quintptr(slot)));
+    }
+    else
+    {
+        QTemporaryFile *file = new QTemporaryFile(scratch().file.fileName() + "-XXXXXX");
+        uchar *data = 0;
+        if(file->open() && file->resize(bytes))
+            data = file->map(0, bytes);
+        if(data)
+            return QImage(data, size.width(), size.height(), size.width() * 4,
+                          QImage::Format_ARGB32_Premultiplied, releaseFile, file);
+        delete file;
+    }
+
+    qWarning() << "Scratch: out of scratch space, allocating" << size << "in memory";
+    return QImage(size, QImage::Format_ARGB32_Premultiplied);
+}
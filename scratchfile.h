@@ -0,0 +1,39 @@
+﻿#ifndef SCRATCHFILE_H
+#define SCRATCHFILE_H
+
+#include <QImage>
+#include <QSize>
+
+/* Pixel memory backed by a temporary file, for canvases bigger than RAM.
+ *
+ * It engages once an image needs more than half of the resident limit
+ * (settings "scratch/residentLimit", in MB). From then on tiles, composite
+ * tiles and pyramid levels are allocated in a memory mapped scratch file
+ * ("scratch/directory", the system temp directory by default) instead of
+ * on the heap, so the kernel can write their pages out and read them back
+ * on demand. Tiles are also kept to the limit: each access stamps the
+ * tile, and when too many are resident the least recently used ones are
+ * dropped from the process with madvise. The mapping stays valid, so a
+ * thread still reading a dropped tile simply faults it back in.
+ */
+class ScratchFile
+{
+public:
+    enum { SlotSize = 256*256*4 };  // one full tile
+
+    static bool isEnabled();
+    static void reserveFor(qint64 imageBytes);
+
+    static qint64 residentLimit();
+    static void setResidentLimit(qint64 bytes);
+
+    // a tile's pixels, 0 if the scratch file is off or full
+    static uchar *allocate(int *slot);
+    static void release(int slot);
+    static void touch(int slot);
+
+    // ARGB32 premultiplied, on the heap while the scratch file is off
+    static QImage image(const QSize &size);
+};
+
+#endif // SCRATCHFILE_H
@@ -11,25 +11,38 @@
 void ScribbleArea::mousePressEvent(QMouseEvent *event)
 //! [11] //! [12]
 {
-    if(totalImageNum <= 0) return;
+    if(event->button() == Qt::MiddleButton) {
+        isPanning = true;
+        lastPanPoint = event->pos();
+        return;
+    }
+
+    // the layer being loaded is overwritten band by band, keep tools off it
+    if(totalImageNum <= 0 || isLoading()) return;
     if (event->button() == Qt::LeftButton) {
         isMousePressed = true;
+        beginStroke();
 
-        int eventX=event->pos().x()-(imageCentralPoint.x()-imageStack[currentImageNum].width()/2);
-        int eventY=event->pos().y()-(imageCentralPoint.y()-imageStack[currentImageNum].height()/2);
+        QPoint imagePos = mapToImage(event->pos());
+        int eventX=imagePos.x();
+        int eventY=imagePos.y();
 
         switch(toolType)
         {
         case ToolType::Marquee:
-            opencvProcess->vertexA.x=eventX;
-            opencvProcess->vertexA.y=eventY;
-
-            marqueeHandlerControl.clear();
-            marqueeHandlerControl << QPointF(event->pos().x(), event->pos().y())
-                       << QPointF(event->pos().x(), event->pos().y())
-                       << QPointF(event->pos().x(), event->pos().y())
-                       << QPointF(event->pos().x(), event->pos().y());
-
+        case ToolType::MagicWand:
+            // shift adds to the selection, alt subtracts, both intersect
+            if((event->modifiers() & Qt::ShiftModifier) && (event->modifiers() & Qt::AltModifier))
+                marqueeMode = SelectionMask::Intersect;
+            else if(event->modifiers() & Qt::ShiftModifier)
+                marqueeMode = SelectionMask::Add;
+            else if(event->modifiers() & Qt::AltModifier)
+                marqueeMode = SelectionMask::Subtract;
+            else
+                marqueeMode = opencvProcess->selectionMode();
+
+            marqueePoints.clear();
+            marqueePoints << QPointF(eventX, eventY);
             break;
         default: break;
         }
@@ -40,43 +53,42 @@ void ScribbleArea::mousePressEvent(QMouseEvent *event)
 
 void ScribbleArea::mouseMoveEvent(QMouseEvent *event)
 {
+    if(isPanning) {
+        panBy(event->pos() - lastPanPoint);
+        lastPanPoint = event->pos();
+        return;
+    }
+
     if(totalImageNum <= 0) return;
     if ((event->buttons() & Qt::LeftButton) && isMousePressed){
         isMouseMoving = true;
 
-        int eventX=event->pos().x()-(imageCentralPoint.x()-imageStack[currentImageNum].width()/2);
-        int eventY=event->pos().y()-(imageCentralPoint.y()-imageStack[currentImageNum].height()/2);
-        int lastX=lastPoint.x()-(imageCentralPoint.x()-imageStack[currentImageNum].width()/2);
-        int lastY=lastPoint.y()-(imageCentralPoint.y()-imageStack[currentImageNum].height()/2);
+        QPoint imagePos = mapToImage(event->pos());
+        int eventX=imagePos.x();
+        int eventY=imagePos.y();
+        QPoint lastImagePos = mapToImage(lastPoint);
+        int lastX=lastImagePos.x();
+        int lastY=lastImagePos.y();
 
         switch(toolType)
         {
         case ToolType::Brush:
+        case ToolType::Erase:
+            // rasterized in one batch on the next frame tick
+            queueSegment(StrokeSegment(QLineF(lastX, lastY, eventX, eventY)));
             break;
-        case ToolType::Marquee:{
-            opencvProcess->vertexB.x=eventX;
-            opencvProcess->vertexB.y=eventY;
-
-            QPointF tmpOriginPoint(marqueeHandlerControl.at(0));
-            marqueeHandlerControl.clear();
-            marqueeHandlerControl << tmpOriginPoint
-                       << QPointF(event->pos().x(), tmpOriginPoint.ry())
-                       << QPointF(event->pos().x(), event->pos().y())
-                       << QPointF(tmpOriginPoint.rx(), event->pos().y());
-            marqueeHandler->setPoints(marqueeHandlerControl);
-
+        case ToolType::Marquee:
+            // a lasso keeps every point, the other shapes two corners
+            if(marqueePoints.size() > 1 && opencvProcess->selectionType() != MarqueeToolBase::Lasso)
+                marqueePoints.remove(1, marqueePoints.size() - 1);
+            marqueePoints << QPointF(eventX, eventY);
             update();
             break;
-        }
-        case ToolType::Erase:
-            opencvProcess->ApplyToolFunction(QPoint(eventX,eventY));
-            break;
 
         default:
             break;
         }
 
-        opencvProcess->ApplyToolFunction(QPoint(lastX,lastY), QPoint(eventX,eventY));
         lastPoint = event->pos();
 
     }
@@ -84,51 +96,73 @@ void ScribbleArea::mouseMoveEvent(QMouseEvent *event)
 
 void ScribbleArea::mouseReleaseEvent(QMouseEvent *event)
 {
-    if(totalImageNum <= 0) return;
+    if(event->button() == Qt::MiddleButton) {
+        isPanning = false;
+        return;
+    }
+
+    if(totalImageNum <= 0 || isLoading()) return;
     isMousePressed = false;
 
     if (event->button() == Qt::LeftButton && isMouseMoving) {
         isMouseMoving = false;
 
-        int eventX=event->pos().x()-(imageCentralPoint.x()-imageStack[currentImageNum].width()/2);
-        int eventY=event->pos().y()-(imageCentralPoint.y()-imageStack[currentImageNum].height()/2);
-        int lastX=lastPoint.x()-(imageCentralPoint.x()-imageStack[currentImageNum].width()/2);
-        int lastY=lastPoint.y()-(imageCentralPoint.y()-imageStack[currentImageNum].height()/2);
+        QPoint imagePos = mapToImage(event->pos());
+        int eventX=imagePos.x();
+        int eventY=imagePos.y();
+        QPoint lastImagePos = mapToImage(lastPoint);
+        int lastX=lastImagePos.x();
+        int lastY=lastImagePos.y();
 
         switch(toolType)
         {
         case ToolType::Brush:
+        case ToolType::Erase:
+            queueSegment(StrokeSegment(QLineF(lastX, lastY, eventX, eventY)));
             break;
-        case ToolType::Marquee:{
-            opencvProcess->somethingSelected=true;
-
-            QPointF tmpOriginPoint(marqueeHandlerControl.at(0));
-            marqueeHandlerControl.clear();
-            marqueeHandlerControl << tmpOriginPoint
-                       << QPointF(event->pos().x(), tmpOriginPoint.ry())
-                       << QPointF(event->pos().x(), event->pos().y())
-                       << QPointF(tmpOriginPoint.rx(), event->pos().y());
-            marqueeHandler->setPoints(marqueeHandlerControl);
+        case ToolType::Marquee:
+            if(marqueePoints.size() > 1 && opencvProcess->selectionType() != MarqueeToolBase::Lasso)
+                marqueePoints.remove(1, marqueePoints.size() - 1);
+            marqueePoints << QPointF(eventX, eventY);
+            opencvProcess->select(marqueePoints, marqueeMode);
+            marqueePoints.clear();
             update();
             break;
-        }
+        case ToolType::MagicWand:
+            opencvProcess->selectSimilar(QPoint(eventX, eventY), marqueeMode);
+            update();
+            break;
+        case ToolType::Fill:
+            opencvProcess->ApplyToolFunction(QPoint(eventX, eventY));
+            break;
+        default:
+            break;
         }
 
-        opencvProcess->ApplyToolFunction(QPoint(lastX,lastY), QPoint(eventX,eventY));
+        flushStroke();
 
     }
     else {
-        int eventX=event->pos().x()-(imageCentralPoint.x()-imageStack[currentImageNum].width()/2);
-        int eventY=event->pos().y()-(imageCentralPoint.y()-imageStack[currentImageNum].height()/2);
+        flushStroke();
+
+        bool isLeftButton = event->button() == Qt::LeftButton;
+        QPoint imagePos = mapToImage(event->pos());
+        int eventX=imagePos.x();
+        int eventY=imagePos.y();
 
         switch(toolType)
         {
         case ToolType::Brush:
             break;
         case ToolType::Marquee:
-            opencvProcess->somethingSelected=false;
-            marqueeHandlerControl.clear();
-            marqueeHandler->setPoints(marqueeHandlerControl);
+            // a plain click drops the selection
+            if(isLeftButton && marqueeMode == SelectionMask::Replace) opencvProcess->clearSelection();
+            marqueePoints.clear();
+            update();
+            break;
+        case ToolType::MagicWand:
+            if(!isLeftButton) break;
+            opencvProcess->selectSimilar(QPoint(eventX, eventY), marqueeMode);
             update();
             break;
         case ToolType::Erase:
@@ -138,61 +172,599 @@ void ScribbleArea::mouseReleaseEvent(QMouseEvent *event)
             break;
         }
 
-        opencvProcess->ApplyToolFunction(QPoint(eventX,eventY));
+        // releases of the other buttons erase too, without a press; no
+        // other tool acts on them
+        if(isLeftButton || toolType == ToolType::Erase)
+        {
+            if(strokeLayerId < 0) beginStroke();
+            opencvProcess->ApplyToolFunction(QPoint(eventX,eventY));
+        }
     }
+
+    if(toolType == ToolType::Fill)
+        endStroke(tr("Fill"));
+    else
+        endStroke(toolType == ToolType::Brush ? tr("Brush Stroke") : tr("Erase"));
 }
 
 
 
 
 
-void ScribbleArea::updateDisplay(int changedImageNum)
+void ScribbleArea::tabletEvent(QTabletEvent *event)
 {
-    if(changedImageNum > imageStack.size())
+    // ignored events come back as mouse events, which the other tools use
+    bool isStrokeTool = toolType == ToolType::Brush || toolType == ToolType::Erase;
+    switch(event->type())
+    {
+    case QEvent::TabletPress:
+        if(!isStrokeTool || event->button() != Qt::LeftButton || totalImageNum <= 0 || isLoading())
+        {
+            event->ignore();
+            return;
+        }
+        isTabletStroke = true;
+        beginStroke();
+        strokeSamples.clear();
+        strokeSamples.append(tabletSample(event));
+        break;
+    case QEvent::TabletMove:
+    {
+        if(!isTabletStroke)
+        {
+            event->ignore();
+            return;
+        }
+        // every sample is kept, the segments are rasterized once per frame
+        StrokeSample previous = strokeSamples.last();
+        StrokeSample sample = tabletSample(event);
+        strokeSamples.append(sample);
+        queueSegment(StrokeSegment(QLineF(previous.position, sample.position),
+                                   previous.pressure, sample.pressure));
+        updatePrediction();
+        break;
+    }
+    case QEvent::TabletRelease:
+        if(!isTabletStroke)
+        {
+            event->ignore();
+            return;
+        }
+        isTabletStroke = false;
+        flushStroke();
+        updatePrediction();
+        endStroke(toolType == ToolType::Brush ? tr("Brush Stroke") : tr("Erase"));
+        strokeSamples.clear();
+        break;
+    default:
+        event->ignore();
+        return;
+    }
+    event->accept();
+}
+
+StrokeSample ScribbleArea::tabletSample(const QTabletEvent *event) const
+{
+    StrokeSample sample;
+    sample.position = (event->posF() - imageOrigin()) / zoomFactor;
+    sample.pressure = event->pressure();
+    sample.xTilt = event->xTilt();
+    sample.yTilt = event->yTilt();
+    sample.time = event->timestamp();
+    return sample;
+}
+
+QPolygonF ScribbleArea::provisionalStroke() const
+{
+    // from the last rasterized sample through the queued ones to the tip
+    QPolygonF path;
+    if(!hasPrediction) return path;
+    if(!pendingSegments.isEmpty())
+        path << pendingSegments.first().line.p1();
+    foreach(const StrokeSegment &segment, pendingSegments)
+        path << segment.line.p2();
+    if(path.isEmpty())
+        path << strokeSamples.last().position;
+    path << predictedTip;
+    return path;
+}
+
+void ScribbleArea::updatePrediction()
+{
+    // one frame ahead, that is how far behind the rasterized stroke runs
+    hasPrediction = isTabletStroke && toolType == ToolType::Brush
+            && strokeSamples.predict(strokeTimer->interval(), &predictedTip);
+
+    QRect oldRect = provisionalRect;
+    provisionalRect = QRect();
+    QPolygonF path = provisionalStroke();
+    if(path.size() > 1)
+    {
+        int rad = opencvProcess->brushSize()/2 + 2;
+        provisionalRect = mapFromImage(path.boundingRect().toAlignedRect().adjusted(-rad, -rad, rad, rad));
+    }
+    update(oldRect | provisionalRect);
+}
+
+void ScribbleArea::queueSegment(const StrokeSegment &segment)
+{
+    pendingSegments.append(segment);
+    if(!strokeTimer->isActive()) strokeTimer->start();
+}
+
+void ScribbleArea::flushStroke()
+{
+    strokeTimer->stop();
+    if(pendingSegments.isEmpty()) return;
+
+    opencvProcess->ApplyToolFunction(pendingSegments);
+    pendingSegments.clear();
+    if(hasPrediction) updatePrediction();
+}
+
+void ScribbleArea::beginStroke()
+{
+    if(currentImageNum < 0) return;
+
+    // shares every tile, only the ones the stroke touches get copied
+    strokeBefore = opencvProcess->layerStack.at(currentImageNum).pixels();
+    strokeLayerId = opencvProcess->layerStack.at(currentImageNum).id;
+}
+
+void ScribbleArea::endStroke(const QString &text)
+{
+    flushStroke();
+    opencvProcess->endStroke();
+
+    int layerId = strokeLayerId;
+    TiledImage before = strokeBefore;
+    strokeLayerId = -1;
+    strokeBefore = TiledImage();
+
+    int imageNum = opencvProcess->layerStack.indexOf(layerId);
+    if(imageNum < 0) return;
+    const TiledImage &pixels = opencvProcess->layerStack.at(imageNum).pixels();
+    if(before.size() != pixels.size() || before.type() != pixels.type()) return;
+
+    QVector<int> changed;
+    for(int i = 0; i < before.tileCount(); i++)
+        if(!pixels.sharesTile(before, i)) changed.append(i);
+    if(changed.isEmpty()) return;
+
+    history->push(new TileDeltaCommand(opencvProcess, &undoTiles, layerId, before, changed, text));
+}
+
+QColor ScribbleArea::foregroundColor() const
+{
+    return opencvProcess->fgColor;
+}
+
+void ScribbleArea::setForegroundColor(const QColor &color)
+{
+    opencvProcess->fgColor = color;
+}
+
+void ScribbleArea::setUndoMemoryBudget(int megabytes)
+{
+    UndoTileStore::saveBudget(megabytes);
+    undoTiles.setMemoryBudget(qint64(megabytes) << 20);
+}
+
+void ScribbleArea::updateDisplay(int changedImageNum, const QRect &changedRect)
+{
+    if(changedImageNum >= opencvProcess->layerStack.size())
     {
         qDebug()<<"Out of bound, no such image opened";
         return;
     }
 
-    if(changedImageNum == imageStack.size())
+    // the tiles share their pixels with the OpenCV image, nothing to convert
+
+    // a null rect means the whole layer was replaced
+    if(changedRect.isNull())
     {
-        QImage newImage;
-        newImage = IplImage2QImage(
-                    opencvProcess->imageStack[changedImageNum], 0, 1000);
-//        newImage = CVMatToQImage(opencvProcess->imageStack[changedImageNum]);
-        imageStack.append(newImage);
+        pyramids[changedImageNum]->reset(image(changedImageNum));
+        markAllStale();
+        update();
+        return;
+    }
+
+    QRect imageRect = changedRect & image(changedImageNum).rect();
+    if(imageRect.isEmpty()) return;
 
-        //resizeImage(&imageStack[0], QSize(imageStack[0].width()/2, imageStack[0].height()/2));
+    modified=true;
+    pyramids[changedImageNum]->invalidate(image(changedImageNum), imageRect);
+    if(changedImageNum == currentImageNum)
+    {
+        markStale(imageRect);
+        update(mapFromImage(imageRect));
     }
     else
     {
-        imageStack[changedImageNum] = IplImage2QImage(
-                    opencvProcess->imageStack[changedImageNum], 0, 1000);
-//        imageStack[changedImageNum] = CVMatToQImage(opencvProcess->imageStack[changedImageNum]);
-        modified=true;
+        markAllStale();
+        update();
     }
+}
+
+void ScribbleArea::pyramidUpdated(const QRect &rect)
+{
+    int imageNum = pyramids.indexOf(qobject_cast<MipPyramid*>(sender()));
+    if(imageNum < 0) return;
+
+    if(pyramids[imageNum]->levelFor(zoomFactor) > 0)
+        update(mapFromImage(rect));
+
+    // strokes made while the job ran are still waiting
+    pyramids[imageNum]->update(image(imageNum));
+}
+
+const TiledImage &ScribbleArea::image(int imageNum) const
+{
+    return opencvProcess->layerStack.at(imageNum).image;
+}
 
+const Layer *ScribbleArea::currentLayer() const
+{
+    if(currentImageNum < 0) return 0;
+    return &opencvProcess->layerStack.at(currentImageNum);
+}
+
+void ScribbleArea::insertPyramid(int imageNum)
+{
+    MipPyramid *pyramid = new MipPyramid(this);
+    connect(pyramid, &MipPyramid::updated, this, &ScribbleArea::pyramidUpdated);
+    pyramids.insert(imageNum, pyramid);
+}
+
+void ScribbleArea::setCurrentLayer(int imageNum)
+{
+    // pending segments belong to the old layer
+    flushStroke();
+    totalImageNum = opencvProcess->layerStack.size();
+    currentImageNum = imageNum;
+    opencvProcess->currentImageNum = imageNum;
+    markAllStale();
+}
+
+void ScribbleArea::layerPropertiesChanged()
+{
+    modified = true;
+    markAllStale();
     update();
 }
 
+void ScribbleArea::markStale(const QRect &rect)
+{
+    foreach(int index, image(0).tilesIn(rect))
+        tileRevisions[index]++;
+}
+
+void ScribbleArea::markAllStale()
+{
+    int tileCount = image(0).tileCount();
+    if(frameTiles.size() != tileCount)
+    {
+        frameTiles = QVector<QImage>(tileCount);
+        tileRevisions.fill(0, tileCount);
+        requestedRevisions.fill(-1, tileCount);
+        renderedRevisions.fill(-1, tileCount);
+    }
+
+    // the old frame tiles stay on screen until their replacements arrive
+    for(int i = 0; i < tileCount; i++)
+        tileRevisions[i]++;
+    layersChanged = true;
+}
+
+void ScribbleArea::requestTiles(const QVector<int> &tiles)
+{
+    QVector<int> indexes, revisions;
+    foreach(int index, tiles)
+    {
+        if(requestedRevisions.at(index) == tileRevisions.at(index)) continue;
+        requestedRevisions[index] = tileRevisions.at(index);
+        indexes.append(index);
+        revisions.append(tileRevisions.at(index));
+    }
+    if(indexes.isEmpty()) return;
+
+    // a copy on write snapshot, strokes detach from it tile by tile
+    renderWorker->post(opencvProcess->layerStack, currentImageNum, layersChanged, indexes, revisions);
+    layersChanged = false;
+}
+
+void ScribbleArea::tilesRendered(const RenderedTiles &tiles)
+{
+    for(int i = 0; i < tiles.indexes.size(); i++)
+    {
+        int index = tiles.indexes.at(i);
+        if(index >= frameTiles.size()) continue;
+
+        frameTiles[index] = tiles.images.at(i);
+        renderedRevisions[index] = tiles.revisions.at(i);
+        update(mapFromImage(image(0).tileRect(index)));
+    }
+}
+
+void ScribbleArea::newLayer()
+{
+    if(totalImageNum <= 0 || isLoading()) return;
+
+    flushStroke();
+    opencvProcess->addLayer();
+
+    insertPyramid(opencvProcess->currentImageNum);
+
+    setCurrentLayer(opencvProcess->currentImageNum);
+    modified = true;
+    updateDisplay(currentImageNum);
+}
+
+void ScribbleArea::duplicateLayer()
+{
+    if(totalImageNum <= 0 || isLoading()) return;
+
+    flushStroke();
+    opencvProcess->duplicateLayer();
+
+    insertPyramid(opencvProcess->currentImageNum);
+
+    setCurrentLayer(opencvProcess->currentImageNum);
+    modified = true;
+    updateDisplay(currentImageNum);
+}
+
+void ScribbleArea::deleteLayer()
+{
+    if(isLoading()) return;
+    flushStroke();
+    int removed = currentImageNum;
+    if(!opencvProcess->removeLayer()) return;
+
+    delete pyramids.takeAt(removed);
+    setCurrentLayer(opencvProcess->currentImageNum);
+    layerPropertiesChanged();
+}
+
+void ScribbleArea::selectLayerAbove()
+{
+    if(isLoading()) return;
+    if(currentImageNum+1 >= totalImageNum) return;
+    setCurrentLayer(currentImageNum+1);
+}
+
+void ScribbleArea::selectLayerBelow()
+{
+    if(isLoading()) return;
+    if(currentImageNum <= 0) return;
+    setCurrentLayer(currentImageNum-1);
+}
+
+void ScribbleArea::toggleLayerVisibility()
+{
+    if(currentImageNum < 0) return;
+    Layer &layer = opencvProcess->layerStack[currentImageNum];
+    layer.isVisible = !layer.isVisible;
+    layerPropertiesChanged();
+}
+
+void ScribbleArea::setLayerOpacity(qreal opacity)
+{
+    if(currentImageNum < 0) return;
+    opencvProcess->layerStack[currentImageNum].opacity = qBound(qreal(0), opacity, qreal(1));
+    layerPropertiesChanged();
+}
+
+void ScribbleArea::setLayerBlendMode(int mode)
+{
+    if(currentImageNum < 0) return;
+    opencvProcess->layerStack[currentImageNum].blendMode = Layer::BlendMode(mode);
+    layerPropertiesChanged();
+}
+
+QSize ScribbleArea::canvasSize() const
+{
+    return opencvProcess->layerStack.canvasSize();
+}
+
+QPointF ScribbleArea::imageOrigin() const
+{
+    return QPointF(imageCentralPoint) + panOffset
+            - QPointF(canvasSize().width(), canvasSize().height()) * (zoomFactor / 2);
+}
+
+QPoint ScribbleArea::mapToImage(const QPoint &pos) const
+{
+    QPointF imagePos = (QPointF(pos) - imageOrigin()) / zoomFactor;
+    return QPoint(qFloor(imagePos.x()), qFloor(imagePos.y()));
+}
+
+QRect ScribbleArea::mapToImage(const QRect &rect) const
+{
+    QPointF origin = imageOrigin();
+    return QRectF((rect.left() - origin.x()) / zoomFactor, (rect.top() - origin.y()) / zoomFactor,
+                  rect.width() / zoomFactor, rect.height() / zoomFactor).toAlignedRect();
+}
+
+QRect ScribbleArea::mapFromImage(const QRect &rect) const
+{
+    // one spare pixel for the smoothing of scaled draws
+    QPointF origin = imageOrigin();
+    return QRectF(origin.x() + rect.left() * zoomFactor, origin.y() + rect.top() * zoomFactor,
+                  rect.width() * zoomFactor, rect.height() * zoomFactor).toAlignedRect()
+            .adjusted(-1, -1, 1, 1);
+}
+
+void ScribbleArea::setZoom(qreal zoom, const QPoint &anchor)
+{
+    zoom = qBound(qreal(1)/64, zoom, qreal(32));
+
+    // keep the image point under anchor where it is
+    QPointF fromCentre = QPointF(anchor - imageCentralPoint) - panOffset;
+    panOffset = QPointF(anchor - imageCentralPoint) - fromCentre * (zoom / zoomFactor);
+    zoomFactor = zoom;
+    update();
+}
+
+void ScribbleArea::panBy(const QPoint &delta)
+{
+    panOffset += delta;
+    update();
+}
+
+void ScribbleArea::drawLevel(QPainter *painter, const QRect &exposed, int level)
+{
+    // blend the layers at the pyramid level into a buffer the size of the
+    // exposed part, then scale that once; QPainter reduces it at most by 2
+    int scale = 1 << level;
+    QRect source(QPoint(exposed.left()/scale, exposed.top()/scale),
+                 QPoint(exposed.right()/scale, exposed.bottom()/scale));
+
+    QImage composite(source.size(), QImage::Format_ARGB32_Premultiplied);
+    composite.fill(0);
+    QPainter compositePainter(&composite);
+    for(int i=0; i<opencvProcess->layerStack.size(); i++)
+    {
+        const Layer &layer = opencvProcess->layerStack.at(i);
+        if(!layer.isVisible) continue;
+        compositePainter.setCompositionMode(LayerCompositor::compositionMode(layer.blendMode));
+        compositePainter.setOpacity(layer.opacity);
+        compositePainter.drawImage(QPoint(0, 0), pyramids[i]->level(level), source);
+    }
+    compositePainter.end();
+
+    QPointF origin = imageOrigin();
+    QTransform transform = QTransform::fromTranslate(origin.x(), origin.y());
+    transform.scale(zoomFactor*scale, zoomFactor*scale);
+    painter->setTransform(transform);
+    painter->setRenderHint(QPainter::SmoothPixmapTransform, true);
+    painter->drawImage(source.topLeft(), composite);
+}
+
+void ScribbleArea::drawTiles(QPainter *painter, const QRect &exposed)
+{
+    QPointF origin = imageOrigin();
+    QTransform transform = QTransform::fromTranslate(origin.x(), origin.y());
+    transform.scale(zoomFactor, zoomFactor);
+    painter->setTransform(transform);
+    painter->setRenderHint(QPainter::SmoothPixmapTransform, zoomFactor < 1);
+
+    const TiledImage &tiledImage = image(0);
+    QVector<int> stale;
+    foreach(int index, tiledImage.tilesIn(exposed))
+    {
+        if(renderedRevisions.at(index) != tileRevisions.at(index))
+            stale.append(index);
+        if(frameTiles.at(index).isNull()) continue;
+
+        QRect tileRect = tiledImage.tileRect(index);
+        QRect part = tileRect & exposed;
+        painter->drawImage(part.topLeft(), frameTiles.at(index),
+                           part.translated(-tileRect.topLeft()));
+    }
+
+    // whatever is still missing gets composed off the GUI thread
+    requestTiles(stale);
+}
+
 //! [12] //! [13]
 void ScribbleArea::paintEvent(QPaintEvent *event)
 //! [13] //! [14]
 {
+    if(opencvProcess->layerStack.isEmpty()) return;
+
     QPainter painter(this);
-//    QRect dirtyRect = event->rect();
-//    painter.drawImage(dirtyRect, image, dirtyRect);
+    QRect dirtyRect = event->rect();
+
+    // only draw the tiles, and the part of them, that were exposed
+    QRect exposed = mapToImage(dirtyRect) & QRect(QPoint(0, 0), canvasSize());
+    if(exposed.isEmpty()) return;
+
+    // the pyramids are only usable once every visible layer has its levels
+    int level = MipPyramid::MaxLevels;
+    for(int i=0; i<opencvProcess->layerStack.size(); i++)
+        if(opencvProcess->layerStack.at(i).isVisible)
+            level = qMin(level, pyramids[i]->levelFor(zoomFactor));
+
+    if(level > 0 && level < MipPyramid::MaxLevels)
+        drawLevel(&painter, exposed, level);
+    else
+        drawTiles(&painter, exposed);
+
+    // the preview stands in for the rows still being converted
+    if(!loadPreview.isNull() && loadingLayer >= 0)
+    {
+        QRect pending = QRect(QPoint(0, 0), loadingImageSize) & QRect(QPoint(0, 0), canvasSize());
+        pending.setTop(loadedTileRows*TiledImage::TileSize);
+        if(!pending.isEmpty())
+        {
+            QPointF origin = imageOrigin();
+            QTransform transform = QTransform::fromTranslate(origin.x(), origin.y());
+            transform.scale(zoomFactor, zoomFactor);
+            painter.setTransform(transform);
+            painter.setClipRect(pending);
+            painter.setRenderHint(QPainter::SmoothPixmapTransform, true);
+            painter.drawImage(QRectF(QPointF(0, 0), QSizeF(loadingImageSize)), loadPreview);
+        }
+    }
+
+    // the pen stroke ahead of the canvas, replaced as the real samples land
+    QPolygonF provisional = provisionalStroke();
+    if(provisional.size() > 1)
+    {
+        QPointF origin = imageOrigin();
+        QTransform transform = QTransform::fromTranslate(origin.x(), origin.y());
+        transform.scale(zoomFactor, zoomFactor);
+        painter.setTransform(transform);
+        painter.setClipping(false);
+        painter.setRenderHint(QPainter::Antialiasing, true);
+        qreal width = qMax(qreal(1), opencvProcess->brushSize() * strokeSamples.last().pressure);
+        painter.setPen(QPen(opencvProcess->fgColor, width, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin));
+        painter.drawPolyline(provisional);
+    }
 
-    /// @note can be optimized, update one small area one time
-    if(imageStack.size()>0)
+    drawSelection(&painter);
+}
+
+void ScribbleArea::drawSelection(QPainter *painter)
+{
+    QPainterPath outline;
+    if(opencvProcess->selection.size() == canvasSize())
+        outline = opencvProcess->selection.outline();
+    if(marqueePoints.size() > 1)
     {
-        for(int i=0; i<imageStack.size(); i++)
+        QRectF box = QRectF(marqueePoints.first(), marqueePoints.last()).normalized();
+        switch(opencvProcess->selectionType())
         {
-            painter.drawImage(imageCentralPoint.x()-imageStack[i].width()/2,
-                imageCentralPoint.y()-imageStack[i].height()/2,
-                imageStack[i]);
+        case MarqueeToolBase::Ellipse:
+            outline.addEllipse(box);
+            break;
+        case MarqueeToolBase::Lasso:
+            outline.addPolygon(marqueePoints);
+            outline.closeSubpath();
+            break;
+        default:
+            outline.addRect(box);
+            break;
         }
     }
+    if(outline.isEmpty()) return;
+
+    // dashes over a light line, one pixel wide at any zoom
+    QPointF origin = imageOrigin();
+    QTransform transform = QTransform::fromTranslate(origin.x(), origin.y());
+    transform.scale(zoomFactor, zoomFactor);
+    painter->setTransform(transform);
+    painter->setClipping(false);
+    painter->setRenderHint(QPainter::Antialiasing, false);
+    painter->setBrush(Qt::NoBrush);
+    QPen pen(QColor(255, 255, 255, toolIndicationAlpha), 0);
+    painter->setPen(pen);
+    painter->drawPath(outline);
+    pen.setColor(QColor(0, 0, 0, toolIndicationAlpha));
+    pen.setStyle(Qt::DashLine);
+    painter->setPen(pen);
+    painter->drawPath(outline);
 }
 //! [14]
 
@@ -211,15 +783,45 @@ void ScribbleArea::resizeEvent(QResizeEvent *event)
     QWidget::resizeEvent(event);
 }
 
+void ScribbleArea::wheelEvent(QWheelEvent *event)
+{
+    // ctrl zooms around the cursor, shift scrolls sideways
+    if(event->modifiers() & Qt::ControlModifier)
+        setZoom(zoomFactor * qPow(1.25, event->angleDelta().y() / 120.0), event->pos());
+    else if(event->modifiers() & Qt::ShiftModifier)
+        panBy(QPoint(event->angleDelta().y() / 2, 0));
+    else
+        panBy(event->angleDelta() / 2);
+    event->accept();
+}
+
 void ScribbleArea::keyPressEvent(QKeyEvent *event)
 {
-    if(event->matches(QKeySequence::Delete))
-    {qDebug()<<opencvProcess->somethingSelected;
-        if(opencvProcess->somethingSelected == false) return;
+    if(event->matches(QKeySequence::ZoomIn))
+        setZoom(zoomFactor * 1.25, rect().center());
+    else if(event->matches(QKeySequence::ZoomOut))
+        setZoom(zoomFactor / 1.25, rect().center());
+    else if(event->key() == Qt::Key_0 && (event->modifiers() & Qt::ControlModifier))
+    {
+        zoomFactor = 1;
+        panOffset = QPointF();
+        update();
+    }
+    else if(event->key() == Qt::Key_Escape)
+    {
+        cancelLoad();
+    }
+    else if(event->matches(QKeySequence::Delete))
+    {
+        // a layer still loading would take its bands over the result
+        if(totalImageNum <= 0 || isLoading() || opencvProcess->selection.isEmpty()) return;
 
+        flushStroke();
+        beginStroke();
         opencvProcess->setToolType(ToolType::Erase);
         opencvProcess->ApplyToolFunction();
         opencvProcess->setToolType(toolType);
+        endStroke(tr("Delete Selection"));
     }
 }
 
@@ -233,6 +835,8 @@ void ScribbleArea::enterEvent(QEvent * event)
 
 void ScribbleArea::setToolType(ToolType::toolType type)
 {
+    // pending segments belong to the old tool
+    flushStroke();
     toolType=type;
     opencvProcess->setToolType(type);
 
@@ -248,59 +852,190 @@ void ScribbleArea::setToolType(ToolType::toolType type)
 ScribbleArea::ScribbleArea(QWidget *parent)
     : QWidget(parent),
       opencvProcess(new OpencvProcess(this)),
-      toolIndicationAlpha(150)
+      toolIndicationAlpha(150),
+      marqueeMode(SelectionMask::Replace)
 {
     setAttribute(Qt::WA_StaticContents);
     modified = false;
     isMouseMoving = false;
     isMousePressed = false;
+    isTabletStroke = false;
+    hasPrediction = false;
     toolType = ToolType::Brush;
 
     totalImageNum = 0;
     currentImageNum = -1;
+    zoomFactor = 1;
+    isPanning = false;
+
+    // mouse and tablet events come much faster than the screen refreshes
+    strokeTimer = new QTimer(this);
+    strokeTimer->setSingleShot(true);
+    strokeTimer->setInterval(16);
+    connect(strokeTimer, &QTimer::timeout, this, &ScribbleArea::flushStroke);
     connect(opencvProcess, &OpencvProcess::updateDisplay, this, &ScribbleArea::updateDisplay);
 
+    history = new QUndoStack(this);
+    strokeLayerId = -1;
+
+    journal = new RecoveryJournal(this);
+    journalTimer = new QTimer(this);
+    journalTimer->setInterval(QSettings().value("recovery/interval", 30).toInt() * 1000);
+    connect(journalTimer, &QTimer::timeout, this, &ScribbleArea::appendJournal);
+    journalTimer->start();
+
+    loader = 0;
+    loadingLayer = -1;
+    loadedTileRows = 0;
+    qRegisterMetaType<TiledImage>();
+
+    layersChanged = false;
+    qRegisterMetaType<RenderedTiles>();
+    renderThread = new QThread(this);
+    renderWorker = new RenderWorker;
+    renderWorker->moveToThread(renderThread);
+    connect(renderThread, &QThread::finished, renderWorker, &QObject::deleteLater);
+    connect(renderWorker, &RenderWorker::tilesRendered, this, &ScribbleArea::tilesRendered);
+    renderThread->start();
+
     imageCentralPoint.setX(this->width()/2);
     imageCentralPoint.setY(this->height()/2);
 
-    marqueeHandler = new HoverPoints(this, HoverPoints::RectangleShape);
-    marqueeHandler->setConnectionType(HoverPoints::LineConnection);
-    marqueeHandler->setCloseType(HoverPoints::Close);
-    marqueeHandler->setEditable(false);
-    marqueeHandler->setPointSize(QSize(10, 10));
-    marqueeHandler->setShapeBrush(QBrush(QColor(0, 0, 0, toolIndicationAlpha)));
-    marqueeHandler->setShapePen(QPen(QColor(0, 0, 0, toolIndicationAlpha)));
-    marqueeHandler->setConnectionPen(QPen(QColor(0, 0, 0, toolIndicationAlpha)));
-    //marqueeHandler->setBoundingRect(QRectF(0, 0, 500, 500));
-    //            connect(pts, SIGNAL(pointsChanged(QPolygonF)),
-    //                    this, SLOT(updateCtrlPoints(QPolygonF)));
-
     //setMouseTracking(true);
 
 }
 //! [0]
 
-//! [1]
-bool ScribbleArea::openImage(const QString &fileName)
-//! [1] //! [2]
+void ScribbleArea::loadSizeKnown(const QSize &imageSize)
+{
+    loadingImageSize = imageSize;
+    loadingLayer = opencvProcess->beginLayer(imageSize, QFileInfo(loader->fileName()).baseName());
+    insertPyramid(loadingLayer);
+    setCurrentLayer(loadingLayer);
+    update();
+}
+
+void ScribbleArea::loadPreviewReady(const QImage &preview)
+{
+    loadPreview = preview;
+    update();
+}
+
+void ScribbleArea::loadWindowKnown(int type, double low, double high)
 {
-    if(totalImageNum == 1)
+    if(loadingLayer < 0) return;
+
+    Layer &layer = opencvProcess->layerStack[loadingLayer];
+    layer.native = TiledImage(layer.image.width(), layer.image.height(), type);
+    layer.window = WindowLevel(type);
+    layer.window.setWindow(low, high);
+}
+
+void ScribbleArea::loadBandLoaded(const TiledImage &band, const TiledImage &nativeBand, int tileRow)
+{
+    if(loadingLayer < 0) return;
+
+    // the band's tiles are shared into the layer, not copied
+    Layer &layer = opencvProcess->layerStack[loadingLayer];
+    for(int column = 0; column < band.tileColumns(); column++)
     {
-        QMessageBox *tmpMessage = new QMessageBox(this);
-        tmpMessage->setText("Sorry, currently only one layer is supported,");
-        tmpMessage->show();
-        return false;
+        int index = tileRow*layer.image.tileColumns() + column;
+        layer.image.setTile(index, band, column);
+        if(!nativeBand.isNull() && !layer.native.isNull())
+            layer.native.setTile(index, nativeBand, column);
+    }
+    loadedTileRows = tileRow + 1;
+
+    QRect rect(0, tileRow*TiledImage::TileSize, band.width(), band.height());
+    markStale(rect);
+    update(mapFromImage(rect));
+}
+
+void ScribbleArea::loadFinished(bool ok)
+{
+    QString fileName = loader->fileName();
+    loader = 0;
+    loadPreview = QImage();
+
+    if(!ok)
+    {
+        discardLoadingLayer();
+        QMessageBox::warning(this, tr("Open"), tr("Unable to load %1").arg(fileName));
+        return;
     }
 
-    if(opencvProcess->openImage(&(fileName.toStdString()[0])))
+    // the pyramid is built once, from the complete layer
+    if(loadingLayer >= 0)
+        pyramids[loadingLayer]->reset(image(loadingLayer));
+    loadingLayer = -1;
+    update();
+}
+
+void ScribbleArea::cancelLoad()
+{
+    if(!loader) return;
+
+    // the loader deletes itself once cvLoadImage lets go
+    loader->cancel();
+    disconnect(loader, 0, this, 0);
+    loader = 0;
+    loadPreview = QImage();
+    discardLoadingLayer();
+}
+
+void ScribbleArea::discardLoadingLayer()
+{
+    if(loadingLayer < 0) return;
+
+    opencvProcess->discardLayer(loadingLayer);
+    delete pyramids.takeAt(loadingLayer);
+    loadingLayer = -1;
+
+    if(opencvProcess->layerStack.isEmpty())
     {
-        totalImageNum++;
-        currentImageNum = totalImageNum-1;
-        opencvProcess->currentImageNum=currentImageNum;
-        updateDisplay(currentImageNum);
-        return true;
+        totalImageNum = 0;
+        currentImageNum = -1;
+        frameTiles.clear();
+        tileRevisions.clear();
+        requestedRevisions.clear();
+        renderedRevisions.clear();
     }
-    return false;
+    else
+    {
+        setCurrentLayer(opencvProcess->currentImageNum);
+    }
+    update();
+}
+
+ScribbleArea::~ScribbleArea()
+{
+    // the commands give their tiles back to undoTiles, which goes first
+    history->clear();
+    // a clean exit, whatever was not saved was dropped on purpose
+    journal->discard();
+    renderThread->quit();
+    renderThread->wait();
+}
+
+//! [1]
+bool ScribbleArea::openImage(const QString &fileName)
+//! [1] //! [2]
+{
+    flushStroke();
+    cancelLoad();
+
+    // opened images stack up as layers on the first one's canvas; the
+    // decode runs in the background and streams in, see ImageLoader
+    loader = new ImageLoader(fileName, canvasSize(), this);
+    connect(loader, &ImageLoader::sizeKnown, this, &ScribbleArea::loadSizeKnown);
+    connect(loader, &ImageLoader::previewReady, this, &ScribbleArea::loadPreviewReady);
+    connect(loader, &ImageLoader::windowKnown, this, &ScribbleArea::loadWindowKnown);
+    connect(loader, &ImageLoader::bandLoaded, this, &ScribbleArea::loadBandLoaded);
+    connect(loader, &ImageLoader::finished, this, &ScribbleArea::loadFinished);
+    loadingLayer = -1;
+    loadedTileRows = 0;
+    loader->start();
+    return true;
 
 //    QSize newSize = loadedImage.size().expandedTo(size());
 //    resizeImage(&loadedImage, newSize);
@@ -318,13 +1053,121 @@ bool ScribbleArea::saveImage(const QString &fileName, const char *fileFormat)
 //    QImage visibleImage = image;
 //    resizeImage(&visibleImage, size());
 
-    if(opencvProcess->saveImage(&(fileName.toStdString()[0]), fileFormat)){
-//    if (visibleImage.save(fileName, fileFormat)) {
-        modified = false;
-        return true;
-    } else {
+    flushStroke();
+    if(totalImageNum <= 0 || isLoading()) return false;
+
+    if(ImageSaver::reducesDepth(opencvProcess->layerStack, QByteArray(fileFormat))
+            && QMessageBox::warning(this, tr("Save"),
+                                    tr("The 16-bit or float samples are saved as 8-bit greys, as they are "
+                                       "shown. Only a single 16-bit layer saved as PNG or TIFF, or a "
+                                       "project, keeps them.\nSave anyway?"),
+                                    QMessageBox::Save | QMessageBox::Cancel) != QMessageBox::Save)
+        return false;
+
+    // writes a snapshot in the background, strokes from now on detach from
+    // it; if the write fails the image counts as modified again
+    ImageSaver *saver = new ImageSaver(opencvProcess->layerStack, fileName, QByteArray(fileFormat), this);
+    connect(saver, &ImageSaver::finished, this, &ScribbleArea::saveFinished);
+    saver->start();
+    modified = false;
+    return true;
+}
+
+bool ScribbleArea::openProject(const QString &fileName)
+{
+    flushStroke();
+    cancelLoad();
+
+    QString error;
+    QSharedPointer<ProjectFile> file = ProjectFile::open(fileName, opencvProcess, &error);
+    if(!file)
+    {
+        QMessageBox::warning(this, tr("Open"), tr("Unable to open %1\n%2").arg(fileName).arg(error));
+        return false;
+    }
+    project = file;
+    journal->discard();
+    layersReplaced();
+
+    modified = false;
+    update();
+    return true;
+}
+
+bool ScribbleArea::recoverJournal()
+{
+    flushStroke();
+    cancelLoad();
+
+    QString error;
+    if(!journal->recover(opencvProcess, &error))
+    {
+        QMessageBox::warning(this, tr("Recover"), tr("Unable to recover the unsaved work\n%1").arg(error));
+        return false;
+    }
+    project.clear();
+    layersReplaced();
+
+    // nothing of it is saved
+    modified = true;
+    update();
+    return true;
+}
+
+void ScribbleArea::layersReplaced()
+{
+    // the layers the history refers to are gone
+    history->clear();
+
+    // the layers were all replaced, so is every per layer view state
+    qDeleteAll(pyramids);
+    pyramids.clear();
+    for(int i = 0; i < opencvProcess->layerStack.size(); i++)
+    {
+        insertPyramid(i);
+        pyramids[i]->reset(image(i));
+    }
+    frameTiles.clear();
+    setCurrentLayer(opencvProcess->currentImageNum);
+
+    marqueePoints.clear();
+    update();
+}
+
+bool ScribbleArea::saveProject(const QString &fileName)
+{
+    flushStroke();
+    if(totalImageNum <= 0 || isLoading()) return false;
+
+    // only the tiles changed since the last save of this file are written
+    QString error;
+    QSharedPointer<ProjectFile> file = ProjectFile::save(fileName, opencvProcess, project, &error);
+    if(!file)
+    {
+        QMessageBox::warning(this, tr("Save"), tr("Unable to save %1\n%2").arg(fileName).arg(error));
         return false;
     }
+    project = file;
+    modified = false;
+    journal->discard();
+    return true;
+}
+
+void ScribbleArea::appendJournal()
+{
+    // a layer still loading is all blank tiles so far
+    if(!modified || isLoading()) return;
+    journal->append(opencvProcess);
+}
+
+void ScribbleArea::saveFinished(bool ok, const QString &error)
+{
+    // strokes made while it was written are still only in the journal
+    if(ok && !modified) journal->discard();
+    if(ok) return;
+
+    modified = true;
+    QMessageBox::warning(this, tr("Save"), tr("Unable to save the image\n%1").arg(error));
 }
 //! [4]
 
@@ -408,190 +1251,3 @@ bool ScribbleArea::saveImage(const QString &fileName, const char *fileFormat)
 //#endif // QT_NO_PRINTER
 //}
 //! [22]
-
-
-QImage ScribbleArea::CVMatToQImage(const Mat& imgMat)
-{
-    Mat rgb;
-    cvtColor(imgMat, rgb, CV_BGR2RGB);
-
-    return QImage((const unsigned char*)rgb.data, rgb.cols, rgb.rows, QImage::Format_RGB888);
-}
-
-QImage ScribbleArea::IplImage2QImage(const IplImage *iplImage, double mini, double maxi)
-{
-    uchar *qImageBuffer = NULL;
-
-    int width = iplImage->width;
-
-    /* Note here that OpenCV image is stored so that each lined is
-    32-bits aligned thus
-    * explaining the necessity to "skip" the few last bytes of each
-    line of OpenCV image buffer.
-    */
-    int widthStep = iplImage->widthStep;
-    int height = iplImage->height;
-
-    switch (iplImage->depth)
-    {
-    case IPL_DEPTH_8U:
-        if(iplImage->nChannels == 1)
-        {
-            /* OpenCV image is stored with one byte grey pixel. We convert it
-                to an 8 bit depth QImage.
-                */
-
-            qImageBuffer = (uchar *) malloc(width*height*sizeof(uchar));
-            uchar *QImagePtr = qImageBuffer;
-            const uchar *iplImagePtr = (const uchar *) iplImage->imageData;
-
-            for(int y = 0; y < height; y++)
-            {
-                // Copy line by line
-                memcpy(QImagePtr, iplImagePtr, width);
-                QImagePtr += width;
-                iplImagePtr += widthStep;
-            }
-
-        }
-        else if(iplImage->nChannels == 3)
-        {
-            /* OpenCV image is stored with 3 byte color pixels (3 channels).
-                        We convert it to a 32 bit depth QImage.
-                        */
-            qImageBuffer = (uchar *) malloc(width*height*4*sizeof(uchar));
-            uchar *QImagePtr = qImageBuffer;
-            const uchar *iplImagePtr = (const uchar *) iplImage->imageData;
-            for(int y = 0; y < height; y++)
-            {
-                for (int x = 0; x < width; x++)
-                {
-                    // We cannot help but copy manually.
-                    QImagePtr[0] = iplImagePtr[0];
-                    QImagePtr[1] = iplImagePtr[1];
-                    QImagePtr[2] = iplImagePtr[2];
-                    QImagePtr[3] = 0;
-
-                    QImagePtr += 4;
-                    iplImagePtr += 3;
-                }
-                iplImagePtr += widthStep-3*width;
-            }
-
-        }
-        else
-        {
-            qDebug("IplImageToQImage: image format is not supported : depth=8U and %d channels ", iplImage->nChannels);
-        }
-        break;
-                case IPL_DEPTH_16U:
-        if(iplImage->nChannels == 1)
-        {
-            /* OpenCV image is stored with 2 bytes grey pixel. We convert it
-                to an 8 bit depth QImage.
-                */
-            qImageBuffer = (uchar *) malloc(width*height*sizeof(uchar));
-            uchar *QImagePtr = qImageBuffer;
-            //const uint16_t *iplImagePtr = (const uint16_t *);
-            const unsigned int *iplImagePtr = (const unsigned int *)iplImage->imageData;
-            for (int y = 0; y < height; y++)
-            {
-                for (int x = 0; x < width; x++)
-                {
-                    // We take only the highest part of the 16 bit value. It is
-                    //similar to dividing by 256.
-                    *QImagePtr++ = ((*iplImagePtr++) >> 8);
-                }
-                iplImagePtr += widthStep/sizeof(unsigned int)-width;
-            }
-        }
-        else
-        {
-            qDebug("IplImageToQImage: image format is not supported : depth=16U and %d channels ", iplImage->nChannels);
-
-        }
-        break;
-                case IPL_DEPTH_32F:
-        if(iplImage->nChannels == 1)
-        {
-            /* OpenCV image is stored with float (4 bytes) grey pixel. We
-                convert it to an 8 bit depth QImage.
-                */
-            qImageBuffer = (uchar *) malloc(width*height*sizeof(uchar));
-            uchar *QImagePtr = qImageBuffer;
-            const float *iplImagePtr = (const float *) iplImage->imageData;
-            for(int y = 0; y < height; y++)
-            {
-                for(int x = 0; x < width; x++)
-                {
-                    uchar p;
-                    float pf = 255 * ((*iplImagePtr++) - mini) / (maxi - mini);
-                    if(pf < 0) p = 0;
-                    else if(pf > 255) p = 255;
-                    else p = (uchar) pf;
-
-                    *QImagePtr++ = p;
-                }
-                iplImagePtr += widthStep/sizeof(float)-width;
-            }
-        }
-        else
-        {
-            qDebug("IplImageToQImage: image format is not supported : depth=32F and %d channels ", iplImage->nChannels);
-        }
-        break;
-                   case IPL_DEPTH_64F:
-        if(iplImage->nChannels == 1)
-        {
-            /* OpenCV image is stored with double (8 bytes) grey pixel. We
-                    convert it to an 8 bit depth QImage.
-                    */
-            qImageBuffer = (uchar *) malloc(width*height*sizeof(uchar));
-            uchar *QImagePtr = qImageBuffer;
-            const double *iplImagePtr = (const double *) iplImage->imageData;
-            for(int y = 0; y < height; y++)
-            {
-                for(int x = 0; x < width; x++)
-                {
-                    uchar p;
-                    double pf = 255 * ((*iplImagePtr++) - mini) / (maxi - mini);
-
-                    if(pf < 0) p = 0;
-                    else if(pf > 255) p = 255;
-                    else p = (uchar) pf;
-
-                    *QImagePtr++ = p;
-                }
-                iplImagePtr += widthStep/sizeof(double)-width;
-            }
-        }
-        else
-        {
-            qDebug("IplImageToQImage: image format is not supported : depth=64F and %d channels ", iplImage->nChannels);
-        }
-        break;
-                default:
-        qDebug("IplImageToQImage: image format is not supported : depth=%d and %d channels ", iplImage->depth, iplImage->nChannels);
-    }
-
-    QImage qImage;
-    QVector<QRgb> vcolorTable;
-    if(iplImage->nChannels == 1)
-    {
-        // We should check who is going to destroy this allocation.
-        QRgb *colorTable = new QRgb[256];
-        for(int i = 0; i < 256; i++)
-        {
-            colorTable[i] = qRgb(i, i, i);
-            vcolorTable[i] = colorTable[i];
-        }
-        qImage = QImage(qImageBuffer, width, height, QImage::Format_Indexed8).copy();
-        qImage.setColorTable(vcolorTable);
-    }
-    else
-    {
-        qImage = QImage(qImageBuffer, width, height, QImage::Format_RGB32).copy();
-    }
-    free(qImageBuffer);
-    return qImage;
-}
@@ -6,64 +6,174 @@
 #include <QPoint>
 #include <QWidget>
 #include <QList>
+#include <QLine>
+#include <QTimer>
+#include <QThread>
+#include <QUndoStack>
 
 #include <cv.h>
 #include <highgui.h>
 
 #include "toolbox.h"
 #include "opencvprocess.h"
-#include "shared/hoverpoints.h"
+#include "mippyramid.h"
+#include "renderworker.h"
+#include "imageloader.h"
+#include "imagesaver.h"
+#include "projectfile.h"
+#include "undohistory.h"
+#include "recoveryjournal.h"
+#include "strokebuffer.h"
 
 
 //! [0]
 class ScribbleArea : public QWidget
 {
     Q_OBJECT
+    friend class Benchmark;
 
 public:
     ScribbleArea(QWidget *parent = 0);
+    ~ScribbleArea();
 
     bool openImage(const QString &fileName);
     bool saveImage(const QString &fileName, const char *fileFormat);
+    // the native .pmig format, see ProjectFile
+    bool openProject(const QString &fileName);
+    bool saveProject(const QString &fileName);
+    QString projectFileName() const { return project ? project->fileName() : QString(); }
+    // work left in the journal by a session that crashed, see RecoveryJournal
+    bool canRecover() const { return journal->canRecover(); }
+    bool recoverJournal();
+    void discardJournal() { journal->discard(); }
 //    void setPenColor(const QColor &newColor);
 //    void setPenWidth(int newWidth);
 
     bool isModified() const { return modified; }
+    bool isLoading() const { return loader != 0; }
 
     void setToolType(ToolType::toolType type);
 
+    const Layer *currentLayer() const;
+
+    // what the brush paints with
+    QColor foregroundColor() const;
+    void setForegroundColor(const QColor &color);
+
+    // every stroke is one step, see TileDeltaCommand
+    QUndoStack *undoStack() const { return history; }
+    int undoMemoryBudget() const { return int(undoTiles.memoryBudget() >> 20); }
+    void setUndoMemoryBudget(int megabytes);
+
 //    QColor penColor() const { return myPenColor; }
 //    int penWidth() const { return myPenWidth; }
 
 public slots:
 //    void clearImage();
     //void print();
-    void updateDisplay(int changedImageNum);
+    void updateDisplay(int changedImageNum, const QRect &changedRect = QRect());
+    // drops the image being opened, and its layer
+    void cancelLoad();
+
+    void newLayer();
+    void duplicateLayer();
+    void deleteLayer();
+    void selectLayerAbove();
+    void selectLayerBelow();
+    void toggleLayerVisibility();
+    void setLayerOpacity(qreal opacity);
+    void setLayerBlendMode(int mode);
+
+private slots:
+    void pyramidUpdated(const QRect &rect);
+    void flushStroke();
+    void tilesRendered(const RenderedTiles &tiles);
+    void loadSizeKnown(const QSize &imageSize);
+    void loadPreviewReady(const QImage &preview);
+    void loadWindowKnown(int type, double low, double high);
+    void loadBandLoaded(const TiledImage &band, const TiledImage &nativeBand, int tileRow);
+    void loadFinished(bool ok);
+    void saveFinished(bool ok, const QString &error);
+    void appendJournal();
 
 protected:
     void mousePressEvent(QMouseEvent *event);
     void mouseMoveEvent(QMouseEvent *event);
     void mouseReleaseEvent(QMouseEvent *event);
+    // pen strokes with pressure, other tablet input comes back as mouse events
+    void tabletEvent(QTabletEvent *event);
     void enterEvent(QEvent * event);
 //    void mouseDoubleClickEvent(QMouseEvent *event);
     void paintEvent(QPaintEvent *event);
     void resizeEvent(QResizeEvent *event);
     void keyPressEvent(QKeyEvent *event);
+    void wheelEvent(QWheelEvent *event);
 
 private:
     OpencvProcess *opencvProcess;
     int totalImageNum, currentImageNum;
-    QList<QImage> imageStack;
     QPoint imageCentralPoint;
 
+    // view transform: widget = centre + pan + (image - size/2) * zoom
+    qreal zoomFactor;
+    QPointF panOffset;
+    bool isPanning;
+    QPoint lastPanPoint;
+    // one per layer, in layer order
+    QList<MipPyramid*> pyramids;
+
+    // composition runs on renderThread, paintEvent only blits frameTiles;
+    // a tile is current while its rendered revision matches tileRevisions
+    QThread *renderThread;
+    RenderWorker *renderWorker;
+    QVector<QImage> frameTiles;
+    QVector<int> tileRevisions, requestedRevisions, renderedRevisions;
+    bool layersChanged;
+    void markStale(const QRect &rect);
+    void markAllStale();
+    void requestTiles(const QVector<int> &tiles);
+
+    // the image being opened: its layer fills in band by band, the
+    // preview covers the rows not loaded yet
+    ImageLoader *loader;
+    int loadingLayer;
+    QSize loadingImageSize;
+    QImage loadPreview;
+    int loadedTileRows;
+    void discardLoadingLayer();
+
+    // the .pmig file last opened or saved, unchanged tiles point into it
+    QSharedPointer<ProjectFile> project;
+    void layersReplaced();
+
+    // unsaved tiles go to the journal every journalTimer tick
+    RecoveryJournal *journal;
+    QTimer *journalTimer;
+    void setZoom(qreal zoom, const QPoint &anchor);
+    void panBy(const QPoint &delta);
+
     ToolType::toolType toolType;
     const int toolIndicationAlpha;
-    QPolygonF marqueeHandlerControl;
-    HoverPoints *marqueeHandler;
-
-
-    QImage CVMatToQImage(const Mat& imgMat);
-    QImage IplImage2QImage(const IplImage *iplImage, double mini, double maxi);
+    // the marquee being dragged, in image coordinates, see OpencvProcess::select
+    QPolygonF marqueePoints;
+    SelectionMask::Mode marqueeMode;
+    // the outlines of the selection and of the marquee
+    void drawSelection(QPainter *painter);
+
+
+    // tiles shared with OpencvProcess, see TiledImage
+    const TiledImage &image(int imageNum) const;
+    void insertPyramid(int imageNum);
+    void setCurrentLayer(int imageNum);
+    void layerPropertiesChanged();
+    // all layers share the canvas size, so one mapping serves them all
+    QSize canvasSize() const;
+    QPointF imageOrigin() const;
+    QPoint mapToImage(const QPoint &pos) const;
+    QRect mapToImage(const QRect &rect) const;
+    QRect mapFromImage(const QRect &rect) const;
+    void drawLevel(QPainter *painter, const QRect &exposed, int level);
+    void drawTiles(QPainter *painter, const QRect &exposed);
 
 
     bool modified;
@@ -72,6 +182,30 @@ private:
     //QColor myPenColor;
     //QImage image;
     QPoint lastPoint;
+    // segments waiting for the next frame tick, in image coordinates
+    QVector<StrokeSegment> pendingSegments;
+    QTimer *strokeTimer;
+    void queueSegment(const StrokeSegment &segment);
+
+    // the pen stroke in progress, every sample of it
+    bool isTabletStroke;
+    StrokeBuffer strokeSamples;
+    StrokeSample tabletSample(const QTabletEvent *event) const;
+    // drawn over the canvas until the frame tick rasterizes the real samples
+    bool hasPrediction;
+    QPointF predictedTip;
+    QRect provisionalRect;
+    QPolygonF provisionalStroke() const;
+    void updatePrediction();
+
+    // the layer as it was when the stroke began, its tiles the stroke
+    // detached are the ones the undo step records
+    QUndoStack *history;
+    UndoTileStore undoTiles;
+    TiledImage strokeBefore;
+    int strokeLayerId;
+    void beginStroke();
+    void endStroke(const QString &text);
     bool isMouseMoving;
     bool isMousePressed;
 
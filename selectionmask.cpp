@@ -0,0 +1,424 @@
+﻿#include <QtConcurrent>
+#include <QPainter>
+#include <QImage>
+
+#include <cv.h>
+
+#include "selectionmask.h"
+#include "tiledimage.h"
+
+using namespace cv;
+
+static const int TileSize = TiledImage::TileSize;
+
+// c * a / 255, rounded
+static inline uint multiplyByAlpha(uint c, uint a)
+{
+    uint t = c * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+struct RasterJob
+{
+    const QPainterPath *shape;
+    QRect rect;
+    QByteArray mask;
+};
+
+static void rasterize(RasterJob &job)
+{
+    job.mask.fill(0, TileSize*TileSize);
+    // the alpha is the coverage
+    QImage image((uchar *) job.mask.data(), TileSize, TileSize, TileSize, QImage::Format_Alpha8);
+    QPainter painter(&image);
+    painter.setRenderHint(QPainter::Antialiasing, true);
+    painter.translate(-job.rect.topLeft());
+    painter.fillPath(*job.shape, Qt::black);
+}
+
+
+SelectionMask::SelectionMask()
+    :columns(0), rows(0), rectangular(false), traced(false)
+{
+    ;
+}
+
+SelectionMask::SelectionMask(const QSize &canvasSize)
+    :canvas(canvasSize), rectangular(false), traced(false)
+{
+    columns = (canvas.width() + TileSize - 1) / TileSize;
+    rows = (canvas.height() + TileSize - 1) / TileSize;
+    states.fill(None, columns*rows);
+    masks.resize(columns*rows);
+}
+
+SelectionMask::SelectionMask(const QSize &canvasSize, const QVector<QByteArray> &tileMasks)
+    :canvas(canvasSize), rectangular(false), traced(true)
+{
+    columns = (canvas.width() + TileSize - 1) / TileSize;
+    rows = (canvas.height() + TileSize - 1) / TileSize;
+    states.fill(None, columns*rows);
+    masks.resize(columns*rows);
+
+    for(int i = 0; i < states.size() && i < tileMasks.size(); i++)
+    {
+        if(tileMasks.at(i).size() != TileSize*TileSize) continue;
+        states[i] = Partial;
+        masks[i] = tileMasks.at(i);
+        normalize(i);
+        if(states.at(i) != None) bounds |= tileRect(i);
+    }
+    path = traceOutline();
+}
+
+void SelectionMask::clear()
+{
+    states.fill(None);
+    masks.fill(QByteArray());
+    bounds = QRect();
+    rectangular = false;
+    path = QPainterPath();
+    traced = false;
+}
+
+void SelectionMask::selectRect(const QRect &rect, Mode mode)
+{
+    // a lone rectangle, or one cut down by another, has no partly covered
+    // pixels and its box is exact
+    bool isLone = mode == Replace || (mode == Add && isEmpty()) || (mode == Intersect && rectangular);
+    QPainterPath shape;
+    shape.addRect(QRectF(rect.normalized()));
+    select(shape, mode);
+    rectangular = isLone && !isEmpty();
+}
+
+void SelectionMask::selectEllipse(const QRect &rect, Mode mode)
+{
+    QPainterPath shape;
+    shape.addEllipse(QRectF(rect.normalized()));
+    select(shape, mode);
+}
+
+void SelectionMask::selectPolygon(const QPolygonF &polygon, Mode mode)
+{
+    // a lasso crossing itself still selects all it goes round
+    QPainterPath shape;
+    shape.setFillRule(Qt::WindingFill);
+    shape.addPolygon(polygon);
+    shape.closeSubpath();
+    select(shape, mode);
+}
+
+void SelectionMask::select(const QPainterPath &shape, Mode mode)
+{
+    if(states.isEmpty()) return;
+    SelectionMask other(canvas);
+    other.bounds = shape.controlPointRect().toAlignedRect() & QRect(QPoint(0, 0), canvas);
+    other.path = shape;
+
+    // the tiles an edge of the shape crosses are rasterized, in parallel
+    QVector<RasterJob> jobs;
+    for(int i = 0; i < states.size(); i++)
+    {
+        QRect rect = tileRect(i);
+        if(!rect.intersects(other.bounds)) continue;
+        if(shape.contains(QRectF(rect)))
+        {
+            other.states[i] = Full;
+            continue;
+        }
+        RasterJob job;
+        job.shape = &shape;
+        job.rect = rect;
+        jobs.append(job);
+    }
+    QtConcurrent::blockingMap(jobs, rasterize);
+
+    for(int j = 0; j < jobs.size(); j++)
+    {
+        int index = (jobs.at(j).rect.top() / TileSize)*columns + jobs.at(j).rect.left() / TileSize;
+        other.states[index] = Partial;
+        other.masks[index] = jobs.at(j).mask;
+    }
+    select(other, mode);
+}
+
+void SelectionMask::select(const SelectionMask &other, Mode mode)
+{
+    if(states.isEmpty() || other.canvas != canvas) return;
+    // nothing selected yet, adding is starting over and the rest is a no-op
+    if(isEmpty() && mode != Replace)
+    {
+        if(mode != Add) return;
+        mode = Replace;
+    }
+    rectangular = false;
+
+    if(mode == Replace)
+    {
+        states.fill(None);
+        masks.fill(QByteArray());
+    }
+    Mode tileMode = mode == Replace ? Add : mode;
+    for(int i = 0; i < states.size(); i++)
+        combine(i, Coverage(other.states.at(i)), other.masks.at(i), tileMode);
+
+    if(mode == Replace)
+        bounds = other.bounds;
+    else if(mode == Add)
+        bounds |= other.bounds;
+    else if(mode == Intersect)
+        bounds &= other.bounds;
+
+    // no further out than the tiles left with something selected
+    QRect selectedTiles;
+    for(int i = 0; i < states.size(); i++)
+        if(states.at(i) != None) selectedTiles |= tileRect(i);
+    bounds &= selectedTiles;
+    if(bounds.isEmpty())
+    {
+        clear();
+        return;
+    }
+
+    // pixel outlines don't combine well as paths
+    traced = (traced && mode != Replace) || other.traced;
+    if(traced)
+        path = traceOutline();
+    else if(mode == Replace)
+        path = other.path;
+    else if(mode == Add)
+        path = path.united(other.path);
+    else if(mode == Subtract)
+        path = path.subtracted(other.path);
+    else
+        path = path.intersected(other.path);
+}
+
+SelectionMask::Coverage SelectionMask::tileCoverage(int index, const uchar **mask) const
+{
+    Coverage state = Coverage(states.at(index));
+    if(mask) *mask = state == Partial ? (const uchar *) masks.at(index).constData() : 0;
+    return state;
+}
+
+uchar SelectionMask::coverage(int x, int y) const
+{
+    if(x < 0 || y < 0 || x >= canvas.width() || y >= canvas.height()) return 0;
+    int index = (y / TileSize)*columns + x / TileSize;
+    switch(states.at(index))
+    {
+    case Full:
+        return 255;
+    case Partial:
+        return masks.at(index).at((y % TileSize)*TileSize + x % TileSize);
+    default:
+        return 0;
+    }
+}
+
+static QByteArray compressMask(const QByteArray &mask)
+{
+    // the level tiles are saved with, see ProjectFile
+    return qCompress(mask, 1);
+}
+
+static QByteArray uncompressMask(const QByteArray &data)
+{
+    return qUncompress(data);
+}
+
+QDataStream &operator<<(QDataStream &stream, const SelectionMask &selection)
+{
+    QList<QByteArray> partial;
+    for(int i = 0; i < selection.states.size(); i++)
+        if(selection.states.at(i) == SelectionMask::Partial)
+            partial.append(selection.masks.at(i));
+    partial = QtConcurrent::blockingMapped<QList<QByteArray> >(partial, compressMask);
+
+    stream << selection.canvas << selection.bounds << selection.rectangular << selection.traced;
+    // a traced outline is traced again on reading, it can be long
+    if(!selection.traced)
+        stream << selection.path;
+    for(int i = 0, p = 0; i < selection.states.size(); i++)
+    {
+        stream << (quint8) selection.states.at(i);
+        if(selection.states.at(i) == SelectionMask::Partial)
+            stream << partial.at(p++);
+    }
+    return stream;
+}
+
+QDataStream &operator>>(QDataStream &stream, SelectionMask &selection)
+{
+    QSize canvas;
+    stream >> canvas;
+    if(canvas.width() < 0 || canvas.height() < 0)
+    {
+        stream.setStatus(QDataStream::ReadCorruptData);
+        return stream;
+    }
+
+    SelectionMask loaded(canvas);
+    stream >> loaded.bounds >> loaded.rectangular >> loaded.traced;
+    if(!loaded.traced)
+        stream >> loaded.path;
+    QList<int> partial;
+    QList<QByteArray> compressed;
+    for(int i = 0; i < loaded.states.size() && stream.status() == QDataStream::Ok; i++)
+    {
+        quint8 state;
+        stream >> state;
+        if(state > SelectionMask::Full)
+            stream.setStatus(QDataStream::ReadCorruptData);
+        loaded.states[i] = state;
+        if(state != SelectionMask::Partial) continue;
+
+        QByteArray mask;
+        stream >> mask;
+        partial.append(i);
+        compressed.append(mask);
+    }
+
+    QList<QByteArray> masks = QtConcurrent::blockingMapped<QList<QByteArray> >(compressed, uncompressMask);
+    for(int p = 0; p < partial.size(); p++)
+    {
+        if(masks.at(p).size() != TileSize*TileSize)
+            stream.setStatus(QDataStream::ReadCorruptData);
+        loaded.masks[partial.at(p)] = masks.at(p);
+    }
+    if(stream.status() != QDataStream::Ok) return stream;
+
+    if(loaded.traced)
+        loaded.path = loaded.traceOutline();
+    selection = loaded;
+    return stream;
+}
+
+QRect SelectionMask::tileRect(int index) const
+{
+    int x = (index % columns) * TileSize;
+    int y = (index / columns) * TileSize;
+    return QRect(x, y, qMin(TileSize, canvas.width() - x), qMin(TileSize, canvas.height() - y));
+}
+
+void SelectionMask::combine(int index, Coverage shapeCoverage, const QByteArray &shapeMask, Mode mode)
+{
+    Coverage state = Coverage(states.at(index));
+    switch(mode)
+    {
+    case Add:
+        if(shapeCoverage == None || state == Full) return;
+        if(shapeCoverage == Full || state == None)
+        {
+            states[index] = shapeCoverage;
+            masks[index] = shapeMask;
+            if(shapeCoverage == Partial) normalize(index);
+            return;
+        }
+        break;
+    case Subtract:
+        if(shapeCoverage == None || state == None) return;
+        break;
+    case Intersect:
+        if(shapeCoverage == Full || state == None) return;
+        if(state == Full)
+        {
+            states[index] = shapeCoverage;
+            masks[index] = shapeMask;
+            if(shapeCoverage == Partial) normalize(index);
+            return;
+        }
+        break;
+    default:
+        return;
+    }
+
+    if(shapeCoverage == None || (mode == Subtract && shapeCoverage == Full))
+    {
+        states[index] = None;
+        masks[index] = QByteArray();
+        return;
+    }
+
+    // both partial, or a full tile losing the shape
+    if(state == Full) masks[index].fill((char) 255, TileSize*TileSize);
+    states[index] = Partial;
+    uchar *out = (uchar *) masks[index].data();
+    const uchar *in = (const uchar *) shapeMask.constData();
+    for(int i = 0; i < TileSize*TileSize; i++)
+    {
+        switch(mode)
+        {
+        case Add:
+            out[i] += multiplyByAlpha(in[i], 255 - out[i]);
+            break;
+        case Subtract:
+            out[i] = multiplyByAlpha(out[i], 255 - in[i]);
+            break;
+        default:
+            out[i] = multiplyByAlpha(out[i], in[i]);
+            break;
+        }
+    }
+    normalize(index);
+}
+
+void SelectionMask::normalize(int index)
+{
+    QRect rect = tileRect(index);
+    const uchar *mask = (const uchar *) masks.at(index).constData();
+    bool isClear = true, isFull = true;
+    for(int y = 0; y < rect.height() && (isClear || isFull); y++)
+    {
+        for(int x = 0; x < rect.width(); x++)
+        {
+            isClear = isClear && mask[y*TileSize + x] == 0;
+            isFull = isFull && mask[y*TileSize + x] == 255;
+        }
+    }
+    if(isClear || isFull)
+    {
+        states[index] = isClear ? None : Full;
+        masks[index] = QByteArray();
+    }
+}
+
+QPainterPath SelectionMask::traceOutline() const
+{
+    QPainterPath outline;
+    if(bounds.isEmpty()) return outline;
+
+    // a clear border keeps the contours off the edge of the image
+    Mat mask(bounds.height() + 2, bounds.width() + 2, CV_8UC1, Scalar::all(0));
+    for(int i = 0; i < states.size(); i++)
+    {
+        QRect rect = tileRect(i);
+        QRect part = rect & bounds;
+        if(part.isEmpty() || states.at(i) == None) continue;
+
+        Mat to = mask(Rect(part.left() - bounds.left() + 1, part.top() - bounds.top() + 1,
+                           part.width(), part.height()));
+        if(states.at(i) == Full)
+        {
+            to.setTo(Scalar::all(255));
+            continue;
+        }
+        Mat from(TileSize, TileSize, CV_8UC1, (void *) masks.at(i).constData());
+        threshold(from(Rect(part.left() - rect.left(), part.top() - rect.top(), part.width(), part.height())),
+                  to, 127, 255, THRESH_BINARY);
+    }
+
+    std::vector<std::vector<Point> > contours;
+    findContours(mask, contours, CV_RETR_LIST, CV_CHAIN_APPROX_SIMPLE,
+                 Point(bounds.left() - 1, bounds.top() - 1));
+    for(size_t c = 0; c < contours.size(); c++)
+    {
+        QPolygonF polygon;
+        for(size_t p = 0; p < contours[c].size(); p++)
+            polygon << QPointF(contours[c][p].x + 0.5, contours[c][p].y + 0.5);
+        outline.addPolygon(polygon);
+        outline.closeSubpath();
+    }
+    return outline;
+}
@@ -0,0 +1,89 @@
+﻿#ifndef SELECTIONMASK_H
+#define SELECTIONMASK_H
+
+#include <QVector>
+#include <QByteArray>
+#include <QSize>
+#include <QRect>
+#include <QPolygonF>
+#include <QPainterPath>
+#include <QDataStream>
+
+/* What is selected, as an 8 bit coverage per pixel. The mask is kept in
+ * tiles laid out as a TiledImage of the same size, so tools clip tile by
+ * tile. A tile wholly outside or wholly inside the selection keeps no mask
+ * at all, only the ones an edge crosses do. A rectangle that was never
+ * combined with another shape is also isRectangle(), and tools can clip
+ * it to boundingRect() without reading any mask.
+ *
+ * Shapes are rasterized antialiased with QPainter and combined with the
+ * mask by coverage; the outline is kept as a path for drawing. A mask that
+ * came from pixels, see FloodFill, has its outline traced instead, and so
+ * has everything combined with it.
+ */
+class SelectionMask
+{
+public:
+    enum Mode{
+        Replace=0,
+        Add=1,
+        Subtract=2,
+        Intersect=3
+    };
+
+    enum Coverage{
+        None=0,
+        Partial=1,
+        Full=2
+    };
+
+    SelectionMask();
+    explicit SelectionMask(const QSize &canvasSize);
+    // one TileSize x TileSize coverage per tile, as tileCoverage() gives
+    // it; an empty one selects nothing
+    SelectionMask(const QSize &canvasSize, const QVector<QByteArray> &tileMasks);
+
+    QSize size() const {return canvas;}
+    bool isEmpty() const {return bounds.isEmpty();}
+    bool isRectangle() const {return rectangular;}
+    // every selected pixel is inside it
+    QRect boundingRect() const {return bounds;}
+    QPainterPath outline() const {return path;}
+
+    void clear();
+    void select(const QPainterPath &shape, Mode mode);
+    // other must have our size
+    void select(const SelectionMask &other, Mode mode);
+    // rect is in pixels, right and bottom edges inclusive like QRect
+    void selectRect(const QRect &rect, Mode mode);
+    void selectEllipse(const QRect &rect, Mode mode);
+    void selectPolygon(const QPolygonF &polygon, Mode mode);
+
+    // of the tile index of a TiledImage of size(); a Partial tile sets mask
+    // to its TileSize x TileSize coverage, row by row
+    Coverage tileCoverage(int index, const uchar **mask = 0) const;
+    uchar coverage(int x, int y) const;
+
+    // for ProjectFile: a state per tile and the Partial masks qCompress'ed
+    friend QDataStream &operator<<(QDataStream &stream, const SelectionMask &selection);
+    friend QDataStream &operator>>(QDataStream &stream, SelectionMask &selection);
+
+private:
+    QSize canvas;
+    int columns, rows;
+    QVector<uchar> states;          // Coverage per tile
+    QVector<QByteArray> masks;      // Partial tiles only
+    QRect bounds;
+    bool rectangular;
+    QPainterPath path;
+    bool traced;
+
+    QRect tileRect(int index) const;
+    void combine(int index, Coverage shapeCoverage, const QByteArray &shapeMask, Mode mode);
+    // Partial tiles that came out empty or full are stored as such
+    void normalize(int index);
+    // the edges of the pixels at least half covered
+    QPainterPath traceOutline() const;
+};
+
+#endif // SELECTIONMASK_H
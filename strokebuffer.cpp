@@ -0,0 +1,29 @@
+﻿#include <QLineF>
+
+#include "strokebuffer.h"
+
+// the samples the velocity is taken over, older ones say little about now
+static const qint64 velocityWindow = 30;
+
+bool StrokeBuffer::predict(qint64 horizon, QPointF *position) const
+{
+    if(buffer.size() < 2) return false;
+
+    const StrokeSample &newest = buffer.last();
+    int first = buffer.size() - 2;
+    while(first > 0 && newest.time - buffer.at(first - 1).time <= velocityWindow)
+        first--;
+    const StrokeSample &oldest = buffer.at(first);
+
+    qint64 elapsed = newest.time - oldest.time;
+    if(elapsed <= 0 || elapsed > velocityWindow) return false;
+
+    QPointF step = (newest.position - oldest.position) * (qreal(horizon) / elapsed);
+    // a sudden stop overshoots, so never run ahead by more than was just covered
+    qreal covered = QLineF(oldest.position, newest.position).length();
+    qreal length = QLineF(QPointF(), step).length();
+    if(length > covered && length > 0) step *= covered / length;
+
+    *position = newest.position + step;
+    return true;
+}
@@ -0,0 +1,43 @@
+﻿#ifndef STROKEBUFFER_H
+#define STROKEBUFFER_H
+
+#include <QVector>
+#include <QPointF>
+
+// one pen report in image coordinates, time in ms as QInputEvent::timestamp()
+struct StrokeSample
+{
+    QPointF position;
+    qreal pressure;     // 0..1, mice press at 1
+    int xTilt, yTilt;   // degrees, see QTabletEvent
+    qint64 time;
+};
+
+/* Every sample of the stroke in progress, at the rate the tablet reports
+ * them. The canvas only draws once per frame, so this is what keeps the
+ * pressure and tilt of the samples in between.
+ *
+ * predict() extrapolates the pen from the velocity of the last few
+ * samples. ScribbleArea draws a provisional tip up to that point, which
+ * the real samples replace on the next frame.
+ */
+class StrokeBuffer
+{
+public:
+    StrokeBuffer() {}
+
+    void clear() {buffer.clear();}
+    void append(const StrokeSample &sample) {buffer.append(sample);}
+    bool isEmpty() const {return buffer.isEmpty();}
+    const StrokeSample &last() const {return buffer.last();}
+    const QVector<StrokeSample> &samples() const {return buffer;}
+
+    // where the pen will be horizon ms after the last sample; false when the
+    // recent samples are too few or too old to tell
+    bool predict(qint64 horizon, QPointF *position) const;
+
+private:
+    QVector<StrokeSample> buffer;
+};
+
+#endif // STROKEBUFFER_H
@@ -0,0 +1,202 @@
+﻿#include <QMutex>
+#include <QMutexLocker>
+
+#include "tiledimage.h"
+#include "projectfile.h"
+
+// guards the tile locations
+static QMutex tileMutex;
+
+Tile::Tile(int width, int height, int type)
+    :width(width), height(height), type(type), buffer(new PixelBuffer(width, height, type))
+{
+    ;
+}
+
+Tile::Tile(int width, int height, int type, const TileLocation &location)
+    :width(width), height(height), type(type), buffer(0), fileLocation(location)
+{
+    ;
+}
+
+Tile::Tile(const Tile &other)
+    :QSharedData(other), width(other.width), height(other.height), type(other.type),
+      buffer(new PixelBuffer(other.width, other.height, other.type))
+{
+    buffer.load()->copyFrom(other.pixels());
+}
+
+Tile::~Tile()
+{
+    delete buffer.load();
+}
+
+PixelBuffer *Tile::load() const
+{
+    // decoded outside the lock so threads load different tiles in parallel;
+    // if two race on the same tile the loser's copy is dropped
+    TileLocation location = this->location();
+    PixelBuffer *pixels = new PixelBuffer(width, height, type);
+    if(location.isNull() || !location.file->readTile(location, pixels))
+    {
+        qWarning("Tile: unreadable tile at %lld, left blank", location.offset);
+        pixels->fill(Scalar::all(0));
+    }
+
+    if(!buffer.testAndSetOrdered(0, pixels))
+    {
+        delete pixels;
+        return buffer.loadAcquire();
+    }
+    return pixels;
+}
+
+const PixelBuffer &Tile::pixels() const
+{
+    PixelBuffer *pixels = buffer.loadAcquire();
+    if(!pixels) pixels = load();
+    pixels->touch();
+    return *pixels;
+}
+
+PixelBuffer &Tile::pixels()
+{
+    PixelBuffer *pixels = buffer.loadAcquire();
+    if(!pixels) pixels = load();
+    pixels->touch();
+
+    QMutexLocker locker(&tileMutex);
+    fileLocation = TileLocation();
+    return *pixels;
+}
+
+TileLocation Tile::location() const
+{
+    QMutexLocker locker(&tileMutex);
+    return fileLocation;
+}
+
+void Tile::setLocation(const TileLocation &location) const
+{
+    QMutexLocker locker(&tileMutex);
+    fileLocation = location;
+}
+
+
+TiledImage::TiledImage()
+    :imageWidth(0), imageHeight(0), columns(0), rows(0), pixelType(CV_8UC4)
+{
+    ;
+}
+
+TiledImage::TiledImage(int width, int height, int type)
+    :imageWidth(width), imageHeight(height), pixelType(type)
+{
+    ScratchFile::reserveFor(qint64(width) * height * CV_ELEM_SIZE(type));
+    columns = (width + TileSize - 1) / TileSize;
+    rows = (height + TileSize - 1) / TileSize;
+
+    tiles.reserve(columns*rows);
+    for(int i = 0; i < columns*rows; i++)
+    {
+        QRect rect = tileRect(i);
+        tiles.append(QSharedDataPointer<Tile>(new Tile(rect.width(), rect.height(), type)));
+    }
+}
+
+TiledImage::TiledImage(int width, int height, int type, const QVector<TileLocation> &locations)
+    :imageWidth(width), imageHeight(height), pixelType(type)
+{
+    ScratchFile::reserveFor(qint64(width) * height * CV_ELEM_SIZE(type));
+    columns = (width + TileSize - 1) / TileSize;
+    rows = (height + TileSize - 1) / TileSize;
+    Q_ASSERT(locations.size() == columns*rows);
+
+    tiles.reserve(columns*rows);
+    for(int i = 0; i < columns*rows; i++)
+    {
+        QRect rect = tileRect(i);
+        tiles.append(QSharedDataPointer<Tile>(new Tile(rect.width(), rect.height(), type,
+                                                       locations.at(i))));
+    }
+}
+
+QRect TiledImage::tileRect(int index) const
+{
+    int x = (index % columns) * TileSize;
+    int y = (index / columns) * TileSize;
+    return QRect(x, y, qMin((int)TileSize, imageWidth - x), qMin((int)TileSize, imageHeight - y));
+}
+
+QVector<int> TiledImage::tilesIn(const QRect &rect) const
+{
+    QVector<int> indexes;
+    QRect region = rect & this->rect();
+    if(region.isEmpty()) return indexes;
+
+    for(int row = region.top() / TileSize; row <= region.bottom() / TileSize; row++)
+        for(int column = region.left() / TileSize; column <= region.right() / TileSize; column++)
+            indexes.append(row*columns + column);
+    return indexes;
+}
+
+bool TiledImage::sharesTile(const TiledImage &other, int index) const
+{
+    return index < other.tiles.size()
+            && tiles.at(index).constData() == other.tiles.at(index).constData();
+}
+
+void TiledImage::fill(const Scalar &value)
+{
+    for(int i = 0; i < tiles.size(); i++)
+        tile(i).fill(value);
+}
+
+void TiledImage::setTile(int index, const TiledImage &source, int sourceIndex)
+{
+    Q_ASSERT(tileRect(index).size() == source.tileRect(sourceIndex).size() && pixelType == source.pixelType);
+    tiles[index] = source.tiles.at(sourceIndex);
+}
+
+bool TiledImage::convertFrom(const IplImage *iplImage, double mini, double maxi)
+{
+    return convertFrom(iplImage, QPoint(0, 0), mini, maxi);
+}
+
+bool TiledImage::convertFrom(const IplImage *iplImage, const QPoint &origin, double mini, double maxi)
+{
+    // the part of this image iplImage covers
+    QRect covered = QRect(0, 0, iplImage->width, iplImage->height).translated(-origin);
+
+    for(int i = 0; i < tiles.size(); i++)
+    {
+        QRect rect = tileRect(i);
+        if(!covered.contains(rect))
+            tile(i).fill(Scalar::all(0));
+
+        QRect part = rect & covered;
+        if(part.isEmpty()) continue;
+        if(!tile(i).convertFrom(iplImage, part.translated(origin), part.topLeft() - rect.topLeft(),
+                                mini, maxi))
+            return false;
+    }
+    return true;
+}
+
+bool TiledImage::copyFrom(const IplImage *iplImage, const QPoint &origin)
+{
+    QRect covered = QRect(0, 0, iplImage->width, iplImage->height).translated(-origin);
+
+    for(int i = 0; i < tiles.size(); i++)
+    {
+        QRect rect = tileRect(i);
+        if(!covered.contains(rect))
+            tile(i).fill(Scalar::all(0));
+
+        QRect part = rect & covered;
+        if(part.isEmpty()) continue;
+        if(!tile(i).copyFrom(iplImage, part.translated(origin), part.topLeft() - rect.topLeft()))
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,122 @@
+﻿#ifndef TILEDIMAGE_H
+#define TILEDIMAGE_H
+
+#include <QSharedData>
+#include <QSharedDataPointer>
+#include <QSharedPointer>
+#include <QAtomicPointer>
+#include <QVector>
+#include <QRect>
+#include <QMetaType>
+
+#include "pixelbuffer.h"
+
+class ProjectFile;
+
+// where an up to date compressed copy of a tile sits in a .pmig file
+struct TileLocation
+{
+    TileLocation() :offset(0), length(0) {}
+
+    QSharedPointer<ProjectFile> file;
+    qint64 offset;
+    int length;
+
+    bool isNull() const {return file.isNull();}
+};
+
+
+/* One TileSize x TileSize block of BGRA pixels (smaller on the right and
+ * bottom edges). Tiles are implicitly shared: copying a TiledImage only
+ * bumps their reference counts and a tile is deep copied the first time it
+ * is written while shared.
+ *
+ * A tile opened from a .pmig file is only read and decompressed the first
+ * time its pixels are used, from any thread. Its location is kept until it
+ * is written, so saving to the same file again can skip it.
+ */
+class Tile : public QSharedData
+{
+public:
+    Tile(int width, int height, int type);
+    Tile(int width, int height, int type, const TileLocation &location);
+    Tile(const Tile &other);
+    ~Tile();
+
+    const PixelBuffer &pixels() const;
+    // for writing, the copy in the file is stale from now on
+    PixelBuffer &pixels();
+
+    bool isLoaded() const {return buffer.loadAcquire() != 0;}
+    TileLocation location() const;
+    void setLocation(const TileLocation &location) const;
+
+private:
+    int width, height, type;
+    mutable QAtomicPointer<PixelBuffer> buffer;
+    mutable TileLocation fileLocation;
+
+    PixelBuffer *load() const;
+};
+
+
+/* An image stored as a grid of copy-on-write tiles. Copies are cheap, so a
+ * duplicated layer or an undo snapshot costs only the tiles written after
+ * it was taken. Tools draw through tile() one tile at a time in tile local
+ * coordinates, see tileRect().
+ */
+class TiledImage
+{
+public:
+    enum { TileSize = 256 };
+
+    TiledImage();
+    // type is CV_8UC4 but for the native samples of a layer, see WindowLevel
+    TiledImage(int width, int height, int type = CV_8UC4);
+    // tiles left in a .pmig file, one location per tile in row order; none
+    // is allocated until its pixels are used, see Tile
+    TiledImage(int width, int height, int type, const QVector<TileLocation> &locations);
+
+    bool isNull() const {return tiles.isEmpty();}
+    int width() const {return imageWidth;}
+    int height() const {return imageHeight;}
+    QSize size() const {return QSize(imageWidth, imageHeight);}
+    QRect rect() const {return QRect(0, 0, imageWidth, imageHeight);}
+    int type() const {return pixelType;}
+
+    int tileCount() const {return tiles.size();}
+    int tileColumns() const {return columns;}
+    int tileRows() const {return rows;}
+    QRect tileRect(int index) const;
+    // indexes of the tiles intersecting rect, in row order
+    QVector<int> tilesIn(const QRect &rect) const;
+
+    const PixelBuffer &constTile(int index) const {return tiles.at(index)->pixels();}
+    // detaches the tile first if it is shared with another copy
+    PixelBuffer &tile(int index) {return tiles[index]->pixels();}
+    bool sharesTile(const TiledImage &other, int index) const;
+
+    // see Tile, for ProjectFile
+    const Tile &tileData(int index) const {return *tiles.at(index);}
+
+    void fill(const Scalar &value);
+    // shares sourceIndex of source, both tiles must have the same size
+    void setTile(int index, const TiledImage &source, int sourceIndex);
+
+    // iplImage is placed at the top left, whatever it does not cover is cleared
+    bool convertFrom(const IplImage *iplImage, double mini, double maxi);
+    // the same with pixel origin of iplImage at the top left, for bands of it
+    bool convertFrom(const IplImage *iplImage, const QPoint &origin, double mini, double maxi);
+    // iplImage of our type copied as is, placed and cleared the same way
+    bool copyFrom(const IplImage *iplImage, const QPoint &origin);
+
+private:
+    int imageWidth, imageHeight;
+    int columns, rows;
+    int pixelType;
+    QVector<QSharedDataPointer<Tile> > tiles;
+};
+
+Q_DECLARE_METATYPE(TiledImage)
+
+#endif // TILEDIMAGE_H
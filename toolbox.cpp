@@ -90,13 +90,16 @@ ToolTweak::ToolTweak(const QString &title, QWidget *parent)
 
 //+++++++++++++Brush+Tool+++++++++++++++++++++++++++++++++++++
 int BrushToolBase::brushSize=2;
-int BrushToolBase::lineType;
 bool BrushToolBase::antiAliasing;
+int BrushToolBase::brushHardness=80;
+int BrushToolBase::brushOpacity=100;
+int BrushToolBase::brushFlow=100;
+int BrushToolBase::brushSpacing=10;
 
 BrushToolTweak::BrushToolTweak(QWidget *parent)
     :ToolTweak("BRUSH TOOL", parent)
 {
-    QSpinBox *sizeSpinBox = new QSpinBox(this);
+    sizeSpinBox = new QSpinBox(this);
     sizeSpinBox->setRange(1,100);
     sizeSpinBox->setValue(2);
     QAction *autoIncrement = new QAction(this);
@@ -113,10 +116,42 @@ BrushToolTweak::BrushToolTweak(QWidget *parent)
 
     this->addSeparator();
 
-    QCheckBox *antiAliasingCheckBox = new QCheckBox(this);
+    antiAliasingCheckBox = new QCheckBox(this);
     antiAliasingCheckBox->setText("Anti-Aliasing");
     this->addWidget(antiAliasingCheckBox);
     connect(antiAliasingCheckBox,SIGNAL(toggled(bool)),this, SLOT(setAntiAliasing(bool)));
+
+    this->addSeparator();
+
+    hardnessSpinBox = addPercentBox("hardness: ", 0, brushHardness);
+    connect(hardnessSpinBox, SIGNAL(valueChanged(int)), this, SLOT(setHardness(int)));
+    opacitySpinBox = addPercentBox("opacity: ", 1, brushOpacity);
+    connect(opacitySpinBox, SIGNAL(valueChanged(int)), this, SLOT(setOpacity(int)));
+    flowSpinBox = addPercentBox("flow: ", 1, brushFlow);
+    connect(flowSpinBox, SIGNAL(valueChanged(int)), this, SLOT(setFlow(int)));
+    spacingSpinBox = addPercentBox("spacing: ", 1, brushSpacing);
+    connect(spacingSpinBox, SIGNAL(valueChanged(int)), this, SLOT(setSpacing(int)));
+}
+
+QSpinBox *BrushToolTweak::addPercentBox(const QString &label, int minimum, int value)
+{
+    QSpinBox *spinBox = new QSpinBox(this);
+    spinBox->setRange(minimum, 100);
+    spinBox->setSuffix("%");
+    spinBox->setValue(value);
+    this->addWidget(new QLabel(label, this));
+    this->addWidget(spinBox);
+    return spinBox;
+}
+
+void BrushToolTweak::refresh()
+{
+    sizeSpinBox->setValue(brushSize);
+    antiAliasingCheckBox->setChecked(antiAliasing);
+    hardnessSpinBox->setValue(brushHardness);
+    opacitySpinBox->setValue(brushOpacity);
+    flowSpinBox->setValue(brushFlow);
+    spacingSpinBox->setValue(brushSpacing);
 }
 
 BrushToolFunction::BrushToolFunction(QWidget *parent)
@@ -133,12 +168,30 @@ int EraseToolBase::eraseShape;
 EraseToolTweak::EraseToolTweak(QWidget *parent)
     :ToolTweak("ERASE TOOL", parent)
 {
-    QSpinBox *sizeSpinBox = new QSpinBox(this);
+    sizeSpinBox = new QSpinBox(this);
     sizeSpinBox->setRange(1,100);
     sizeSpinBox->setValue(10);
     this->addWidget(new QLabel("size: ",this));
     this->addWidget(sizeSpinBox);
     connect(sizeSpinBox, SIGNAL(valueChanged(int)), this, SLOT(setEraseSize(int)));
+
+    this->addSeparator();
+
+    // in Shape order
+    shapeComboBox = new QComboBox(this);
+    shapeComboBox->addItem("Round");
+    shapeComboBox->addItem("Square");
+    shapeComboBox->addItem("Soft");
+    shapeComboBox->setCurrentIndex(eraseShape);
+    this->addWidget(new QLabel("shape: ",this));
+    this->addWidget(shapeComboBox);
+    connect(shapeComboBox, SIGNAL(currentIndexChanged(int)), this, SLOT(setEraseShape(int)));
+}
+
+void EraseToolTweak::refresh()
+{
+    sizeSpinBox->setValue(eraseSize);
+    shapeComboBox->setCurrentIndex(eraseShape);
 }
 
 EraseToolFunction::EraseToolFunction(QWidget *parent)
@@ -149,16 +202,41 @@ EraseToolFunction::EraseToolFunction(QWidget *parent)
 
 //+++++++++++Marquee+Tool+++++++++++++++++++++++++++++++++++++++
 int MarqueeToolBase::selectionType;
+int MarqueeToolBase::selectionMode;
 
 MarqueeToolTweak::MarqueeToolTweak(QWidget *parent)
     :ToolTweak("MARQUEE TOOL", parent)
 {
-    QComboBox *selectionTypeBox = new QComboBox(this);
+    // in SelectionType order
+    selectionTypeBox = new QComboBox(this);
     selectionTypeBox->addItem("Rectangle");
-    //selectionTypeBox->addItem("Circle");
+    selectionTypeBox->addItem("Ellipse");
+    selectionTypeBox->addItem("Lasso");
+    selectionTypeBox->setCurrentIndex(selectionType);
     this->addWidget(selectionTypeBox);
 
     connect(selectionTypeBox, SIGNAL(currentIndexChanged(int)), this, SLOT(setSelectionType(int)));
+
+    this->addSeparator();
+
+    // in SelectionMask::Mode order; shift adds, alt subtracts and both
+    // intersect whatever this is
+    selectionModeBox = new QComboBox(this);
+    selectionModeBox->addItem("New");
+    selectionModeBox->addItem("Add");
+    selectionModeBox->addItem("Subtract");
+    selectionModeBox->addItem("Intersect");
+    selectionModeBox->setCurrentIndex(selectionMode);
+    this->addWidget(new QLabel("mode: ",this));
+    this->addWidget(selectionModeBox);
+
+    connect(selectionModeBox, SIGNAL(currentIndexChanged(int)), this, SLOT(setSelectionMode(int)));
+}
+
+void MarqueeToolTweak::refresh()
+{
+    selectionTypeBox->setCurrentIndex(selectionType);
+    selectionModeBox->setCurrentIndex(selectionMode);
 }
 
 MarqueeToolFunction::MarqueeToolFunction(QWidget *parent)
@@ -168,6 +246,154 @@ MarqueeToolFunction::MarqueeToolFunction(QWidget *parent)
 }
 
 
+//+++++++++++Fill+Tool+++++++++++++++++++++++++++++++++++++++++
+int FillToolBase::fillTolerance=32;
+bool FillToolBase::fillContiguous=true;
+
+FillToolTweak::FillToolTweak(QWidget *parent)
+    :ToolTweak("FILL TOOL", parent)
+{
+    // the most any channel may differ from the pixel clicked
+    toleranceSpinBox = new QSpinBox(this);
+    toleranceSpinBox->setRange(0,255);
+    toleranceSpinBox->setValue(fillTolerance);
+    this->addWidget(new QLabel("tolerance: ",this));
+    this->addWidget(toleranceSpinBox);
+    connect(toleranceSpinBox, SIGNAL(valueChanged(int)), this, SLOT(setTolerance(int)));
+
+    this->addSeparator();
+
+    contiguousCheckBox = new QCheckBox(this);
+    contiguousCheckBox->setText("Contiguous");
+    contiguousCheckBox->setChecked(fillContiguous);
+    this->addWidget(contiguousCheckBox);
+    connect(contiguousCheckBox, SIGNAL(toggled(bool)), this, SLOT(setContiguous(bool)));
+}
+
+void FillToolTweak::refresh()
+{
+    toleranceSpinBox->setValue(fillTolerance);
+    contiguousCheckBox->setChecked(fillContiguous);
+}
+
+FillToolFunction::FillToolFunction(QWidget *parent)
+    :QObject(parent)
+{
+    ;
+}
+
+
+//+++++++++++Magic+Wand+Tool+++++++++++++++++++++++++++++++++++
+int MagicWandToolBase::wandTolerance=32;
+bool MagicWandToolBase::wandContiguous=true;
+
+MagicWandToolTweak::MagicWandToolTweak(QWidget *parent)
+    :ToolTweak("MAGIC WAND TOOL", parent)
+{
+    toleranceSpinBox = new QSpinBox(this);
+    toleranceSpinBox->setRange(0,255);
+    toleranceSpinBox->setValue(wandTolerance);
+    this->addWidget(new QLabel("tolerance: ",this));
+    this->addWidget(toleranceSpinBox);
+    connect(toleranceSpinBox, SIGNAL(valueChanged(int)), this, SLOT(setTolerance(int)));
+
+    this->addSeparator();
+
+    contiguousCheckBox = new QCheckBox(this);
+    contiguousCheckBox->setText("Contiguous");
+    contiguousCheckBox->setChecked(wandContiguous);
+    this->addWidget(contiguousCheckBox);
+    connect(contiguousCheckBox, SIGNAL(toggled(bool)), this, SLOT(setContiguous(bool)));
+}
+
+void MagicWandToolTweak::refresh()
+{
+    toleranceSpinBox->setValue(wandTolerance);
+    contiguousCheckBox->setChecked(wandContiguous);
+}
+
+MagicWandToolFunction::MagicWandToolFunction(QWidget *parent)
+    :QObject(parent)
+{
+    ;
+}
+
+
+//+++++++++++Tool+Settings++++++++++++++++++++++++++++++++++++++
+ToolSettings ToolSettings::current()
+{
+    ToolSettings settings;
+    settings.brushSize = BrushToolBase::brushSize;
+    settings.antiAliasing = BrushToolBase::antiAliasing;
+    settings.brushHardness = BrushToolBase::brushHardness;
+    settings.brushOpacity = BrushToolBase::brushOpacity;
+    settings.brushFlow = BrushToolBase::brushFlow;
+    settings.brushSpacing = BrushToolBase::brushSpacing;
+    settings.eraseSize = EraseToolBase::eraseSize;
+    settings.eraseShape = EraseToolBase::eraseShape;
+    settings.selectionType = MarqueeToolBase::selectionType;
+    settings.selectionMode = MarqueeToolBase::selectionMode;
+    settings.fillTolerance = FillToolBase::fillTolerance;
+    settings.fillContiguous = FillToolBase::fillContiguous;
+    settings.wandTolerance = MagicWandToolBase::wandTolerance;
+    settings.wandContiguous = MagicWandToolBase::wandContiguous;
+    return settings;
+}
+
+void ToolSettings::apply() const
+{
+    // the ranges of the tweaks' widgets
+    BrushToolBase::brushSize = qBound(1, brushSize, 100);
+    BrushToolBase::antiAliasing = antiAliasing;
+    BrushToolBase::brushHardness = qBound(0, brushHardness, 100);
+    BrushToolBase::brushOpacity = qBound(1, brushOpacity, 100);
+    BrushToolBase::brushFlow = qBound(1, brushFlow, 100);
+    BrushToolBase::brushSpacing = qBound(1, brushSpacing, 100);
+    EraseToolBase::eraseSize = qBound(1, eraseSize, 100);
+    EraseToolBase::eraseShape = qBound(0, eraseShape, (int)EraseToolBase::Soft);
+    MarqueeToolBase::selectionType = qBound(0, selectionType, (int)MarqueeToolBase::Lasso);
+    MarqueeToolBase::selectionMode = qBound(0, selectionMode, 3);
+    FillToolBase::fillTolerance = qBound(0, fillTolerance, 255);
+    FillToolBase::fillContiguous = fillContiguous;
+    MagicWandToolBase::wandTolerance = qBound(0, wandTolerance, 255);
+    MagicWandToolBase::wandContiguous = wandContiguous;
+}
+
+QDataStream &operator<<(QDataStream &stream, const ToolSettings &settings)
+{
+    stream << (qint32) settings.brushSize << settings.antiAliasing
+           << (qint32) settings.brushHardness << (qint32) settings.brushOpacity
+           << (qint32) settings.brushFlow << (qint32) settings.brushSpacing
+           << (qint32) settings.eraseSize << (qint32) settings.eraseShape
+           << (qint32) settings.selectionType << (qint32) settings.selectionMode
+           << (qint32) settings.fillTolerance << settings.fillContiguous
+           << (qint32) settings.wandTolerance << settings.wandContiguous;
+    return stream;
+}
+
+QDataStream &operator>>(QDataStream &stream, ToolSettings &settings)
+{
+    qint32 brushSize, brushHardness, brushOpacity, brushFlow, brushSpacing;
+    qint32 eraseSize, eraseShape, selectionType, selectionMode, fillTolerance, wandTolerance;
+    stream >> brushSize >> settings.antiAliasing
+           >> brushHardness >> brushOpacity >> brushFlow >> brushSpacing
+           >> eraseSize >> eraseShape >> selectionType >> selectionMode
+           >> fillTolerance >> settings.fillContiguous >> wandTolerance >> settings.wandContiguous;
+    settings.brushSize = brushSize;
+    settings.brushHardness = brushHardness;
+    settings.brushOpacity = brushOpacity;
+    settings.brushFlow = brushFlow;
+    settings.brushSpacing = brushSpacing;
+    settings.eraseSize = eraseSize;
+    settings.eraseShape = eraseShape;
+    settings.selectionType = selectionType;
+    settings.selectionMode = selectionMode;
+    settings.fillTolerance = fillTolerance;
+    settings.wandTolerance = wandTolerance;
+    return stream;
+}
+
+
 //+++++++++++Color+Swatch+++++++++++++++++++++++++++++++++++++++
 //int ColorSwatchBase::colorBoxWidth=10;
 
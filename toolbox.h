@@ -6,6 +6,9 @@
 #include <QToolBar>
 #include <QList>
 #include <QSpinBox>
+#include <QCheckBox>
+#include <QComboBox>
+#include <QDataStream>
 #include <QDebug>
 
 class ToolType{
@@ -14,7 +17,9 @@ public:
         Brush=0,
         Erase=1,
         Marquee=2,
-        Pen=3
+        Pen=3,
+        Fill=4,
+        MagicWand=5
     };
 };
 
@@ -47,6 +52,9 @@ class ToolTweak:public QToolBar
 public:
     ToolTweak(const QString &title, QWidget *parent);
 
+    // shows the tool settings again, after a project restored them
+    virtual void refresh() {}
+
 };
 
 
@@ -54,9 +62,14 @@ public:
 class BrushToolBase
 {
 protected:
+    friend struct ToolSettings;
     static int brushSize;
-    static int lineType;
     static bool antiAliasing;
+    // percent, see BrushEngine
+    static int brushHardness;
+    static int brushOpacity;
+    static int brushFlow;
+    static int brushSpacing;
 };
 
 
@@ -67,11 +80,25 @@ class BrushToolTweak
     Q_OBJECT
 public:
     BrushToolTweak(QWidget *parent);
+    void refresh();
+
+private:
+    QSpinBox *sizeSpinBox;
+    QCheckBox *antiAliasingCheckBox;
+    QSpinBox *hardnessSpinBox;
+    QSpinBox *opacitySpinBox;
+    QSpinBox *flowSpinBox;
+    QSpinBox *spacingSpinBox;
+
+    QSpinBox *addPercentBox(const QString &label, int minimum, int value);
 
 private slots:
     void setBrushSize(int value){brushSize=value;}
-    void setLineType(int value){lineType=value;}
     void setAntiAliasing(bool value){antiAliasing=value;}
+    void setHardness(int value){brushHardness=value;}
+    void setOpacity(int value){brushOpacity=value;}
+    void setFlow(int value){brushFlow=value;}
+    void setSpacing(int value){brushSpacing=value;}
 };
 
 class BrushToolFunction
@@ -83,8 +110,11 @@ public:
     BrushToolFunction(QWidget *parent);
 
     int getBrushSize() const {return brushSize;}
-    int getLineType() const {return lineType;}
     bool getAntiAliasing() const {return antiAliasing;}
+    int getHardness() const {return brushHardness;}
+    int getOpacity() const {return brushOpacity;}
+    int getFlow() const {return brushFlow;}
+    int getSpacing() const {return brushSpacing;}
 
 };
 
@@ -92,7 +122,15 @@ public:
 //+++++++++++ERASE+TOOL+++++++++++++++++++++++++++++++++++++++
 class EraseToolBase
 {
+public:
+    enum Shape{
+        Round=0,
+        Square=1,
+        Soft=2
+    };
+
 protected:
+    friend struct ToolSettings;
     static int eraseSize;
     static int eraseShape;
 };
@@ -105,6 +143,11 @@ class EraseToolTweak
     Q_OBJECT
 public:
     EraseToolTweak(QWidget *parent);
+    void refresh();
+
+private:
+    QSpinBox *sizeSpinBox;
+    QComboBox *shapeComboBox;
 
 private slots:
     void setEraseSize(int value){eraseSize=value;}
@@ -122,7 +165,7 @@ public:
     EraseToolFunction(QWidget *parent);
 
     int getEraseSize()const {return eraseSize;}
-    bool getEraseShape()const {return eraseShape;}
+    int getEraseShape()const {return eraseShape;}
 
 };
 
@@ -130,8 +173,17 @@ public:
 //+++++++++++++Marquee+Tool+++++++++++++++++++++++++++++++++++++
 class MarqueeToolBase
 {
+public:
+    enum SelectionType{
+        Rectangle=0,
+        Ellipse=1,
+        Lasso=2
+    };
+
 protected:
+    friend struct ToolSettings;
     static int selectionType;
+    static int selectionMode;   // a SelectionMask::Mode
 };
 
 
@@ -142,9 +194,15 @@ class MarqueeToolTweak
     Q_OBJECT
 public:
     MarqueeToolTweak(QWidget *parent);
+    void refresh();
+
+private:
+    QComboBox *selectionTypeBox;
+    QComboBox *selectionModeBox;
 
 private slots:
-    void setSelectionType(int value){selectionType=value; qDebug()<<value;}
+    void setSelectionType(int value){selectionType=value;}
+    void setSelectionMode(int value){selectionMode=value;}
 
 };
 
@@ -157,10 +215,126 @@ public:
     MarqueeToolFunction(QWidget *parent);
 
     int getSelectionType() const {return selectionType;}
+    int getSelectionMode() const {return selectionMode;}
+
+};
+
+
+
+
+
+
+
+//+++++++++++++Fill+Tool+++++++++++++++++++++++++++++++++++++++
+// the bucket fill, see FloodFill
+class FillToolBase
+{
+protected:
+    friend struct ToolSettings;
+    static int fillTolerance;
+    static bool fillContiguous;
+};
+
+
+class FillToolTweak
+        :public ToolTweak,
+        protected FillToolBase
+{
+    Q_OBJECT
+public:
+    FillToolTweak(QWidget *parent);
+    void refresh();
+
+private:
+    QSpinBox *toleranceSpinBox;
+    QCheckBox *contiguousCheckBox;
+
+private slots:
+    void setTolerance(int value){fillTolerance=value;}
+    void setContiguous(bool value){fillContiguous=value;}
+};
+
+class FillToolFunction
+        :public QObject,
+        protected FillToolBase
+{
+    Q_OBJECT
+public:
+    FillToolFunction(QWidget *parent);
+
+    int getTolerance() const {return fillTolerance;}
+    bool getContiguous() const {return fillContiguous;}
+
+};
+
+
+//+++++++++++++Magic+Wand+Tool+++++++++++++++++++++++++++++++++
+// selects what the bucket would fill, combined as MarqueeToolBase's mode
+class MagicWandToolBase
+{
+protected:
+    friend struct ToolSettings;
+    static int wandTolerance;
+    static bool wandContiguous;
+};
+
+
+class MagicWandToolTweak
+        :public ToolTweak,
+        protected MagicWandToolBase
+{
+    Q_OBJECT
+public:
+    MagicWandToolTweak(QWidget *parent);
+    void refresh();
+
+private:
+    QSpinBox *toleranceSpinBox;
+    QCheckBox *contiguousCheckBox;
+
+private slots:
+    void setTolerance(int value){wandTolerance=value;}
+    void setContiguous(bool value){wandContiguous=value;}
+};
+
+class MagicWandToolFunction
+        :public QObject,
+        protected MagicWandToolBase
+{
+    Q_OBJECT
+public:
+    MagicWandToolFunction(QWidget *parent);
+
+    int getTolerance() const {return wandTolerance;}
+    bool getContiguous() const {return wandContiguous;}
 
 };
 
 
+//+++++++++++++Tool+Settings++++++++++++++++++++++++++++++++++++
+// a copy of every tool panel setting, as a project keeps them
+struct ToolSettings
+{
+    int brushSize;
+    bool antiAliasing;
+    int brushHardness, brushOpacity, brushFlow, brushSpacing;
+    int eraseSize, eraseShape;
+    int selectionType, selectionMode;
+    int fillTolerance;
+    bool fillContiguous;
+    int wandTolerance;
+    bool wandContiguous;
+
+    static ToolSettings current();
+    // sets the panel's settings, clamped to what it offers; the tweaks
+    // show them after refresh()
+    void apply() const;
+};
+
+QDataStream &operator<<(QDataStream &stream, const ToolSettings &settings);
+QDataStream &operator>>(QDataStream &stream, ToolSettings &settings);
+
+
 
 
 
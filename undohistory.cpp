@@ -0,0 +1,212 @@
+﻿#include <QtConcurrent>
+#include <QSettings>
+#include <QDebug>
+
+#include "undohistory.h"
+#include "opencvprocess.h"
+
+static QByteArray compressTile(const Tile *tile)
+{
+    // the fastest level, strokes end on the GUI thread
+    return tile->pixels().compressed(1);
+}
+
+
+UndoTileStore::UndoTileStore()
+    :spillEnd(0), spillLive(0), memoryBytes(0), lastHandle(0)
+{
+    budget = qint64(savedBudget()) << 20;
+}
+
+void UndoTileStore::setMemoryBudget(qint64 bytes)
+{
+    budget = bytes;
+    spill();
+}
+
+qint64 UndoTileStore::add(const QByteArray &blob)
+{
+    inMemory.insert(++lastHandle, blob);
+    memoryBytes += blob.size();
+    spill();
+    return lastHandle;
+}
+
+QByteArray UndoTileStore::take(qint64 handle)
+{
+    QMap<qint64, QByteArray>::iterator it = inMemory.find(handle);
+    if(it != inMemory.end())
+    {
+        QByteArray blob = it.value();
+        memoryBytes -= blob.size();
+        inMemory.erase(it);
+        return blob;
+    }
+
+    if(!onDisk.contains(handle)) return QByteArray();
+    QPair<qint64, int> location = onDisk.take(handle);
+    spillLive -= location.second;
+    QByteArray blob;
+    if(spillFile.seek(location.first))
+        blob = spillFile.read(location.second);
+    if(blob.size() != location.second)
+        qWarning() << "Undo: unable to read back" << spillFile.fileName();
+    trimSpillFile();
+    return blob;
+}
+
+void UndoTileStore::remove(qint64 handle)
+{
+    QMap<qint64, QByteArray>::iterator it = inMemory.find(handle);
+    if(it != inMemory.end())
+    {
+        memoryBytes -= it.value().size();
+        inMemory.erase(it);
+    }
+    else if(onDisk.contains(handle))
+    {
+        spillLive -= onDisk.take(handle).second;
+        trimSpillFile();
+    }
+}
+
+void UndoTileStore::trimSpillFile()
+{
+    // start over once nothing in it is used
+    if(onDisk.isEmpty() && spillEnd > 0)
+    {
+        spillFile.resize(0);
+        spillEnd = 0;
+        return;
+    }
+    if(spillEnd - spillLive <= spillLive + (64 << 20)) return;
+
+    // mostly dead bytes: move the live blobs down in offset order, each
+    // only ever over space already read
+    QMap<qint64, qint64> byOffset;
+    for(QHash<qint64, QPair<qint64, int> >::const_iterator it = onDisk.constBegin();
+        it != onDisk.constEnd(); ++it)
+        byOffset.insert(it.value().first, it.key());
+
+    qint64 end = 0;
+    for(QMap<qint64, qint64>::const_iterator it = byOffset.constBegin(); it != byOffset.constEnd(); ++it)
+    {
+        QPair<qint64, int> &location = onDisk[it.value()];
+        if(location.first != end)
+        {
+            QByteArray blob;
+            if(spillFile.seek(location.first))
+                blob = spillFile.read(location.second);
+            if(blob.size() != location.second || !spillFile.seek(end)
+                    || spillFile.write(blob) != blob.size())
+            {
+                // the blobs moved so far are valid, the rest stay where they
+                // were; only one the failed write overlapped may be lost
+                qWarning() << "Undo: unable to compact" << spillFile.fileName();
+                return;
+            }
+            location.first = end;
+        }
+        end += location.second;
+    }
+    spillFile.resize(end);
+    spillEnd = end;
+}
+
+void UndoTileStore::spill()
+{
+    if(memoryBytes <= budget || inMemory.isEmpty()) return;
+    if(!spillFile.isOpen() && !spillFile.open())
+    {
+        qWarning() << "Undo: unable to create a spill file, keeping the history in memory";
+        return;
+    }
+
+    // oldest first, those are the least likely to be undone
+    while(memoryBytes > budget && !inMemory.isEmpty())
+    {
+        QMap<qint64, QByteArray>::iterator it = inMemory.begin();
+        if(!spillFile.seek(spillEnd) || spillFile.write(it.value()) != it.value().size())
+        {
+            qWarning() << "Undo: unable to write" << spillFile.fileName();
+            return;
+        }
+        onDisk.insert(it.key(), qMakePair(spillEnd, it.value().size()));
+        spillEnd += it.value().size();
+        spillLive += it.value().size();
+        memoryBytes -= it.value().size();
+        inMemory.erase(it);
+    }
+}
+
+int UndoTileStore::savedBudget()
+{
+    return QSettings().value("undo/memoryBudget", 256).toInt();
+}
+
+void UndoTileStore::saveBudget(int megabytes)
+{
+    QSettings().setValue("undo/memoryBudget", megabytes);
+}
+
+
+TileDeltaCommand::TileDeltaCommand(OpencvProcess *process, UndoTileStore *store, int layerId,
+                                   const TiledImage &before, const QVector<int> &tiles,
+                                   const QString &text)
+    :QUndoCommand(text), process(process), store(store), layerId(layerId), tiles(tiles),
+      isFirstRedo(true)
+{
+    QList<const Tile *> beforeTiles;
+    foreach(int index, tiles)
+        beforeTiles.append(&before.tileData(index));
+    QList<QByteArray> blobs = QtConcurrent::blockingMapped<QList<QByteArray> >(beforeTiles, compressTile);
+    foreach(const QByteArray &blob, blobs)
+        handles.append(store->add(blob));
+}
+
+TileDeltaCommand::~TileDeltaCommand()
+{
+    foreach(qint64 handle, handles)
+        store->remove(handle);
+}
+
+void TileDeltaCommand::undo()
+{
+    swapTiles();
+}
+
+void TileDeltaCommand::redo()
+{
+    // QUndoStack::push() redoes the command, but the stroke is drawn already
+    if(isFirstRedo)
+    {
+        isFirstRedo = false;
+        return;
+    }
+    swapTiles();
+}
+
+void TileDeltaCommand::swapTiles()
+{
+    int imageNum = process->layerStack.indexOf(layerId);
+    if(imageNum < 0) return;
+    TiledImage &image = process->layerStack[imageNum].pixels();
+
+    // what is on the layer now is what the next undo or redo brings back
+    QList<const Tile *> currentTiles;
+    foreach(int index, tiles)
+        currentTiles.append(&image.tileData(index));
+    QList<QByteArray> blobs = QtConcurrent::blockingMapped<QList<QByteArray> >(currentTiles, compressTile);
+
+    QRect changedRect;
+    for(int i = 0; i < tiles.size(); i++)
+    {
+        QByteArray stored = store->take(handles.at(i));
+        if(!image.tile(tiles.at(i)).uncompress((const uchar *)stored.constData(), stored.size()))
+            qWarning() << "Undo: tile" << tiles.at(i) << "of" << process->layerStack.at(imageNum).name << "is lost";
+        handles[i] = store->add(blobs.at(i));
+        changedRect |= image.tileRect(tiles.at(i));
+    }
+
+    process->notifyChanged(imageNum, changedRect);
+}
@@ -0,0 +1,85 @@
+﻿#ifndef UNDOHISTORY_H
+#define UNDOHISTORY_H
+
+#include <QUndoCommand>
+#include <QByteArray>
+#include <QVector>
+#include <QMap>
+#include <QHash>
+#include <QPair>
+#include <QTemporaryFile>
+
+#include "tiledimage.h"
+
+class OpencvProcess;
+
+/* The compressed tiles of the undo history. The newest blobs stay in
+ * memory up to memoryBudget() bytes, older ones are moved out to a
+ * temporary file, so a long history costs disk rather than RAM. Blobs read
+ * back from it leave dead bytes behind; once those outweigh the live ones
+ * the file is compacted. Handles grow with every add(), a smaller handle
+ * is an older blob.
+ */
+class UndoTileStore
+{
+public:
+    UndoTileStore();
+
+    qint64 memoryBudget() const {return budget;}
+    void setMemoryBudget(qint64 bytes);
+    qint64 memoryUsed() const {return memoryBytes;}
+
+    qint64 add(const QByteArray &blob);
+    // returns the blob and forgets it
+    QByteArray take(qint64 handle);
+    void remove(qint64 handle);
+
+    // the budget in MB from the settings, "undo/memoryBudget"
+    static int savedBudget();
+    static void saveBudget(int megabytes);
+
+private:
+    Q_DISABLE_COPY(UndoTileStore)
+
+    QMap<qint64, QByteArray> inMemory;
+    QHash<qint64, QPair<qint64, int> > onDisk;  // offset, length in spillFile
+    QTemporaryFile spillFile;
+    qint64 spillEnd;
+    qint64 spillLive;       // bytes of spillFile still in onDisk
+    qint64 memoryBytes;
+    qint64 budget;
+    qint64 lastHandle;
+
+    void spill();
+    void trimSpillFile();
+};
+
+
+/* One stroke, as the tiles it changed. The command holds the other state
+ * of those tiles: the ones from before the stroke until it is undone,
+ * then the ones it drew until it is redone. The layer is found by id, if
+ * it was deleted since the command does nothing.
+ */
+class TileDeltaCommand : public QUndoCommand
+{
+public:
+    // before is a snapshot of the layer's pixels() from the start of the stroke
+    TileDeltaCommand(OpencvProcess *process, UndoTileStore *store, int layerId,
+                     const TiledImage &before, const QVector<int> &tiles, const QString &text);
+    ~TileDeltaCommand();
+
+    void undo();
+    void redo();
+
+private:
+    OpencvProcess *process;
+    UndoTileStore *store;
+    int layerId;
+    QVector<int> tiles;
+    QVector<qint64> handles;
+    bool isFirstRedo;       // the stroke is already on the layer
+
+    void swapTiles();
+};
+
+#endif // UNDOHISTORY_H
@@ -0,0 +1,150 @@
+﻿#include <QtConcurrent>
+
+#include "windowlevel.h"
+#include "pixelkernels.h"
+
+struct ScanJob
+{
+    const PixelBuffer *pixels;
+    double mini, maxi;
+};
+
+static void scanTile(ScanJob &job)
+{
+    minMaxLoc(job.pixels->mat(), &job.mini, &job.maxi);
+}
+
+struct RenderJob
+{
+    const WindowLevel *window;
+    const PixelBuffer *native;
+    PixelBuffer *display;
+};
+
+static void renderJob(RenderJob &job)
+{
+    job.window->renderTile(*job.native, job.display);
+}
+
+
+WindowLevel::WindowLevel()
+    :sampleType(-1), windowLow(0), windowHigh(1), fittedMin(0), fittedMax(1)
+{
+    ;
+}
+
+WindowLevel::WindowLevel(int type)
+    :sampleType(type), windowLow(0), windowHigh(1), fittedMin(0), fittedMax(1)
+{
+    setWindow(0, type == CV_16UC1 ? 65535 : 1);
+}
+
+bool WindowLevel::isNativeType(int type)
+{
+    return type == CV_16UC1 || type == CV_32FC1;
+}
+
+void WindowLevel::setWindow(double low, double high)
+{
+    fittedMin = low;
+    fittedMax = high;
+    // a flat image still needs a non empty window
+    if(!(high > low)) high = low + 1;
+    windowLow = low;
+    windowHigh = high;
+
+    if(sampleType != CV_16UC1) return;
+    lut.resize(65536);
+    quint32 *entry = lut.data();
+    double scale = 255 / (high - low);
+    for(int v = 0; v < 65536; v++)
+    {
+        // truncated like the float kernel
+        int grey = (int) qBound(0.0, (v - low) * scale, 255.0);
+        entry[v] = 0xff000000u | quint32(grey) * 0x010101u;
+    }
+}
+
+void WindowLevel::invalidate(const QVector<int> &tiles)
+{
+    foreach(int index, tiles)
+        if(index < isScanned.size()) isScanned[index] = false;
+}
+
+bool WindowLevel::fitToRange(const TiledImage &native)
+{
+    if(native.tileCount() == 0) return false;
+    if(isScanned.size() != native.tileCount())
+    {
+        isScanned.fill(false, native.tileCount());
+        tileMin.resize(native.tileCount());
+        tileMax.resize(native.tileCount());
+    }
+
+    QVector<ScanJob> jobs;
+    for(int i = 0; i < native.tileCount(); i++)
+    {
+        if(isScanned.at(i)) continue;
+        ScanJob job = {&native.constTile(i), 0, 0};
+        jobs.append(job);
+    }
+    QtConcurrent::blockingMap(jobs, scanTile);
+
+    int next = 0;
+    double mini = 0, maxi = 0;
+    for(int i = 0; i < native.tileCount(); i++)
+    {
+        if(!isScanned.at(i))
+        {
+            tileMin[i] = jobs.at(next).mini;
+            tileMax[i] = jobs.at(next).maxi;
+            isScanned[i] = true;
+            next++;
+        }
+        mini = i == 0 ? tileMin.at(i) : qMin(mini, tileMin.at(i));
+        maxi = i == 0 ? tileMax.at(i) : qMax(maxi, tileMax.at(i));
+    }
+
+    if(mini == fittedMin && maxi == fittedMax) return false;
+    setWindow(mini, maxi);
+    return true;
+}
+
+double WindowLevel::sampleFor(int grey) const
+{
+    double sample = windowLow + grey * (windowHigh - windowLow) / 255;
+    return sampleType == CV_16UC1 ? qBound(0, qRound(sample), 65535) : sample;
+}
+
+void WindowLevel::render(const TiledImage &native, TiledImage *display, const QVector<int> &tiles) const
+{
+    // tile() detaches, so it is called here rather than on the pool
+    QVector<RenderJob> jobs;
+    foreach(int index, tiles)
+    {
+        RenderJob job = {this, &native.constTile(index), &display->tile(index)};
+        jobs.append(job);
+    }
+    QtConcurrent::blockingMap(jobs, renderJob);
+}
+
+void WindowLevel::renderTile(const PixelBuffer &native, PixelBuffer *display) const
+{
+    Mat samples = native.mat();
+    Mat pixels = display->mat();
+    const PixelKernels &kernels = PixelKernels::best();
+
+    for(int y = 0; y < samples.rows; y++)
+    {
+        if(sampleType == CV_16UC1)
+        {
+            const quint16 *in = samples.ptr<quint16>(y);
+            quint32 *out = pixels.ptr<quint32>(y);
+            const quint32 *table = lut.constData();
+            for(int x = 0; x < samples.cols; x++)
+                out[x] = table[in[x]];
+        }
+        else
+            kernels.gray32FToBGRA(samples.ptr(y), pixels.ptr(y), samples.cols, windowLow, windowHigh);
+    }
+}
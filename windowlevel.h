@@ -0,0 +1,51 @@
+﻿#ifndef WINDOWLEVEL_H
+#define WINDOWLEVEL_H
+
+#include <QVector>
+
+#include "tiledimage.h"
+
+/* How a layer that keeps its native depth, 16-bit or float grey, is shown:
+ * samples at low() are black, at high() white, the rest is clamped.
+ * 16-bit samples go through a LUT built when the window is set, float
+ * samples through the SIMD scaled kernel.
+ *
+ * The sample range is kept per tile. invalidate() forgets the tiles an
+ * edit touched and fitToRange() rescans only those, so following the
+ * data does not cost a pass over the whole layer.
+ */
+class WindowLevel
+{
+public:
+    WindowLevel();
+    explicit WindowLevel(int type);
+
+    // the layouts layers keep natively, CV_16UC1 and CV_32FC1
+    static bool isNativeType(int type);
+    bool isNull() const {return sampleType < 0;}
+
+    double low() const {return windowLow;}
+    double high() const {return windowHigh;}
+    void setWindow(double low, double high);
+
+    void invalidate(const QVector<int> &tiles);
+    // sets the window to the range of the samples, true if that moved it
+    bool fitToRange(const TiledImage &native);
+
+    // the sample a display grey level stands for, what the tools paint with
+    double sampleFor(int grey) const;
+
+    // renders tiles of native into the same tiles of display, in parallel
+    void render(const TiledImage &native, TiledImage *display, const QVector<int> &tiles) const;
+    void renderTile(const PixelBuffer &native, PixelBuffer *display) const;
+
+private:
+    int sampleType;
+    double windowLow, windowHigh;
+    double fittedMin, fittedMax;    // the range the window was last set for
+    QVector<quint32> lut;           // 16-bit samples to opaque BGRA, shared by copies
+    QVector<double> tileMin, tileMax;
+    QVector<bool> isScanned;
+};
+
+#endif // WINDOWLEVEL_H